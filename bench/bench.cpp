@@ -0,0 +1,1316 @@
+// dcli のベンチマーク: ローカルのモック Discord サーバーを立て、dcli の送信・取得経路を
+// 実際のプロセスとして動かして msgs/sec, p50/p99 レイテンシ, メッセージあたりの
+// アロケーション回数, ピーク RSS を JSON で出力する。--follow は代替 Gateway で検証する。
+//
+//   dcli-bench --dcli ./dcli --alloc-lib ./bench/alloc_count.so [--output FILE]
+//   dcli-bench --serve [--port N] [--latency-ms N] [--limit N] [--window-ms N] [--seed N]
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <map>
+#include <algorithm>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+#include <filesystem>
+#include <sstream>
+#include <iomanip>
+#include <iterator>
+#include <cmath>
+#include <cstring>
+#include <cstdlib>
+#include <csignal>
+#include <getopt.h>
+#include <nlohmann/json.hpp>
+#include <zlib.h>
+#include <openssl/evp.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+using json = nlohmann::json;
+using Clock = std::chrono::steady_clock;
+
+const uint64_t DISCORD_EPOCH_MS = 1420070400000ULL;
+const std::string BENCH_CHANNEL = "111";
+
+uint64_t now_ms() {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+// Imitates the parts of the Discord REST API that dcli uses:
+// POST/GET /channels/{id}/messages (with after/before/limit), GET /gateway (the
+// MockGateway's URL) and
+// POST /webhooks/{id}/{token} (a webhook posts into the channel with its ID),
+// GET /users/@me/guilds, /guilds/{id} and /guilds/{id}/channels (generated guilds),
+// plus rate limit buckets per route and token that answer 429 when exhausted.
+class MockServer {
+public:
+    struct Settings {
+        int latency_ms = 0;  // 各レスポンスの前に待つ時間
+        int limit = 0;       // 0 ならレート制限なし
+        int window_ms = 1000;
+        int guilds = 0;          // /users/@me/guilds に返すギルド数
+        int guild_channels = 0;  // ギルドあたりのチャンネル数
+    };
+
+    using ArrivalCallback = std::function<void(const std::string& content, Clock::time_point at)>;
+
+    ~MockServer() { stop(); }
+
+    int start(int port) {
+        listen_fd_ = socket(AF_INET, SOCK_STREAM, 0);
+        int one = 1;
+        setsockopt(listen_fd_, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        sockaddr_in addr{};
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(port);
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        if (bind(listen_fd_, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0 || listen(listen_fd_, 128) < 0) {
+            throw std::runtime_error(std::string("Mock server cannot listen: ") + strerror(errno));
+        }
+        socklen_t size = sizeof(addr);
+        getsockname(listen_fd_, reinterpret_cast<sockaddr*>(&addr), &size);
+        port_ = ntohs(addr.sin_port);
+        acceptor_ = std::thread([this]() { accept_loop(); });
+        return port_;
+    }
+
+    void stop() {
+        if (listen_fd_ < 0) return;
+        shutdown(listen_fd_, SHUT_RDWR);
+        close(listen_fd_);
+        listen_fd_ = -1;
+        if (acceptor_.joinable()) acceptor_.join();
+    }
+
+    std::string api_base() const { return "http://127.0.0.1:" + std::to_string(port_) + "/api/v10"; }
+
+    void configure(const Settings& settings) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        settings_ = settings;
+        buckets_.clear();
+    }
+
+    // URL returned by GET /gateway (the stand-in Gateway)
+    void set_gateway_url(const std::string& url) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        gateway_url_ = url;
+    }
+
+    void on_arrival(ArrivalCallback callback) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        arrival_ = std::move(callback);
+    }
+
+    // Replace a channel's history with `count` messages, one per minute up to now
+    void seed(const std::string& channel_id, size_t count) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto& messages = channels_[channel_id];
+        messages.clear();
+        uint64_t now = now_ms();
+        for (size_t i = 0; i < count; ++i) {
+            uint64_t ms = now - (count - i) * 60000;
+            messages.push_back({make_id(ms), "seed message " + std::to_string(i) + " with some ordinary text in it",
+                                "user" + std::to_string(i % 7)});
+        }
+    }
+
+    void clear() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        channels_.clear();
+        nonces_.clear();
+        buckets_.clear();
+        rate_limited_ = 0;
+    }
+
+    size_t rate_limited() const { return rate_limited_; }
+
+    // Contents and authors posted to a channel, oldest first
+    std::vector<std::pair<std::string, std::string>> posted(const std::string& channel_id) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        std::vector<std::pair<std::string, std::string>> result;
+        for (const auto& message : channels_[channel_id]) result.emplace_back(message.content, message.author);
+        return result;
+    }
+
+private:
+    struct Message {
+        uint64_t id;
+        std::string content;
+        std::string author;
+    };
+
+    struct Bucket {
+        Clock::time_point window_start;
+        int used = 0;
+    };
+
+    struct Response {
+        int status = 200;
+        std::string body;
+        std::vector<std::pair<std::string, std::string>> headers;
+    };
+
+    uint64_t make_id(uint64_t ms) { return ((ms - DISCORD_EPOCH_MS) << 22) | (sequence_++ & 0x3fffff); }
+
+    void accept_loop() {
+        for (;;) {
+            int fd = accept(listen_fd_, nullptr, nullptr);
+            if (fd < 0) {
+                if (errno == EINTR) continue;
+                return;
+            }
+            int one = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+            std::thread([this, fd]() { serve(fd); }).detach();
+        }
+    }
+
+    // One keep-alive HTTP/1.1 connection
+    void serve(int fd) {
+        std::string buffer;
+        char chunk[65536];
+        for (;;) {
+            size_t header_end;
+            while ((header_end = buffer.find("\r\n\r\n")) == std::string::npos) {
+                ssize_t n = recv(fd, chunk, sizeof(chunk), 0);
+                if (n <= 0) {
+                    close(fd);
+                    return;
+                }
+                buffer.append(chunk, n);
+            }
+            std::string head = buffer.substr(0, header_end);
+            std::istringstream lines(head);
+            std::string method, target, line;
+            lines >> method >> target;
+            std::getline(lines, line);
+            size_t content_length = 0;
+            bool keep_alive = true;
+            bool gzip = false;
+            std::string content_type, authorization;
+            while (std::getline(lines, line)) {
+                std::string lower = line;
+                std::transform(lower.begin(), lower.end(), lower.begin(), [](unsigned char c) { return std::tolower(c); });
+                if (lower.rfind("content-length:", 0) == 0) content_length = std::stoul(lower.substr(15));
+                if (lower.rfind("connection:", 0) == 0 && lower.find("close") != std::string::npos) keep_alive = false;
+                if (lower.rfind("content-type:", 0) == 0) content_type = line.substr(line.find(':') + 1);
+                if (lower.rfind("authorization:", 0) == 0) authorization = line.substr(line.find(':') + 2);
+                if (lower.rfind("accept-encoding:", 0) == 0 && lower.find("gzip") != std::string::npos) gzip = true;
+            }
+            while (buffer.size() < header_end + 4 + content_length) {
+                ssize_t n = recv(fd, chunk, sizeof(chunk), 0);
+                if (n <= 0) {
+                    close(fd);
+                    return;
+                }
+                buffer.append(chunk, n);
+            }
+            std::string body = buffer.substr(header_end + 4, content_length);
+            buffer.erase(0, header_end + 4 + content_length);
+
+            while (!authorization.empty() && authorization.back() == '\r') authorization.pop_back();
+            Response response = handle(method, target, content_type, authorization, body);
+            // Discord と同様に大きめのレスポンスは gzip で返す
+            if (gzip && response.body.size() >= 1024) {
+                response.body = gzip_compress(response.body);
+                response.headers.emplace_back("Content-Encoding", "gzip");
+            }
+            std::string out = "HTTP/1.1 " + std::to_string(response.status) + (response.status == 200 ? " OK" : " Error") + "\r\n"
+                              "Content-Type: application/json\r\n"
+                              "Content-Length: " + std::to_string(response.body.size()) + "\r\n";
+            for (const auto& [name, value] : response.headers) out += name + ": " + value + "\r\n";
+            out += "\r\n" + response.body;
+            if (send(fd, out.data(), out.size(), MSG_NOSIGNAL) < 0 || !keep_alive) {
+                close(fd);
+                return;
+            }
+        }
+    }
+
+    Response handle(const std::string& method, const std::string& target, const std::string& content_type,
+                    const std::string& authorization, const std::string& body) {
+        Settings settings;
+        ArrivalCallback arrival;
+        std::string gateway_url;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            settings = settings_;
+            arrival = arrival_;
+            gateway_url = gateway_url_;
+        }
+        auto arrived = Clock::now();
+        if (settings.latency_ms > 0) std::this_thread::sleep_for(std::chrono::milliseconds(settings.latency_ms));
+
+        std::string path = target.substr(0, target.find('?'));
+        std::map<std::string, std::string> query;
+        if (target.find('?') != std::string::npos) {
+            std::istringstream params(target.substr(target.find('?') + 1));
+            std::string param;
+            while (std::getline(params, param, '&')) {
+                size_t eq = param.find('=');
+                if (eq != std::string::npos) query[param.substr(0, eq)] = param.substr(eq + 1);
+            }
+        }
+
+        Response response;
+        if (path == "/api/v10/gateway") {
+            response.body = json{{"url", gateway_url}}.dump();
+            return response;
+        }
+        if (path == "/api/v10/users/@me/guilds" || path.rfind("/api/v10/guilds/", 0) == 0) {
+            return handle_guilds(path, query, settings);
+        }
+        const std::string prefix = "/api/v10/channels/";
+        const std::string suffix = "/messages";
+        const std::string webhooks = "/api/v10/webhooks/";
+        std::string channel_id, bucket_key, author = "dcli-bench";
+        if (path.rfind(webhooks, 0) == 0 && method == "POST" && path.find('/', webhooks.size()) != std::string::npos) {
+            channel_id = path.substr(webhooks.size(), path.find('/', webhooks.size()) - webhooks.size());
+            bucket_key = "webhook:" + path.substr(webhooks.size());
+            author = "webhook-" + channel_id;
+        } else if (path.rfind(prefix, 0) == 0 && path.size() > prefix.size() + suffix.size() &&
+                   path.compare(path.size() - suffix.size(), suffix.size(), suffix) == 0) {
+            channel_id = path.substr(prefix.size(), path.size() - prefix.size() - suffix.size());
+            bucket_key = method + ":" + channel_id + ":" + authorization;
+            if (!authorization.empty()) author = authorization;
+        } else {
+            response.status = 404;
+            response.body = R"({"message":"404: Not Found","code":0})";
+            return response;
+        }
+
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (!take_token(bucket_key, settings, response)) return response;
+
+        if (method == "POST") {
+            std::string content, nonce;
+            json attachments = json::array();
+            try {
+                if (content_type.find("multipart/form-data") != std::string::npos) {
+                    content = parse_multipart(content_type, body, attachments);
+                } else {
+                    json payload = json::parse(body);
+                    content = payload.value("content", "");
+                    if (payload.value("enforce_nonce", false)) nonce = payload.value("nonce", "");
+                }
+            } catch (const std::exception&) {
+                response.status = 400;
+                response.body = R"({"message":"Invalid Form Body","code":50035})";
+                return response;
+            }
+            // enforce_nonce: Discord と同様に同じ nonce なら既存のメッセージを返して投稿しない
+            if (!nonce.empty()) {
+                auto seen = nonces_.find(channel_id + ":" + nonce);
+                if (seen != nonces_.end()) {
+                    response.body = to_json(seen->second, channel_id).dump();
+                    return response;
+                }
+            }
+            Message message{make_id(now_ms()), content, author};
+            channels_[channel_id].push_back(message);
+            if (!nonce.empty()) nonces_.emplace(channel_id + ":" + nonce, message);
+            json created = to_json(message, channel_id);
+            created["attachments"] = attachments;
+            response.body = created.dump();
+            if (arrival) arrival(content, arrived);
+            return response;
+        }
+
+        // Discord と同様に新しい順で返す
+        const auto& messages = channels_[channel_id];
+        size_t limit = query.count("limit") ? std::min<size_t>(100, std::stoul(query["limit"])) : 50;
+        size_t begin = 0, end = messages.size();
+        auto by_id = [](const Message& m, uint64_t id) { return m.id < id; };
+        if (query.count("after")) {
+            begin = std::lower_bound(messages.begin(), messages.end(), std::stoull(query["after"]) + 1, by_id) - messages.begin();
+            end = std::min(end, begin + limit);
+        } else {
+            if (query.count("before")) {
+                end = std::lower_bound(messages.begin(), messages.end(), std::stoull(query["before"]), by_id) - messages.begin();
+            }
+            begin = end > limit ? end - limit : 0;
+        }
+        json page = json::array();
+        for (size_t i = end; i > begin; --i) page.push_back(to_json(messages[i - 1], channel_id));
+        response.body = page.dump();
+        return response;
+    }
+
+    // Generated guilds 900001.. named guild-N, each with text channels (every
+    // tenth one a voice channel) named after a topic and a number
+    Response handle_guilds(const std::string& path, std::map<std::string, std::string>& query, const Settings& settings) {
+        static const char* TOPICS[] = {"general", "deploys", "alerts", "random", "builds", "support", "release", "ops"};
+        const uint64_t first_guild = 900001;
+        Response response;
+        auto guild_json = [](uint64_t id) { return json{{"id", std::to_string(id)}, {"name", "guild-" + std::to_string(id - 900000)}}; };
+        if (path == "/api/v10/users/@me/guilds") {
+            uint64_t after = query.count("after") ? std::stoull(query["after"]) : 0;
+            size_t limit = query.count("limit") ? std::min<size_t>(200, std::stoul(query["limit"])) : 200;
+            json page = json::array();
+            for (uint64_t id = std::max(first_guild, after + 1); id < first_guild + settings.guilds && page.size() < limit; ++id) {
+                page.push_back(guild_json(id));
+            }
+            response.body = page.dump();
+            return response;
+        }
+        std::string rest = path.substr(std::string("/api/v10/guilds/").size());
+        uint64_t guild = std::strtoull(rest.c_str(), nullptr, 10);
+        if (guild < first_guild || guild >= first_guild + settings.guilds) {
+            response.status = 404;
+            response.body = R"({"message":"Unknown Guild","code":10004})";
+        } else if (rest.find("/channels") == std::string::npos) {
+            response.body = guild_json(guild).dump();
+        } else {
+            json channels = json::array();
+            for (int c = 0; c < settings.guild_channels; ++c) {
+                channels.push_back({{"id", std::to_string(guild * 100000 + c)},
+                                    {"type", c % 10 == 9 ? 2 : 0},
+                                    {"name", std::string(TOPICS[c % 8]) + "-" + std::to_string(c / 8)}});
+            }
+            response.body = channels.dump();
+        }
+        return response;
+    }
+
+    // Count the request against its bucket; fills in a 429 when the bucket is empty
+    bool take_token(const std::string& key, const Settings& settings, Response& response) {
+        if (settings.limit <= 0) return true;
+        auto now = Clock::now();
+        Bucket& bucket = buckets_[key];
+        auto window = std::chrono::milliseconds(settings.window_ms);
+        if (now - bucket.window_start >= window) {
+            bucket.window_start = now;
+            bucket.used = 0;
+        }
+        double reset_after = std::chrono::duration<double>(bucket.window_start + window - now).count();
+        std::ostringstream reset;
+        reset << std::fixed << std::setprecision(3) << reset_after;
+        response.headers = {{"X-RateLimit-Bucket", key.substr(0, key.find(':'))},
+                            {"X-RateLimit-Limit", std::to_string(settings.limit)},
+                            {"X-RateLimit-Reset-After", reset.str()}};
+        if (bucket.used >= settings.limit) {
+            ++rate_limited_;
+            response.status = 429;
+            response.headers.push_back({"X-RateLimit-Remaining", "0"});
+            response.headers.push_back({"Retry-After", reset.str()});
+            response.body = R"({"message":"You are being rate limited.","retry_after":)" + reset.str() + R"(,"global":false})";
+            return false;
+        }
+        ++bucket.used;
+        response.headers.push_back({"X-RateLimit-Remaining", std::to_string(settings.limit - bucket.used)});
+        return true;
+    }
+
+    // Attachment upload: returns payload_json's content and lists the file parts
+    static std::string parse_multipart(const std::string& content_type, const std::string& body, json& attachments) {
+        size_t at = content_type.find("boundary=");
+        if (at == std::string::npos) throw std::runtime_error("no boundary");
+        std::string boundary = "--" + content_type.substr(at + 9);
+        while (!boundary.empty() && (boundary.back() == '\r' || boundary.back() == ' ')) boundary.pop_back();
+        std::string content;
+        size_t pos = body.find(boundary);
+        while (pos != std::string::npos) {
+            size_t headers_start = pos + boundary.size() + 2;
+            size_t headers_end = body.find("\r\n\r\n", headers_start);
+            size_t next = body.find("\r\n" + boundary, headers_end);
+            if (headers_end == std::string::npos || next == std::string::npos) break;
+            std::string headers = body.substr(headers_start, headers_end - headers_start);
+            size_t data_start = headers_end + 4;
+            auto field = [&](const std::string& name) {
+                size_t start = headers.find(name + "=\"");
+                if (start == std::string::npos) return std::string();
+                start += name.size() + 2;
+                return headers.substr(start, headers.find('"', start) - start);
+            };
+            if (field("name") == "payload_json") {
+                content = json::parse(body.substr(data_start, next - data_start)).value("content", "");
+            } else if (!field("filename").empty()) {
+                attachments.push_back({{"filename", field("filename")}, {"size", next - data_start}});
+            }
+            pos = next + 2;
+        }
+        if (attachments.empty() && content.empty()) throw std::runtime_error("empty form");
+        return content;
+    }
+
+    static std::string gzip_compress(const std::string& data) {
+        z_stream stream{};
+        deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY);
+        std::string out(deflateBound(&stream, data.size()), '\0');
+        stream.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data.data()));
+        stream.avail_in = data.size();
+        stream.next_out = reinterpret_cast<Bytef*>(&out[0]);
+        stream.avail_out = out.size();
+        deflate(&stream, Z_FINISH);
+        out.resize(stream.total_out);
+        deflateEnd(&stream);
+        return out;
+    }
+
+    static json to_json(const Message& message, const std::string& channel_id) {
+        return {{"id", std::to_string(message.id)},
+                {"channel_id", channel_id},
+                {"content", message.content},
+                {"author", {{"id", "1"}, {"username", message.author}}}};
+    }
+
+    int listen_fd_ = -1;
+    int port_ = 0;
+    std::thread acceptor_;
+    std::mutex mutex_;
+    Settings settings_;
+    ArrivalCallback arrival_;
+    std::map<std::string, std::vector<Message>> channels_; // id 昇順
+    std::map<std::string, Message> nonces_; // "<channel>:<nonce>"
+    std::string gateway_url_ = "wss://gateway.invalid";
+    std::map<std::string, Bucket> buckets_;
+    std::atomic<size_t> rate_limited_{0};
+    uint64_t sequence_ = 0;
+};
+
+// Stand-in for the Discord Gateway, for --follow. Speaks just enough RFC 6455
+// (upgrade handshake, unmasked server frames, masked client frames, fragmentation,
+// ping/pong, close) and zlib-stream transport compression. Each session runs a
+// fixed script:
+//   1st connection: HELLO (fragmented) -> IDENTIFY -> READY, a MESSAGE_CREATE split
+//                   over two WebSocket messages and a ping; once a heartbeat has been
+//                   ACKed the TCP connection is dropped without a close frame
+//   2nd connection: HELLO -> RESUME with the last seq -> the missed MESSAGE_CREATE
+//                   and RESUMED; heartbeats are ACKed until the client goes away
+class MockGateway {
+public:
+    struct Report {
+        int connections = 0;
+        int identifies = 0;
+        int resumes = 0;
+        long resume_seq = -1;         // RESUME で受け取った seq (期待値は 2)
+        bool resume_session_ok = false;
+        int heartbeats = 0;
+        bool pong_ok = false;         // ping と同じペイロードの pong が返った
+        bool unmasked_frame = false;  // クライアントのフレームにマスクがなかった
+        bool disconnected = false;
+        double reconnect_ms = 0;      // 切断から RESUME まで
+    };
+
+    static constexpr int HEARTBEAT_INTERVAL_MS = 200;
+    static constexpr long READY_SEQ = 1;
+    static const std::string SESSION_ID;
+
+    ~MockGateway() { stop(); }
+
+    int start(int port) {
+        listen_fd_ = socket(AF_INET, SOCK_STREAM, 0);
+        int one = 1;
+        setsockopt(listen_fd_, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        sockaddr_in addr{};
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(port);
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        if (bind(listen_fd_, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0 || listen(listen_fd_, 16) < 0) {
+            throw std::runtime_error(std::string("Mock gateway cannot listen: ") + strerror(errno));
+        }
+        socklen_t size = sizeof(addr);
+        getsockname(listen_fd_, reinterpret_cast<sockaddr*>(&addr), &size);
+        port_ = ntohs(addr.sin_port);
+        acceptor_ = std::thread([this]() { accept_loop(); });
+        return port_;
+    }
+
+    void stop() {
+        if (listen_fd_ < 0) return;
+        shutdown(listen_fd_, SHUT_RDWR);
+        close(listen_fd_);
+        listen_fd_ = -1;
+        if (acceptor_.joinable()) acceptor_.join();
+    }
+
+    std::string url() const { return "ws://127.0.0.1:" + std::to_string(port_); }
+
+    void reset() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        report_ = Report();
+        resumed_heartbeats_ = 0;
+    }
+
+    Report report() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return report_;
+    }
+
+    // Wait until the resumed session has ACKed a heartbeat (the whole script ran)
+    bool wait_resumed(std::chrono::milliseconds timeout) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        return changed_.wait_for(lock, timeout, [this] { return report_.resumes > 0 && resumed_heartbeats_ > 0; });
+    }
+
+private:
+    // One client connection: its socket, read buffer and zlib-stream context
+    struct Connection {
+        int fd;
+        std::string buffer;
+        z_stream deflate{};
+        bool open = true;
+    };
+
+    void accept_loop() {
+        for (;;) {
+            int fd = accept(listen_fd_, nullptr, nullptr);
+            if (fd < 0) {
+                if (errno == EINTR) continue;
+                return;
+            }
+            int one = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+            std::thread([this, fd]() { serve(fd); }).detach();
+        }
+    }
+
+    void serve(int fd) {
+        Connection conn{fd, {}};
+        deflateInit(&conn.deflate, Z_DEFAULT_COMPRESSION);
+        if (handshake(conn)) run_session(conn);
+        deflateEnd(&conn.deflate);
+        close(fd);
+    }
+
+    bool handshake(Connection& conn) {
+        size_t header_end;
+        while ((header_end = conn.buffer.find("\r\n\r\n")) == std::string::npos) {
+            if (!fill(conn, 5000)) return false;
+        }
+        std::string head = conn.buffer.substr(0, header_end);
+        conn.buffer.erase(0, header_end + 4);
+        std::string key;
+        std::istringstream lines(head);
+        std::string line;
+        while (std::getline(lines, line)) {
+            if (!line.empty() && line.back() == '\r') line.pop_back();
+            std::string lower = line;
+            std::transform(lower.begin(), lower.end(), lower.begin(), [](unsigned char c) { return std::tolower(c); });
+            if (lower.rfind("sec-websocket-key:", 0) == 0) key = line.substr(line.find(':') + 2);
+        }
+        if (key.empty() || head.find("compress=zlib-stream") == std::string::npos) {
+            send_all(conn, "HTTP/1.1 400 Bad Request\r\nContent-Length: 0\r\n\r\n");
+            return false;
+        }
+        std::string accept = key + "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+        unsigned char digest[EVP_MAX_MD_SIZE];
+        unsigned int digest_size = 0;
+        EVP_Digest(accept.data(), accept.size(), digest, &digest_size, EVP_sha1(), nullptr);
+        std::string encoded(4 * ((digest_size + 2) / 3), '\0');
+        EVP_EncodeBlock(reinterpret_cast<unsigned char*>(&encoded[0]), digest, static_cast<int>(digest_size));
+        return send_all(conn, "HTTP/1.1 101 Switching Protocols\r\n"
+                              "Upgrade: websocket\r\n"
+                              "Connection: Upgrade\r\n"
+                              "Sec-WebSocket-Accept: " + encoded + "\r\n\r\n");
+    }
+
+    void run_session(Connection& conn) {
+        bool first;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            first = report_.connections++ == 0;
+        }
+        // HELLO は 2 つのフレームに分けて送る (継続フレームの確認)
+        std::string hello = compress(conn, json{{"op", 10}, {"d", {{"heartbeat_interval", HEARTBEAT_INTERVAL_MS}}}});
+        size_t half = hello.size() / 2;
+        send_frame(conn, 0x2, hello.substr(0, half), false);
+        send_frame(conn, 0x0, hello.substr(half), true);
+
+        const std::string ping = "bench-ping";
+        while (conn.open) {
+            uint8_t opcode;
+            std::string payload;
+            if (!read_frame(conn, opcode, payload)) return;
+            if (opcode == 0x8) {
+                send_frame(conn, 0x8, payload.substr(0, 2), true);
+                return;
+            }
+            if (opcode == 0xA) {
+                std::lock_guard<std::mutex> lock(mutex_);
+                report_.pong_ok = payload == ping;
+                continue;
+            }
+            if (opcode != 0x1) continue;
+            json message = json::parse(payload, nullptr, false);
+            int op = message.is_object() ? message.value("op", -1) : -1;
+            if (op == 2) { // Identify
+                {
+                    std::lock_guard<std::mutex> lock(mutex_);
+                    ++report_.identifies;
+                }
+                send_payload(conn, dispatch("READY", READY_SEQ, {{"session_id", SESSION_ID}, {"resume_gateway_url", url()}}));
+                // zlib-stream のペイロードを 2 つの WebSocket メッセージに分ける
+                std::string event = compress(conn, dispatch("MESSAGE_CREATE", READY_SEQ + 1, message_create("gateway event 1", 1)));
+                send_frame(conn, 0x2, event.substr(0, event.size() / 2), true);
+                send_frame(conn, 0x2, event.substr(event.size() / 2), true);
+                send_frame(conn, 0x9, ping, true);
+            } else if (op == 6) { // Resume
+                const json& data = message["d"];
+                {
+                    std::lock_guard<std::mutex> lock(mutex_);
+                    ++report_.resumes;
+                    report_.resume_seq = data.value("seq", -1L);
+                    report_.resume_session_ok = data.value("session_id", "") == SESSION_ID;
+                    report_.reconnect_ms = std::chrono::duration<double, std::milli>(Clock::now() - disconnected_at_).count();
+                }
+                // 切断中に起きたイベントを再送してから RESUMED
+                send_payload(conn, dispatch("MESSAGE_CREATE", READY_SEQ + 2, message_create("gateway event 2", 2)));
+                send_payload(conn, dispatch("RESUMED", READY_SEQ + 3, json::object()));
+            } else if (op == 1) { // Heartbeat
+                send_payload(conn, {{"op", 11}, {"d", nullptr}});
+                bool drop;
+                {
+                    std::lock_guard<std::mutex> lock(mutex_);
+                    ++report_.heartbeats;
+                    if (report_.resumes > 0) ++resumed_heartbeats_;
+                    drop = first && report_.identifies > 0 && !report_.disconnected;
+                    if (drop) {
+                        report_.disconnected = true;
+                        disconnected_at_ = Clock::now();
+                    }
+                }
+                changed_.notify_all();
+                if (drop) {
+                    // close フレームなしで TCP を切る
+                    shutdown(conn.fd, SHUT_RDWR);
+                    return;
+                }
+            }
+        }
+    }
+
+    static json dispatch(const std::string& type, long seq, const json& data) {
+        return {{"op", 0}, {"t", type}, {"s", seq}, {"d", data}};
+    }
+
+    static json message_create(const std::string& content, uint64_t n) {
+        uint64_t id = ((now_ms() - DISCORD_EPOCH_MS) << 22) | n;
+        return {{"id", std::to_string(id)},
+                {"channel_id", BENCH_CHANNEL},
+                {"content", content},
+                {"author", {{"id", "1"}, {"username", "gateway-bench"}}}};
+    }
+
+    // Deflate one payload into the connection's zlib stream, ending in 00 00 ff ff
+    std::string compress(Connection& conn, const json& payload) {
+        std::string text = payload.dump();
+        std::string out(deflateBound(&conn.deflate, text.size()) + 16, '\0');
+        conn.deflate.next_in = reinterpret_cast<Bytef*>(&text[0]);
+        conn.deflate.avail_in = text.size();
+        conn.deflate.next_out = reinterpret_cast<Bytef*>(&out[0]);
+        conn.deflate.avail_out = out.size();
+        deflate(&conn.deflate, Z_SYNC_FLUSH);
+        out.resize(out.size() - conn.deflate.avail_out);
+        return out;
+    }
+
+    void send_payload(Connection& conn, const json& payload) { send_frame(conn, 0x2, compress(conn, payload), true); }
+
+    // Server frames are never masked
+    bool send_frame(Connection& conn, uint8_t opcode, const std::string& payload, bool fin) {
+        std::string frame;
+        frame += char((fin ? 0x80 : 0) | opcode);
+        if (payload.size() < 126) {
+            frame += char(payload.size());
+        } else if (payload.size() <= 0xffff) {
+            frame += char(126);
+            frame += char(payload.size() >> 8);
+            frame += char(payload.size() & 0xff);
+        } else {
+            frame += char(127);
+            for (int shift = 56; shift >= 0; shift -= 8) frame += char((uint64_t(payload.size()) >> shift) & 0xff);
+        }
+        return send_all(conn, frame + payload);
+    }
+
+    // Read one client frame; false on disconnect or an unmasked frame
+    bool read_frame(Connection& conn, uint8_t& opcode, std::string& payload) {
+        while (!parse_frame(conn, opcode, payload)) {
+            if (!conn.open || !fill(conn, 10000)) return false;
+        }
+        return true;
+    }
+
+    bool parse_frame(Connection& conn, uint8_t& opcode, std::string& payload) {
+        const auto* bytes = reinterpret_cast<const unsigned char*>(conn.buffer.data());
+        size_t size = conn.buffer.size();
+        if (size < 2) return false;
+        if (!(bytes[1] & 0x80)) {
+            std::lock_guard<std::mutex> lock(mutex_);
+            report_.unmasked_frame = true;
+            conn.open = false;
+            return false;
+        }
+        uint64_t length = bytes[1] & 0x7f;
+        size_t offset = 2;
+        if (length == 126) {
+            if (size < 4) return false;
+            length = (uint64_t(bytes[2]) << 8) | bytes[3];
+            offset = 4;
+        } else if (length == 127) {
+            if (size < 10) return false;
+            length = 0;
+            for (int i = 0; i < 8; ++i) length = (length << 8) | bytes[2 + i];
+            offset = 10;
+        }
+        // クライアントのフレームは 4 バイトのマスク付き
+        if (size < offset + 4 + length) return false;
+        opcode = bytes[0] & 0x0f;
+        payload = conn.buffer.substr(offset + 4, length);
+        for (size_t i = 0; i < payload.size(); ++i) payload[i] ^= conn.buffer[offset + i % 4];
+        conn.buffer.erase(0, offset + 4 + length);
+        return true;
+    }
+
+    bool fill(Connection& conn, int timeout_ms) {
+        pollfd pfd{conn.fd, POLLIN, 0};
+        if (poll(&pfd, 1, timeout_ms) <= 0) return false;
+        char chunk[16384];
+        ssize_t n = recv(conn.fd, chunk, sizeof(chunk), 0);
+        if (n <= 0) {
+            conn.open = false;
+            return false;
+        }
+        conn.buffer.append(chunk, n);
+        return true;
+    }
+
+    bool send_all(Connection& conn, const std::string& data) {
+        if (send(conn.fd, data.data(), data.size(), MSG_NOSIGNAL) != static_cast<ssize_t>(data.size())) {
+            conn.open = false;
+            return false;
+        }
+        return true;
+    }
+
+    int listen_fd_ = -1;
+    int port_ = 0;
+    std::thread acceptor_;
+    std::mutex mutex_;
+    std::condition_variable changed_;
+    Report report_;
+    int resumed_heartbeats_ = 0;
+    Clock::time_point disconnected_at_;
+};
+
+const std::string MockGateway::SESSION_ID = "bench-session";
+
+// 実行した dcli プロセスの結果
+struct RunResult {
+    int exit_code = -1;
+    double seconds = 0;
+    long peak_rss_kb = 0;
+    unsigned long allocations = 0;
+};
+
+// Runs dcli in its own HOME (config, cache and outbox) against the mock server
+class DcliRunner {
+public:
+    DcliRunner(const std::string& dcli, const std::string& alloc_lib, const std::string& api_base)
+        : dcli_(std::filesystem::absolute(dcli)), alloc_lib_(alloc_lib.empty() ? "" : std::filesystem::absolute(alloc_lib).string()),
+          api_base_(api_base) {}
+
+    ~DcliRunner() { remove_home(); }
+
+    // Start over with an empty config directory; `extra` keys are added to the config
+    void reset_home(const json& extra = json::object()) {
+        remove_home();
+        char pattern[] = "/tmp/dcli-bench.XXXXXX";
+        home_ = mkdtemp(pattern);
+        std::filesystem::create_directories(home_ + "/.config/dcli");
+        std::ofstream config(home_ + "/.config/dcli/config.json");
+        json settings = {{"token", "bench-token"}, {"channels", {{"bench", BENCH_CHANNEL}}}, {"last_used_channel", BENCH_CHANNEL}};
+        settings.update(extra);
+        config << settings.dump(4);
+    }
+
+    const std::string& home() const { return home_; }
+
+    pid_t spawn(const std::vector<std::string>& args, const std::string& stdin_path = "/dev/null",
+                const std::string& stdout_path = "/dev/null") {
+        std::string alloc_log = home_ + "/allocations";
+        pid_t pid = fork();
+        if (pid == 0) {
+            int in = open(stdin_path.c_str(), O_RDONLY);
+            int out = open(stdout_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+            int err = open("/dev/null", O_WRONLY);
+            dup2(in, 0);
+            dup2(out, 1);
+            dup2(err, 2);
+            setenv("HOME", home_.c_str(), 1);
+            setenv("DCLI_API_BASE", api_base_.c_str(), 1);
+            if (!alloc_lib_.empty()) {
+                setenv("LD_PRELOAD", alloc_lib_.c_str(), 1);
+                setenv("DCLI_ALLOC_LOG", alloc_log.c_str(), 1);
+            }
+            std::vector<char*> argv{const_cast<char*>(dcli_.c_str())};
+            for (const auto& arg : args) argv.push_back(const_cast<char*>(arg.c_str()));
+            argv.push_back(nullptr);
+            execv(dcli_.c_str(), argv.data());
+            _exit(127);
+        }
+        started_ = Clock::now();
+        return pid;
+    }
+
+    RunResult wait(pid_t pid) {
+        RunResult result;
+        int status = 0;
+        rusage usage{};
+        wait4(pid, &status, 0, &usage);
+        result.seconds = std::chrono::duration<double>(Clock::now() - started_).count();
+        result.exit_code = WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+        result.peak_rss_kb = usage.ru_maxrss;
+        std::ifstream log(home_ + "/allocations");
+        log >> result.allocations;
+        return result;
+    }
+
+    RunResult run(const std::vector<std::string>& args, const std::string& stdin_path = "/dev/null") {
+        return wait(spawn(args, stdin_path));
+    }
+
+private:
+    void remove_home() {
+        if (!home_.empty()) std::filesystem::remove_all(home_);
+        home_.clear();
+    }
+
+    std::string dcli_;
+    std::string alloc_lib_;
+    std::string api_base_;
+    std::string home_;
+    Clock::time_point started_;
+};
+
+double percentile(std::vector<double> samples, double p) {
+    if (samples.empty()) return 0;
+    std::sort(samples.begin(), samples.end());
+    size_t rank = static_cast<size_t>(std::ceil(p * samples.size()));
+    return samples[std::min(samples.size() - 1, rank > 0 ? rank - 1 : 0)];
+}
+
+json latency_summary(const std::vector<double>& samples_ms) {
+    double total = 0;
+    for (double sample : samples_ms) total += sample;
+    return {{"samples", samples_ms.size()},
+            {"p50_ms", percentile(samples_ms, 0.50)},
+            {"p99_ms", percentile(samples_ms, 0.99)},
+            {"mean_ms", samples_ms.empty() ? 0.0 : total / samples_ms.size()}};
+}
+
+// 少数と多数の 2 回の差分から、起動時のコストを除いたメッセージあたりの回数を求める
+double marginal_allocations(const RunResult& small, size_t small_count, const RunResult& large, size_t large_count) {
+    if (large_count <= small_count || large.allocations < small.allocations) return 0;
+    return double(large.allocations - small.allocations) / double(large_count - small_count);
+}
+
+std::string write_batch_file(const std::string& home, size_t count) {
+    std::string path = home + "/batch.txt";
+    std::ofstream file(path);
+    for (size_t i = 0; i < count; ++i) file << "bench message " << i << " \"quoted\" and some ordinary text\n";
+    return path;
+}
+
+struct BenchOptions {
+    size_t messages = 2000;
+    size_t latency_samples = 200;
+    size_t history = 2000;
+    size_t fetch_runs = 10;
+    int latency_ms = 0;
+};
+
+// --batch の送信スループット (レート制限なし)
+json bench_send_batch(MockServer& server, DcliRunner& runner, const BenchOptions& options) {
+    server.clear();
+    server.configure({options.latency_ms, 0, 1000});
+    runner.reset_home();
+    RunResult baseline = runner.run({"--batch=" + write_batch_file(runner.home(), 10)});
+    runner.reset_home();
+    RunResult result = runner.run({"--batch=" + write_batch_file(runner.home(), options.messages)});
+    return {{"messages", options.messages},
+            {"exit_code", result.exit_code},
+            {"seconds", result.seconds},
+            {"msgs_per_sec", result.seconds > 0 ? options.messages / result.seconds : 0.0},
+            {"allocations_per_message", marginal_allocations(baseline, 10, result, options.messages)},
+            {"peak_rss_kb", result.peak_rss_kb}};
+}
+
+// --batch under a tight rate limit: checks pacing and 429 handling
+json bench_send_rate_limited(MockServer& server, DcliRunner& runner, const BenchOptions& options) {
+    const size_t count = 200;
+    server.clear();
+    server.configure({options.latency_ms, 20, 250});
+    runner.reset_home();
+    RunResult result = runner.run({"--batch=" + write_batch_file(runner.home(), count)});
+    return {{"messages", count},
+            {"limit", "20 per 250ms"},
+            {"exit_code", result.exit_code},
+            {"seconds", result.seconds},
+            {"msgs_per_sec", result.seconds > 0 ? count / result.seconds : 0.0},
+            {"responses_429", server.rate_limited()},
+            {"peak_rss_kb", result.peak_rss_kb}};
+}
+
+// --batch to one rate-limited channel with one bot token, then with extra tokens
+// and webhooks in the config; checks that messages still arrive in order
+json bench_send_identities(MockServer& server, DcliRunner& runner, const BenchOptions& options) {
+    const size_t count = 200;
+    const json pools[] = {
+        json::object(),
+        {{"tokens", {"bench-token-2", "bench-token-3"}},
+         {"webhooks", {{"bench", {server.api_base() + "/webhooks/" + BENCH_CHANNEL + "/bench-webhook"}}}}},
+    };
+    json result = {{"messages", count}, {"limit", "20 per 250ms per identity"}};
+    for (const auto& pool : pools) {
+        server.clear();
+        server.configure({options.latency_ms, 20, 250});
+        runner.reset_home(pool);
+        RunResult run = runner.run({"--batch=" + write_batch_file(runner.home(), count)});
+        auto posted = server.posted(BENCH_CHANNEL);
+        std::map<std::string, size_t> authors;
+        bool in_order = posted.size() == count;
+        for (size_t i = 0; i < posted.size(); ++i) {
+            ++authors[posted[i].second];
+            if (posted[i].first.rfind("bench message " + std::to_string(i) + " ", 0) != 0) in_order = false;
+        }
+        result[std::to_string(authors.size()) + "_identities"] = {
+            {"exit_code", run.exit_code},
+            {"seconds", run.seconds},
+            {"msgs_per_sec", run.seconds > 0 ? count / run.seconds : 0.0},
+            {"responses_429", server.rate_limited()},
+            {"in_order", in_order},
+            {"per_identity", authors}};
+    }
+    return result;
+}
+
+// Per-message latency through a warm daemon: from writing the NDJSON line to the
+// daemon's socket until the mock server receives the POST
+json bench_send_latency(MockServer& server, DcliRunner& runner, const BenchOptions& options) {
+    server.clear();
+    server.configure({options.latency_ms, 0, 1000});
+
+    std::mutex mutex;
+    std::condition_variable arrived_cv;
+    std::map<std::string, Clock::time_point> arrivals;
+    server.on_arrival([&](const std::string& content, Clock::time_point at) {
+        std::lock_guard<std::mutex> lock(mutex);
+        arrivals[content] = at;
+        arrived_cv.notify_all();
+    });
+
+    auto run_daemon = [&](size_t count, std::vector<double>& samples) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            arrivals.clear();
+        }
+        runner.reset_home();
+        std::string socket_path = runner.home() + "/.config/dcli/dcli.sock";
+        pid_t pid = runner.spawn({"--daemon"});
+        int fd = -1;
+        for (int i = 0; i < 500 && fd < 0; ++i) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            int candidate = socket(AF_UNIX, SOCK_STREAM, 0);
+            sockaddr_un addr{};
+            addr.sun_family = AF_UNIX;
+            strncpy(addr.sun_path, socket_path.c_str(), sizeof(addr.sun_path) - 1);
+            if (connect(candidate, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == 0) {
+                fd = candidate;
+            } else {
+                close(candidate);
+            }
+        }
+        if (fd < 0) {
+            kill(pid, SIGKILL);
+            runner.wait(pid);
+            throw std::runtime_error("dcli --daemon did not open its socket");
+        }
+        for (size_t i = 0; i < count; ++i) {
+            std::string content = "latency probe " + std::to_string(i);
+            std::string line = json{{"channel", BENCH_CHANNEL}, {"content", content}}.dump() + "\n";
+            auto sent = Clock::now();
+            if (write(fd, line.data(), line.size()) < 0) break;
+            char reply[256];
+            if (read(fd, reply, sizeof(reply)) <= 0) break;
+            std::unique_lock<std::mutex> lock(mutex);
+            if (!arrived_cv.wait_for(lock, std::chrono::seconds(10), [&]() { return arrivals.count(content) > 0; })) break;
+            samples.push_back(std::chrono::duration<double, std::milli>(arrivals[content] - sent).count());
+        }
+        close(fd);
+        kill(pid, SIGTERM);
+        return runner.wait(pid);
+    };
+
+    std::vector<double> warmup, samples;
+    RunResult baseline = run_daemon(10, warmup);
+    RunResult result = run_daemon(options.latency_samples, samples);
+    server.on_arrival(nullptr);
+
+    json summary = latency_summary(samples);
+    summary["allocations_per_message"] = marginal_allocations(baseline, 10, result, options.latency_samples);
+    summary["peak_rss_kb"] = result.peak_rss_kb;
+    return summary;
+}
+
+// --history on an empty cache: paging, parsing and storing
+json bench_fetch_history(MockServer& server, DcliRunner& runner, const BenchOptions& options) {
+    server.clear();
+    server.configure({options.latency_ms, 0, 1000});
+    server.seed(BENCH_CHANNEL, options.history * 2);
+
+    std::vector<double> samples;
+    RunResult result;
+    for (size_t i = 0; i < options.fetch_runs; ++i) {
+        runner.reset_home();
+        result = runner.run({"--history", std::to_string(options.history)});
+        samples.push_back(result.seconds * 1000);
+    }
+    runner.reset_home();
+    RunResult baseline = runner.run({"--history", "100"});
+
+    json summary = latency_summary(samples);
+    summary["messages"] = options.history;
+    summary["exit_code"] = result.exit_code;
+    summary["msgs_per_sec"] = summary["p50_ms"].get<double>() > 0 ? options.history / (summary["p50_ms"].get<double>() / 1000) : 0.0;
+    summary["allocations_per_message"] = marginal_allocations(baseline, 100, result, options.history);
+    summary["peak_rss_kb"] = result.peak_rss_kb;
+    return summary;
+}
+
+// The /get path with a warm cache: a delta sync that finds nothing new
+json bench_fetch_delta(MockServer& server, DcliRunner& runner, const BenchOptions& options) {
+    server.clear();
+    server.configure({options.latency_ms, 0, 1000});
+    server.seed(BENCH_CHANNEL, 500);
+    runner.reset_home();
+    runner.run({"--tail-all=1"});
+
+    std::vector<double> samples;
+    RunResult result;
+    for (size_t i = 0; i < options.fetch_runs * 2; ++i) {
+        result = runner.run({"--tail-all=1"});
+        samples.push_back(result.seconds * 1000);
+    }
+    json summary = latency_summary(samples);
+    summary["exit_code"] = result.exit_code;
+    summary["peak_rss_kb"] = result.peak_rss_kb;
+    return summary;
+}
+
+// --export of a whole channel with compressed responses, then a rerun that resumes
+// and finds nothing new; checks every message is in the output once, in order
+json bench_export(MockServer& server, DcliRunner& runner, const BenchOptions& options) {
+    const size_t count = 20000;
+    server.clear();
+    server.configure({options.latency_ms, 0, 1000});
+    server.seed(BENCH_CHANNEL, count);
+    runner.reset_home();
+    std::string path = runner.home() + "/export.ndjson.gz";
+    RunResult result = runner.run({"--export", BENCH_CHANNEL, "--out", path});
+    RunResult rerun = runner.run({"--export", BENCH_CHANNEL, "--out", path});
+
+    size_t lines = 0;
+    bool in_order = true;
+    gzFile file = gzopen(path.c_str(), "rb");
+    if (file) {
+        std::string line;
+        char buffer[4096];
+        while (gzgets(file, buffer, sizeof(buffer))) {
+            line += buffer;
+            if (line.back() != '\n') continue;
+            auto message = json::parse(line, nullptr, false);
+            if (!message.is_object() || message.value("content", "").rfind("seed message " + std::to_string(lines) + " ", 0) != 0) {
+                in_order = false;
+            }
+            ++lines;
+            line.clear();
+        }
+        gzclose(file);
+    }
+    return {{"messages", count},
+            {"exit_code", result.exit_code},
+            {"seconds", result.seconds},
+            {"msgs_per_sec", result.seconds > 0 ? count / result.seconds : 0.0},
+            {"output_bytes", std::filesystem::exists(path) ? std::filesystem::file_size(path) : 0},
+            {"complete", lines == count && in_order},
+            {"rerun_exit_code", rerun.exit_code},
+            {"rerun_seconds", rerun.seconds},
+            {"peak_rss_kb", result.peak_rss_kb}};
+}
+
+// --follow against the stand-in Gateway: HELLO, IDENTIFY, zlib-stream dispatches,
+// heartbeats, a dropped connection and a RESUME. Checks that both events were
+// printed and that the client resumed from the right seq instead of re-identifying.
+json bench_gateway(MockServer& server, MockGateway& gateway, DcliRunner& runner, const BenchOptions& options) {
+    server.clear();
+    server.configure({options.latency_ms, 0, 1000});
+    gateway.reset();
+    runner.reset_home();
+    std::string output = runner.home() + "/follow.out";
+    pid_t pid = runner.spawn({"--follow"}, "/dev/null", output);
+    bool resumed = gateway.wait_resumed(std::chrono::seconds(10));
+    // 再送されたイベントが表示されるまで少し待つ
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    kill(pid, SIGTERM);
+    RunResult result = runner.wait(pid);
+
+    std::ifstream file(output);
+    std::string text((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+    size_t printed = 0;
+    for (const char* event : {"gateway-bench: gateway event 1", "gateway-bench: gateway event 2"}) {
+        printed += text.find(event) != std::string::npos;
+    }
+    MockGateway::Report report = gateway.report();
+    bool ok = resumed && printed == 2 && report.identifies == 1 && report.resume_session_ok &&
+              report.resume_seq == MockGateway::READY_SEQ + 1 && report.pong_ok && !report.unmasked_frame;
+    return {{"ok", ok},
+            {"connections", report.connections},
+            {"identifies", report.identifies},
+            {"resumes", report.resumes},
+            {"resume_seq", report.resume_seq},
+            {"resume_session_ok", report.resume_session_ok},
+            {"heartbeats_acked", report.heartbeats},
+            {"pong_ok", report.pong_ok},
+            {"client_frames_masked", !report.unmasked_frame},
+            {"events_printed", printed},
+            {"reconnect_ms", report.reconnect_ms},
+            {"peak_rss_kb", result.peak_rss_kb}};
+}
+
+void print_help() {
+    std::cout << "Usage: dcli-bench --dcli <PATH> [--alloc-lib <PATH>] [options]\n";
+    std::cout << "       dcli-bench --serve [--port N] [options]\n";
+    std::cout << "Options:\n";
+    std::cout << "  --dcli <PATH>              dcli binary to benchmark (default: ./dcli)\n";
+    std::cout << "  --alloc-lib <PATH>         LD_PRELOAD library that counts allocations\n";
+    std::cout << "  --output <FILE>            Also write the JSON results to FILE\n";
+    std::cout << "  --messages <N>             Messages for the batch throughput run (default: 2000)\n";
+    std::cout << "  --samples <N>              Messages for the daemon latency run (default: 200)\n";
+    std::cout << "  --history <N>              Messages fetched per --history run (default: 2000)\n";
+    std::cout << "  --runs <N>                 Repetitions of the fetch runs (default: 10)\n";
+    std::cout << "  --latency-ms <N>           Delay the mock server adds to every response\n";
+    std::cout << "  --serve                    Only run the mock server until interrupted\n";
+    std::cout << "  --port <N>                 Port for --serve (default: 18080)\n";
+    std::cout << "  --limit <N>                Requests per rate limit window for --serve (default: none)\n";
+    std::cout << "  --window-ms <N>            Rate limit window for --serve (default: 1000)\n";
+    std::cout << "  --seed <N>                 Messages to seed in channel 111 for --serve\n";
+    std::cout << "  --guilds <N>               Guilds the bot is in for --serve (default: none)\n";
+    std::cout << "  --guild-channels <N>       Channels per guild for --serve (default: 50)\n";
+}
+
+int main(int argc, char* argv[]) {
+    std::string dcli = "./dcli", alloc_lib, output;
+    BenchOptions options;
+    bool serve = false;
+    int port = 18080;
+    MockServer::Settings settings;
+    settings.guild_channels = 50;
+    size_t seed = 0;
+
+    struct option long_options[] = {
+        {"dcli", required_argument, nullptr, 'd'},
+        {"alloc-lib", required_argument, nullptr, 'a'},
+        {"output", required_argument, nullptr, 'o'},
+        {"messages", required_argument, nullptr, 'm'},
+        {"samples", required_argument, nullptr, 's'},
+        {"history", required_argument, nullptr, 'H'},
+        {"runs", required_argument, nullptr, 'r'},
+        {"latency-ms", required_argument, nullptr, 'l'},
+        {"serve", no_argument, nullptr, 'S'},
+        {"port", required_argument, nullptr, 'p'},
+        {"limit", required_argument, nullptr, 'L'},
+        {"window-ms", required_argument, nullptr, 'w'},
+        {"seed", required_argument, nullptr, 'e'},
+        {"guilds", required_argument, nullptr, 'g'},
+        {"guild-channels", required_argument, nullptr, 'c'},
+        {"help", no_argument, nullptr, 'h'},
+        {nullptr, 0, nullptr, 0}
+    };
+    int opt;
+    while ((opt = getopt_long(argc, argv, "h", long_options, nullptr)) != -1) {
+        switch (opt) {
+            case 'd': dcli = optarg; break;
+            case 'a': alloc_lib = optarg; break;
+            case 'o': output = optarg; break;
+            case 'm': options.messages = std::max(20UL, std::strtoul(optarg, nullptr, 10)); break;
+            case 's': options.latency_samples = std::max(20UL, std::strtoul(optarg, nullptr, 10)); break;
+            case 'H': options.history = std::max(200UL, std::strtoul(optarg, nullptr, 10)); break;
+            case 'r': options.fetch_runs = std::max(1UL, std::strtoul(optarg, nullptr, 10)); break;
+            case 'l': options.latency_ms = settings.latency_ms = std::atoi(optarg); break;
+            case 'S': serve = true; break;
+            case 'p': port = std::atoi(optarg); break;
+            case 'L': settings.limit = std::atoi(optarg); break;
+            case 'w': settings.window_ms = std::max(1, std::atoi(optarg)); break;
+            case 'e': seed = std::strtoul(optarg, nullptr, 10); break;
+            case 'g': settings.guilds = std::atoi(optarg); break;
+            case 'c': settings.guild_channels = std::atoi(optarg); break;
+            case 'h': print_help(); return 0;
+            default: print_help(); return 1;
+        }
+    }
+
+    try {
+        MockServer server;
+        MockGateway gateway;
+        gateway.start(0);
+        server.set_gateway_url(gateway.url());
+        if (serve) {
+            server.configure(settings);
+            if (seed > 0) server.seed(BENCH_CHANNEL, seed);
+            server.start(port);
+            std::cout << "Mock Discord API listening; run dcli with DCLI_API_BASE=" << server.api_base() << std::endl;
+            std::cout << "Stand-in Gateway at " << gateway.url() << " (drops the first session once to test RESUME)" << std::endl;
+            pause();
+            return 0;
+        }
+
+        server.start(0);
+        DcliRunner runner(dcli, alloc_lib, server.api_base());
+        json results = {
+            {"dcli", dcli},
+            {"allocations_counted", !alloc_lib.empty()},
+            {"mock_latency_ms", options.latency_ms},
+        };
+        std::vector<std::pair<std::string, std::function<json()>>> benches = {
+            {"send_batch", [&]() { return bench_send_batch(server, runner, options); }},
+            {"send_rate_limited", [&]() { return bench_send_rate_limited(server, runner, options); }},
+            {"send_identities", [&]() { return bench_send_identities(server, runner, options); }},
+            {"send_latency", [&]() { return bench_send_latency(server, runner, options); }},
+            {"fetch_history", [&]() { return bench_fetch_history(server, runner, options); }},
+            {"fetch_delta", [&]() { return bench_fetch_delta(server, runner, options); }},
+            {"export", [&]() { return bench_export(server, runner, options); }},
+            {"gateway", [&]() { return bench_gateway(server, gateway, runner, options); }},
+        };
+        for (const auto& [name, bench] : benches) {
+            std::cerr << "Running " << name << "..." << std::endl;
+            results[name] = bench();
+        }
+
+        std::string text = results.dump(2);
+        std::cout << text << std::endl;
+        if (!output.empty()) {
+            std::ofstream file(output);
+            file << text << "\n";
+        }
+    } catch (const std::exception& e) {
+        std::cerr << "Error: " << e.what() << std::endl;
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,148 @@
+// json_escape.hpp のマイクロベンチマーク。
+// First checks that every scanner (scalar, SSE2, AVX2) produces exactly what the
+// original escape_json did, then times them on a few message shapes and prints
+// MB/s and ns/message as JSON. Exits non-zero on any mismatch.
+#include <iostream>
+#include <sstream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <random>
+#include <functional>
+#include <nlohmann/json.hpp>
+#include "../json_escape.hpp"
+
+using json = nlohmann::json;
+
+// escape_json as it was in dcli.cpp, kept as the reference
+std::string legacy_escape_json(const std::string& s) {
+    std::ostringstream o;
+    for (auto c = s.cbegin(); c != s.cend(); c++) {
+        switch (*c) {
+            case '"': o << "\\\""; break;
+            case '\\': o << "\\\\"; break;
+            case '\b': o << "\\b"; break;
+            case '\f': o << "\\f"; break;
+            case '\n': o << "\\n"; break;
+            case '\r': o << "\\r"; break;
+            case '\t': o << "\\t"; break;
+            default:
+                if ('\x00' <= *c && *c <= '\x1f') {
+                    o << "\\u"
+                      << std::hex << std::setw(4) << std::setfill('0') << (int)*c;
+                } else {
+                    o << *c;
+                }
+        }
+    }
+    return o.str();
+}
+
+struct Scanner {
+    std::string name;
+    json_escape::FindFunction find;
+};
+
+std::vector<Scanner> available_scanners() {
+    std::vector<Scanner> scanners{{"scalar", json_escape::find_escape_scalar}};
+#ifdef DCLI_ESCAPE_X86
+    scanners.push_back({"sse2", json_escape::find_escape_sse2});
+    if (__builtin_cpu_supports("avx2")) scanners.push_back({"avx2", json_escape::find_escape_avx2});
+#endif
+    return scanners;
+}
+
+// Inputs that exercise every byte value, block boundaries and multi-byte UTF-8
+std::vector<std::string> equivalence_inputs() {
+    std::vector<std::string> inputs{"", "plain", "\"", "\\", "\x7f", "日本語のメッセージ", "emoji 🎉 and \"quotes\"\n"};
+    for (int c = 0; c < 256; ++c) {
+        inputs.push_back(std::string(1, static_cast<char>(c)));
+        // 各ブロック境界の前後に置く
+        for (size_t at : {15, 16, 17, 31, 32, 33, 63, 64}) {
+            std::string text(at + 8, 'a');
+            text[at] = static_cast<char>(c);
+            inputs.push_back(text);
+        }
+    }
+    std::mt19937 rng(42);
+    const std::vector<std::string> pieces{"a", "Z", " ", "\"", "\\", "\n", "\t", "\x01", "\x1f", "é", "日本", "🎉", "\xff", "\x80"};
+    for (int i = 0; i < 20000; ++i) {
+        std::string text;
+        size_t length = rng() % 200;
+        while (text.size() < length) {
+            text += rng() % 4 == 0 ? pieces[rng() % pieces.size()] : std::string(rng() % 40, 'x');
+        }
+        inputs.push_back(text);
+    }
+    for (int i = 0; i < 2000; ++i) {
+        std::string text(rng() % 300, '\0');
+        for (auto& c : text) c = static_cast<char>(rng());
+        inputs.push_back(text);
+    }
+    return inputs;
+}
+
+size_t check_equivalence(const std::vector<Scanner>& scanners) {
+    size_t mismatches = 0;
+    std::string out;
+    for (const auto& input : equivalence_inputs()) {
+        std::string expected = legacy_escape_json(input);
+        for (const auto& scanner : scanners) {
+            out.clear();
+            json_escape::append_escaped(out, input, scanner.find);
+            if (out != expected && mismatches++ < 5) {
+                std::cerr << scanner.name << " differs from escape_json for input of " << input.size() << " bytes" << std::endl;
+            }
+        }
+    }
+    return mismatches;
+}
+
+// Message shapes: a short chat line, a long prose message, a code block, Japanese text
+std::vector<std::pair<std::string, std::string>> corpus() {
+    std::string prose;
+    while (prose.size() < 1900) prose += "The deploy finished without errors and all health checks are green. ";
+    std::string code = "```cpp\n";
+    while (code.size() < 1900) code += "\tif (value == \"x\") { return \"\\\\path\\\\to\"; }\n";
+    code += "```";
+    std::string japanese;
+    while (japanese.size() < 1900) japanese += "本日のデプロイは正常に完了しました。";
+    return {{"short", "Build #1234 passed on main"}, {"prose", prose}, {"code", code}, {"japanese", japanese}};
+}
+
+int main() {
+    auto scanners = available_scanners();
+    size_t mismatches = check_equivalence(scanners);
+
+    json results = {{"equivalent", mismatches == 0}, {"mismatches", mismatches}};
+    std::vector<std::pair<std::string, std::function<void(std::string&, const std::string&)>>> variants{
+        {"legacy", [](std::string& out, const std::string& in) { out = legacy_escape_json(in); }}};
+    for (const auto& scanner : scanners) {
+        auto find = scanner.find;
+        variants.push_back({scanner.name, [find](std::string& out, const std::string& in) {
+                                out.clear();
+                                json_escape::append_escaped(out, in, find);
+                            }});
+    }
+
+    std::string out;
+    for (const auto& [shape, text] : corpus()) {
+        json row;
+        for (const auto& [name, escape] : variants) {
+            size_t iterations = std::max<size_t>(2000, 20000000 / (text.size() + 1));
+            auto start = std::chrono::steady_clock::now();
+            for (size_t i = 0; i < iterations; ++i) {
+                escape(out, text);
+                asm volatile("" : : "r"(out.data()) : "memory");
+            }
+            double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            row[name] = {{"ns_per_message", seconds * 1e9 / iterations},
+                         {"mb_per_sec", text.size() * iterations / seconds / 1e6}};
+        }
+        row["bytes"] = text.size();
+        results[shape] = row;
+    }
+    std::cout << results.dump(2) << std::endl;
+    return mismatches == 0 ? 0 : 1;
+}
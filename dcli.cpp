@@ -14,198 +14,4984 @@
 #include <limits>
 #include <map>
 #include <algorithm>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <vector>
+#include <cctype>
+#include <tuple>
+#include <deque>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+#include <csignal>
+#include <cerrno>
+#include <cstring>
+#include <cmath>
+#include <random>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <string_view>
+#include <ctime>
+#include <queue>
+#include <unordered_map>
+#include <iterator>
+#include <dirent.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <poll.h>
+#include <zlib.h>
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+#include <charconv>
+#include "json_escape.hpp"
 
 using json = nlohmann::json;
 
+// Discord API のベース URL
+// DCLI_API_BASE でローカルのモックサーバーなどに向けられる
+std::string get_api_base() {
+    const char* base = getenv("DCLI_API_BASE");
+    return base && *base ? base : "https://discord.com/api/v10";
+}
+
+const std::string API_BASE = get_api_base();
+
 // ヘルパークラス：リソース自動管理
 struct CurlHandleDeleter {
     void operator()(CURL* curl) const { curl_easy_cleanup(curl); }
 };
 using CurlHandle = std::unique_ptr<CURL, CurlHandleDeleter>;
 
-struct CurlSlistDeleter {
-    void operator()(curl_slist* list) const { curl_slist_free_all(list); }
-};
-using CurlSlist = std::unique_ptr<curl_slist, CurlSlistDeleter>;
+struct CurlSlistDeleter {
+    void operator()(curl_slist* list) const { curl_slist_free_all(list); }
+};
+using CurlSlist = std::unique_ptr<curl_slist, CurlSlistDeleter>;
+
+struct CurlShareDeleter {
+    void operator()(CURLSH* share) const { curl_share_cleanup(share); }
+};
+using CurlShare = std::unique_ptr<CURLSH, CurlShareDeleter>;
+
+// 設定ファイルのディレクトリとパスを取得
+std::string get_config_dir() {
+    const char* home = getenv("HOME");
+    if (!home) throw std::runtime_error("HOME environment variable not set");
+    return std::string(home) + "/.config/dcli/";
+}
+
+std::string get_config_path() {
+    return get_config_dir() + "config.json";
+}
+
+// 設定を保存
+void save_config(const std::string& token, const std::map<std::string, std::string>& channels, const std::string& last_used_channel) {
+    try {
+        const std::string config_dir = get_config_dir();
+        mkdir(config_dir.c_str(), 0700);
+
+        // tokens, webhooks など他のキーはそのまま残す
+        json config = json::object();
+        std::ifstream existing(get_config_path());
+        if (existing) {
+            json old = json::parse(existing, nullptr, false);
+            if (old.is_object()) config = std::move(old);
+        }
+        config["token"] = token;
+        config["channels"] = channels;
+        config["last_used_channel"] = last_used_channel;
+
+        std::ofstream file(get_config_path());
+        if (!file) throw std::runtime_error("Cannot open config file");
+
+        file << config.dump(4);
+
+        chmod(get_config_path().c_str(), 0600);
+        std::cout << "Config saved successfully." << std::endl;
+    } catch (const std::exception& e) {
+        std::cerr << "Error saving config: " << e.what() << std::endl;
+        throw;
+    }
+}
+
+// 設定を読み込み
+std::tuple<std::string, std::map<std::string, std::string>, std::string> load_config() {
+    try {
+        std::ifstream file(get_config_path());
+        if (!file) throw std::runtime_error("Config file not found");
+
+        json config;
+        file >> config;
+
+        std::string token = config["token"];
+        std::map<std::string, std::string> channels = config["channels"].get<std::map<std::string, std::string>>();
+        std::string last_used_channel = config.value("last_used_channel", "");
+
+        return {token, channels, last_used_channel};
+    } catch (const std::exception& e) {
+        std::cerr << "Error loading config: " << e.what() << std::endl;
+        throw;
+    }
+}
+
+// ヘルプメッセージを表示
+void print_help() {
+    std::cout << "Usage: dcli [options]\n";
+    std::cout << "       dcli [--channel <NAME|ID>] send [MESSAGE...]\n";
+    std::cout << "Options:\n";
+    std::cout << "  --token <TOKEN>            Set Discord Bot Token\n";
+    std::cout << "  --switch                   Switch to a different channel by name\n";
+    std::cout << "  --add                      Add a new channel ID and name\n";
+    std::cout << "  --remove                   Remove a channel ID and name\n";
+    std::cout << "  --channel <NAME|ID>        Send to this channel instead of the last used one\n";
+    std::cout << "  --batch[=FILE]             Send each line of FILE (default: stdin) as a message\n";
+    std::cout << "  --coalesce[=MS]            Pack lines sent within MS milliseconds (default 500) into fewer messages\n";
+    std::cout << "  --history <N>              Print the last N messages of the channel, fetching older pages as needed\n";
+    std::cout << "  --tail-all[=N]             Print the latest N messages across all channels, merged by time\n";
+    std::cout << "  --sync-guild[=GUILD_ID]    Fetch the channel lists of the bot's guilds for --channel and --switch\n";
+    std::cout << "  --export <NAME|ID>         Export the channel's full history as gzip-compressed NDJSON (resumable)\n";
+    std::cout << "  --out <FILE>               Output file for --export (default: <CHANNEL_ID>.ndjson.gz)\n";
+    std::cout << "  --search <QUERY>           Search fetched messages in all channels (from:, in:, after:, before: filters)\n";
+    std::cout << "  --follow                   Print new messages in configured channels as they arrive (Gateway)\n";
+    std::cout << "  --attach <FILE>            Upload FILE as an attachment and exit (repeatable)\n";
+    std::cout << "  --metrics <FILE>           Append per-request timings as NDJSON to FILE\n";
+    std::cout << "  --daemon                   Keep a warm connection and accept 'dcli send' over a Unix socket\n";
+    std::cout << "  --latency-bench[=N]        Compare cold vs. reused connection latency over N requests\n";
+    std::cout << "  --help                     Show this help message\n";
+}
+
+// コールバック関数を定義
+size_t WriteCallback(void* ptr, size_t size, size_t nmemb, void* userp) {
+    ((std::string*)userp)->append((char*)ptr, size * nmemb);
+    return size * nmemb;
+}
+
+// レスポンスヘッダー (キーは小文字化)
+using HeaderMap = std::map<std::string, std::string, std::less<>>;
+
+// CURLINFO timing breakdown of a request. Times are in microseconds from the start
+// of the request, as curl reports them (namelookup <= connect <= appconnect <= starttransfer <= total).
+struct RequestTiming {
+    curl_off_t namelookup = 0;
+    curl_off_t connect = 0;
+    curl_off_t appconnect = 0;
+    curl_off_t starttransfer = 0;
+    curl_off_t total = 0;
+    curl_off_t bytes_sent = 0;
+    curl_off_t bytes_received = 0;
+    long new_connections = 0; // 0 なら既存の接続を再利用した
+};
+
+// Result of a single HTTP request
+struct HttpResponse {
+    CURLcode result = CURLE_OK;
+    long status = 0;
+    std::string body;
+    HeaderMap headers;
+    RequestTiming timing;
+
+    bool ok() const { return result == CURLE_OK && status >= 200 && status < 300; }
+
+    // Clear for reuse, keeping the body's capacity and the header nodes
+    void reset() {
+        result = CURLE_OK;
+        status = 0;
+        body.clear();
+        timing = RequestTiming();
+        while (!headers.empty()) spare_headers_.push_back(headers.extract(headers.begin()));
+    }
+
+    // Store a header under its lowercased name, recycling a spare node if there is one
+    void set_header(std::string_view name, std::string_view value) {
+        if (spare_headers_.empty()) {
+            std::string key(name);
+            std::transform(key.begin(), key.end(), key.begin(), [](unsigned char c) { return std::tolower(c); });
+            headers[key].assign(value);
+            return;
+        }
+        HeaderMap::node_type node = std::move(spare_headers_.back());
+        spare_headers_.pop_back();
+        std::string& key = node.key();
+        key.assign(name);
+        std::transform(key.begin(), key.end(), key.begin(), [](unsigned char c) { return std::tolower(c); });
+        node.mapped().assign(value);
+        auto inserted = headers.insert(std::move(node));
+        if (!inserted.inserted) {
+            inserted.position->second.assign(value);
+            spare_headers_.push_back(std::move(inserted.node));
+        }
+    }
+
+private:
+    std::vector<HeaderMap::node_type> spare_headers_;
+};
+
+// Header callback: collects "Key: value" lines into an HttpResponse
+size_t HeaderCallback(char* buffer, size_t size, size_t nitems, void* userp) {
+    size_t total = size * nitems;
+    std::string_view line(buffer, total);
+    size_t colon = line.find(':');
+    if (colon != std::string_view::npos) {
+        size_t first = line.find_first_not_of(" \t", colon + 1);
+        size_t last = line.find_last_not_of(" \t\r\n");
+        std::string_view value = (first == std::string_view::npos || last < first) ? std::string_view() : line.substr(first, last - first + 1);
+        static_cast<HttpResponse*>(userp)->set_header(line.substr(0, colon), value);
+    }
+    return total;
+}
+
+// Build the default request headers for a bot token
+CurlSlist make_headers(const std::string& token) {
+    CurlSlist headers;
+    headers.reset(curl_slist_append(nullptr, "Content-Type: application/json"));
+    headers.reset(curl_slist_append(headers.release(), ("Authorization: " + token).c_str()));
+    return headers;
+}
+
+// Headers for multipart/form-data uploads: curl sets the Content-Type itself,
+// and "Expect:" skips the 100-continue round trip on HTTP/1.1
+CurlSlist make_form_headers(const std::string& token) {
+    CurlSlist headers;
+    headers.reset(curl_slist_append(nullptr, ("Authorization: " + token).c_str()));
+    headers.reset(curl_slist_append(headers.release(), "Expect:"));
+    return headers;
+}
+
+// Fill in status and timing of a finished transfer
+void read_transfer_info(CURL* curl, HttpResponse& response) {
+    if (response.result == CURLE_OK) {
+        curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &response.status);
+    }
+    RequestTiming& t = response.timing;
+    curl_easy_getinfo(curl, CURLINFO_NAMELOOKUP_TIME_T, &t.namelookup);
+    curl_easy_getinfo(curl, CURLINFO_CONNECT_TIME_T, &t.connect);
+    curl_easy_getinfo(curl, CURLINFO_APPCONNECT_TIME_T, &t.appconnect);
+    curl_easy_getinfo(curl, CURLINFO_STARTTRANSFER_TIME_T, &t.starttransfer);
+    curl_easy_getinfo(curl, CURLINFO_TOTAL_TIME_T, &t.total);
+    long request_size = 0, header_size = 0;
+    curl_off_t uploaded = 0, downloaded = 0;
+    curl_easy_getinfo(curl, CURLINFO_REQUEST_SIZE, &request_size);
+    curl_easy_getinfo(curl, CURLINFO_HEADER_SIZE, &header_size);
+    curl_easy_getinfo(curl, CURLINFO_SIZE_UPLOAD_T, &uploaded);
+    curl_easy_getinfo(curl, CURLINFO_SIZE_DOWNLOAD_T, &downloaded);
+    t.bytes_sent = request_size + uploaded;
+    t.bytes_received = header_size + downloaded;
+    curl_easy_getinfo(curl, CURLINFO_NUM_CONNECTS, &t.new_connections);
+}
+
+// Perform the request configured on `curl`, collecting status, body and headers
+// into `response`, which is reset first so its buffers can be reused
+void perform_request(CURL* curl, HttpResponse& response) {
+    response.reset();
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, WriteCallback);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, &response.body);
+    curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, HeaderCallback);
+    curl_easy_setopt(curl, CURLOPT_HEADERDATA, &response);
+    response.result = curl_easy_perform(curl);
+    read_transfer_info(curl, response);
+}
+
+HttpResponse perform_request(CURL* curl) {
+    HttpResponse response;
+    perform_request(curl, response);
+    return response;
+}
+
+// Connection manager: keeps curl handles warm and shares the DNS, TLS session and
+// connection caches between them, so every request after the first skips the
+// DNS lookup and TCP/TLS handshakes. HTTP/2 is negotiated where the server allows it.
+// libcurl can't share a connection cache between threads running transfers at the
+// same time, so handles for another thread (new_thread_handle) get a second share
+// without it.
+class ConnectionManager {
+public:
+    explicit ConnectionManager(const std::string& token)
+        : headers_(make_headers(token)), form_headers_(make_form_headers(token)), share_(curl_share_init()),
+          thread_share_(curl_share_init()), curl_(curl_easy_init()) {
+        if (!share_ || !thread_share_ || !curl_) throw std::runtime_error("Failed to initialize curl");
+        for (CURLSH* share : {share_.get(), thread_share_.get()}) {
+            curl_share_setopt(share, CURLSHOPT_LOCKFUNC, lock_share);
+            curl_share_setopt(share, CURLSHOPT_UNLOCKFUNC, unlock_share);
+            curl_share_setopt(share, CURLSHOPT_USERDATA, this);
+            curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+            curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+        }
+        curl_share_setopt(share_.get(), CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+        configure(curl_.get(), share_.get());
+    }
+
+    ConnectionManager(const ConnectionManager&) = delete;
+    ConnectionManager& operator=(const ConnectionManager&) = delete;
+
+    // Create an additional handle bound to the shared caches, for use on the thread
+    // that uses handle()
+    CurlHandle new_handle() {
+        CurlHandle curl(curl_easy_init());
+        if (!curl) throw std::runtime_error("Failed to initialize curl");
+        configure(curl.get(), share_.get());
+        return curl;
+    }
+
+    // Same, for a thread that runs transfers alongside the main one: DNS and TLS
+    // sessions are shared, connections are not (reuse happens within the thread's
+    // own curl_multi)
+    CurlHandle new_thread_handle() {
+        CurlHandle curl(curl_easy_init());
+        if (!curl) throw std::runtime_error("Failed to initialize curl");
+        configure(curl.get(), thread_share_.get());
+        return curl;
+    }
+
+    // Same, for multipart/form-data requests
+    CurlHandle new_form_handle() {
+        CurlHandle curl = new_handle();
+        curl_easy_setopt(curl.get(), CURLOPT_HTTPHEADER, form_headers_.get());
+        return curl;
+    }
+
+    HttpResponse get(const std::string& url) { return get(curl_.get(), url); }
+    HttpResponse post(const std::string& url, const std::string& body) { return post(curl_.get(), url, body); }
+
+    HttpResponse get(CURL* curl, const std::string& url) {
+        curl_easy_setopt(curl, CURLOPT_HTTPGET, 1L);
+        curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
+        return perform_request(curl);
+    }
+
+    HttpResponse post(CURL* curl, const std::string& url, const std::string& body) {
+        HttpResponse response;
+        post(curl, url, body, response);
+        return response;
+    }
+
+    // POST reusing `response`'s buffers (the send hot path)
+    void post(CURL* curl, const std::string& url, const std::string& body, HttpResponse& response) {
+        curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
+        curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE, static_cast<long>(body.size()));
+        curl_easy_setopt(curl, CURLOPT_POSTFIELDS, body.c_str());
+        perform_request(curl, response);
+    }
+
+    CURL* handle() const { return curl_.get(); }
+
+private:
+    void configure(CURL* curl, CURLSH* share) {
+        curl_easy_setopt(curl, CURLOPT_SHARE, share);
+        curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers_.get());
+        curl_easy_setopt(curl, CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_2TLS);
+        curl_easy_setopt(curl, CURLOPT_PIPEWAIT, 1L);
+        curl_easy_setopt(curl, CURLOPT_TCP_KEEPALIVE, 1L);
+        curl_easy_setopt(curl, CURLOPT_DNS_CACHE_TIMEOUT, 300L);
+        // gzip/deflate/br などサポートされている全ての圧縮を受け付ける
+        curl_easy_setopt(curl, CURLOPT_ACCEPT_ENCODING, "");
+    }
+
+    static void lock_share(CURL*, curl_lock_data data, curl_lock_access, void* userp) {
+        static_cast<ConnectionManager*>(userp)->locks_[data].lock();
+    }
+
+    static void unlock_share(CURL*, curl_lock_data data, void* userp) {
+        static_cast<ConnectionManager*>(userp)->locks_[data].unlock();
+    }
+
+    // 破棄順序: ハンドル → share → ヘッダー → ロック
+    std::mutex locks_[CURL_LOCK_DATA_LAST];
+    CurlSlist headers_;
+    CurlSlist form_headers_;
+    CurlShare share_;
+    CurlShare thread_share_; // CONNECT を含まない
+    CurlHandle curl_;
+};
+
+struct CurlMultiDeleter {
+    void operator()(CURLM* multi) const { curl_multi_cleanup(multi); }
+};
+using CurlMulti = std::unique_ptr<CURLM, CurlMultiDeleter>;
+
+// Runs several GETs at once over curl_multi. Handles come from the ConnectionManager,
+// so they share its caches and multiplex over one HTTP/2 connection where possible.
+class MultiFetcher {
+public:
+    MultiFetcher(ConnectionManager& conn, size_t max_in_flight) : multi_(curl_multi_init()) {
+        if (!multi_) throw std::runtime_error("Failed to initialize curl");
+        curl_multi_setopt(multi_.get(), CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+        for (size_t i = 0; i < max_in_flight; ++i) {
+            auto transfer = std::make_unique<Transfer>();
+            transfer->curl = conn.new_handle();
+            curl_easy_setopt(transfer->curl.get(), CURLOPT_PRIVATE, transfer.get());
+            transfers_.push_back(std::move(transfer));
+        }
+    }
+
+    ~MultiFetcher() {
+        for (auto& transfer : transfers_) {
+            if (transfer->busy) curl_multi_remove_handle(multi_.get(), transfer->curl.get());
+        }
+    }
+
+    bool full() const { return in_flight_ == transfers_.size(); }
+    size_t in_flight() const { return in_flight_; }
+
+    // Start a GET; `tag` is handed back with its response
+    void start(const std::string& url, size_t tag) {
+        for (auto& transfer : transfers_) {
+            if (transfer->busy) continue;
+            transfer->busy = true;
+            transfer->tag = tag;
+            transfer->url = url;
+            transfer->response.reset();
+            CURL* curl = transfer->curl.get();
+            curl_easy_setopt(curl, CURLOPT_HTTPGET, 1L);
+            curl_easy_setopt(curl, CURLOPT_URL, transfer->url.c_str());
+            curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, WriteCallback);
+            curl_easy_setopt(curl, CURLOPT_WRITEDATA, &transfer->response.body);
+            curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, HeaderCallback);
+            curl_easy_setopt(curl, CURLOPT_HEADERDATA, &transfer->response);
+            curl_multi_add_handle(multi_.get(), curl);
+            ++in_flight_;
+            return;
+        }
+        throw std::logic_error("MultiFetcher::start called with no free handle");
+    }
+
+    // Drive transfers for up to `timeout`; returns the ones that finished as (tag, response)
+    std::vector<std::pair<size_t, HttpResponse>> poll(std::chrono::milliseconds timeout) {
+        std::vector<std::pair<size_t, HttpResponse>> done;
+        int running = 0;
+        curl_multi_perform(multi_.get(), &running);
+        collect(done);
+        if (done.empty()) {
+            curl_multi_poll(multi_.get(), nullptr, 0, static_cast<int>(timeout.count()), nullptr);
+            curl_multi_perform(multi_.get(), &running);
+            collect(done);
+        }
+        return done;
+    }
+
+private:
+    struct Transfer {
+        CurlHandle curl;
+        HttpResponse response;
+        std::string url;
+        size_t tag = 0;
+        bool busy = false;
+    };
+
+    void collect(std::vector<std::pair<size_t, HttpResponse>>& done) {
+        int queued = 0;
+        while (CURLMsg* msg = curl_multi_info_read(multi_.get(), &queued)) {
+            if (msg->msg != CURLMSG_DONE) continue;
+            Transfer* transfer = nullptr;
+            curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, &transfer);
+            transfer->response.result = msg->data.result;
+            read_transfer_info(msg->easy_handle, transfer->response);
+            curl_multi_remove_handle(multi_.get(), msg->easy_handle);
+            transfer->busy = false;
+            --in_flight_;
+            done.emplace_back(transfer->tag, std::move(transfer->response));
+        }
+    }
+
+    // 破棄順序: ハンドルを外してから multi を解放
+    CurlMulti multi_;
+    std::vector<std::unique_ptr<Transfer>> transfers_;
+    size_t in_flight_ = 0;
+};
+
+// 受信メッセージのキャッシュディレクトリ
+std::string get_cache_dir() {
+    return get_config_dir() + "cache/";
+}
+
+// Discord snowflake helpers
+uint64_t parse_snowflake(const std::string& id) {
+    return std::strtoull(id.c_str(), nullptr, 10);
+}
+
+// Milliseconds since the Unix epoch at which a snowflake was created
+uint64_t snowflake_timestamp_ms(uint64_t id) {
+    return (id >> 22) + 1420070400000ULL;
+}
+
+// A message as kept in the local cache
+struct StoredMessage {
+    uint64_t id = 0;
+    std::string author;
+    std::string content;
+};
+
+// Read-only view of a cached message, pointing into the mapped file
+struct MessageView {
+    uint64_t id;
+    std::string_view author;
+    std::string_view content;
+};
+
+// Per-channel message cache. Messages are appended as records to
+// ~/.config/dcli/cache/<channel>.msgs, which is memory-mapped for reading and
+// indexed in memory by snowflake, so lookups never copy message text.
+class MessageStore {
+public:
+    explicit MessageStore(const std::string& channel_id) : path_(get_cache_dir() + channel_id + ".msgs") {
+        mkdir(get_config_dir().c_str(), 0700);
+        mkdir(get_cache_dir().c_str(), 0700);
+        fd_ = ::open(path_.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+        if (fd_ < 0) throw std::runtime_error("Cannot open message cache: " + path_);
+        refresh();
+    }
+
+    ~MessageStore() {
+        if (data_) munmap(const_cast<char*>(data_), mapped_);
+        if (fd_ >= 0) close(fd_);
+    }
+
+    MessageStore(const MessageStore&) = delete;
+    MessageStore& operator=(const MessageStore&) = delete;
+
+    size_t size() const { return index_.size(); }
+    uint64_t first_id() const { return index_.empty() ? 0 : index_.front().first; }
+    uint64_t last_id() const { return index_.empty() ? 0 : index_.back().first; }
+
+    // i-th cached message in snowflake (chronological) order
+    MessageView at(size_t i) const {
+        const char* record = data_ + index_[i].second;
+        RecordHeader header;
+        std::memcpy(&header, record, sizeof(header));
+        const char* text = record + sizeof(header);
+        return {header.id, std::string_view(text, header.author_size),
+                std::string_view(text + header.author_size, header.content_size)};
+    }
+
+    bool contains(uint64_t id) const {
+        auto it = std::lower_bound(index_.begin(), index_.end(), std::make_pair(id, uint64_t(0)));
+        return it != index_.end() && it->first == id;
+    }
+
+    // Look up a cached message by snowflake
+    bool find(uint64_t id, MessageView& view) const {
+        auto it = std::lower_bound(index_.begin(), index_.end(), std::make_pair(id, uint64_t(0)));
+        if (it == index_.end() || it->first != id) return false;
+        view = at(it - index_.begin());
+        return true;
+    }
+
+    // File offset of the i-th message, and of the end of the last complete record
+    // (records are only ever appended, so offsets past a saved end are new)
+    uint64_t offset(size_t i) const { return index_[i].second; }
+    uint64_t end_offset() const { return indexed_end_; }
+
+    // Append the messages not already cached; returns how many were new
+    size_t append(const std::vector<StoredMessage>& messages) {
+        flock(fd_, LOCK_EX);
+        refresh(); // 他のプロセスが追記した分を取り込む
+        std::string buffer;
+        std::vector<uint64_t> ids;
+        for (const auto& message : messages) {
+            if (contains(message.id) || std::find(ids.begin(), ids.end(), message.id) != ids.end()) continue;
+            RecordHeader header{message.id, static_cast<uint32_t>(message.author.size()), static_cast<uint32_t>(message.content.size())};
+            buffer.append(reinterpret_cast<const char*>(&header), sizeof(header));
+            buffer += message.author;
+            buffer += message.content;
+            ids.push_back(message.id);
+        }
+        if (!buffer.empty()) {
+            if (pwrite(fd_, buffer.data(), buffer.size(), indexed_end_) != static_cast<ssize_t>(buffer.size())) {
+                flock(fd_, LOCK_UN);
+                throw std::runtime_error("Cannot write message cache: " + path_);
+            }
+            refresh();
+        }
+        flock(fd_, LOCK_UN);
+        return ids.size();
+    }
+
+private:
+    struct RecordHeader {
+        uint64_t id;
+        uint32_t author_size;
+        uint32_t content_size;
+    };
+    static constexpr char MAGIC[8] = {'D', 'C', 'L', 'I', 'M', 'S', 'G', '1'};
+
+    // Map the file and index any records past the indexed end
+    void refresh() {
+        struct stat st;
+        if (fstat(fd_, &st) < 0) throw std::runtime_error("Cannot stat message cache: " + path_);
+        size_t size = st.st_size;
+        if (size == 0) {
+            if (pwrite(fd_, MAGIC, sizeof(MAGIC), 0) != sizeof(MAGIC)) throw std::runtime_error("Cannot write message cache: " + path_);
+            size = sizeof(MAGIC);
+        }
+        if (size == mapped_) return;
+
+        if (data_) munmap(const_cast<char*>(data_), mapped_);
+        void* data = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd_, 0);
+        if (data == MAP_FAILED) throw std::runtime_error("Cannot map message cache: " + path_);
+        data_ = static_cast<const char*>(data);
+        mapped_ = size;
+
+        if (indexed_end_ == 0) {
+            if (std::memcmp(data_, MAGIC, sizeof(MAGIC)) != 0) throw std::runtime_error("Not a dcli message cache: " + path_);
+            indexed_end_ = sizeof(MAGIC);
+        }
+        bool sorted = true;
+        while (indexed_end_ + sizeof(RecordHeader) <= mapped_) {
+            RecordHeader header;
+            std::memcpy(&header, data_ + indexed_end_, sizeof(header));
+            size_t end = indexed_end_ + sizeof(header) + header.author_size + header.content_size;
+            if (end > mapped_) break; // 書きかけのレコード
+            if (!index_.empty() && header.id < index_.back().first) sorted = false;
+            index_.emplace_back(header.id, indexed_end_);
+            indexed_end_ = end;
+        }
+        if (!sorted) std::sort(index_.begin(), index_.end());
+    }
+
+    std::string path_;
+    int fd_ = -1;
+    const char* data_ = nullptr;
+    size_t mapped_ = 0;
+    size_t indexed_end_ = 0;
+    std::vector<std::pair<uint64_t, uint64_t>> index_; // (snowflake, file offset)
+};
+
+// Open message stores, one per channel
+class MessageCache {
+public:
+    MessageStore& channel(const std::string& channel_id) {
+        auto& store = stores_[channel_id];
+        if (!store) store = std::make_unique<MessageStore>(channel_id);
+        return *store;
+    }
+
+private:
+    std::map<std::string, std::unique_ptr<MessageStore>> stores_;
+};
+
+// Number of most recent messages /get looks at
+const size_t RECENT_WINDOW = 100;
+
+// Function to retrieve recent messages from a specific user
+void get_recent_messages(const MessageStore& store, const std::string& username) {
+    std::vector<std::string_view> user_messages;
+    size_t begin = store.size() > RECENT_WINDOW ? store.size() - RECENT_WINDOW : 0;
+    for (size_t i = begin; i < store.size(); ++i) {
+        MessageView message = store.at(i);
+        if (message.author == username) {
+            user_messages.push_back(message.content);
+        }
+    }
+    if (user_messages.empty()) {
+        std::cout << "No messages found for user: " << username << "\n";
+    } else {
+        for (const auto& msg : user_messages) {
+            std::cout << msg << "\n";
+        }
+    }
+}
+
+// Function to list recent usernames
+std::vector<std::string> list_recent_usernames(const MessageStore& store) {
+    std::set<std::string> usernames;
+    size_t begin = store.size() > RECENT_WINDOW ? store.size() - RECENT_WINDOW : 0;
+    for (size_t i = begin; i < store.size(); ++i) {
+        usernames.insert(std::string(store.at(i).author));
+    }
+    return std::vector<std::string>(usernames.begin(), usernames.end());
+}
+
+// Function to trim whitespace from both ends of a string
+std::string trim(const std::string& str) {
+    size_t first = str.find_first_not_of(' ');
+    if (first == std::string::npos) return "";
+    size_t last = str.find_last_not_of(' ');
+    return str.substr(first, last - first + 1);
+}
+
+// Split command arguments on whitespace like a shell would: 'single' and "double"
+// quotes keep spaces, and a backslash escapes the next character (outside single
+// quotes). Returns false on an unterminated quote.
+bool split_args(const std::string& text, std::vector<std::string>& args) {
+    std::string arg;
+    bool in_arg = false;
+    char quote = 0;
+    for (size_t i = 0; i < text.size(); ++i) {
+        char c = text[i];
+        if (quote == '\'') {
+            if (c == '\'') quote = 0; else arg += c;
+        } else if (c == '\\' && i + 1 < text.size() && (quote == 0 || text[i + 1] == '"' || text[i + 1] == '\\')) {
+            arg += text[++i];
+            in_arg = true;
+        } else if (quote == '"') {
+            if (c == '"') quote = 0; else arg += c;
+        } else if (c == '\'' || c == '"') {
+            quote = c;
+            in_arg = true;
+        } else if (c == ' ' || c == '\t') {
+            if (in_arg) args.push_back(std::move(arg));
+            arg.clear();
+            in_arg = false;
+        } else {
+            arg += c;
+            in_arg = true;
+        }
+    }
+    if (in_arg) args.push_back(std::move(arg));
+    return quote == 0;
+}
+
+// チャンネルのメッセージ URL を組み立てる
+std::string messages_url(const std::string& channel_id) {
+    return API_BASE + "/channels/" + channel_id + "/messages";
+}
+
+// Same, written into a reused buffer
+void messages_url(std::string& url, const std::string& channel_id) {
+    url.assign(API_BASE).append("/channels/").append(channel_id).append("/messages");
+}
+
+std::string ascii_lower(std::string_view text) {
+    std::string lower(text);
+    for (auto& c : lower) c = static_cast<char>(std::tolower(static_cast<unsigned char>(c)));
+    return lower;
+}
+
+// --sync-guild で取得したチャンネル一覧の保存先
+std::string get_directory_path() {
+    return get_config_dir() + "channels.dir";
+}
+
+// A guild text channel, as fetched by --sync-guild
+struct DirectoryChannel {
+    uint64_t id = 0;
+    uint64_t guild_id = 0;
+    std::string name;
+};
+
+// Channels of the synced guilds in one memory-mapped file, indexed both ways:
+// entries sorted by channel ID (id → name) and a table of entry numbers sorted
+// by lowercased name (name → id, prefix lookups). Layout (native byte order):
+//   Header | Guild[guild_count] (by ID) | Entry[channel_count] (by ID) |
+//   uint32 by_name[channel_count] | name bytes
+class ChannelDirectory {
+public:
+    struct Channel {
+        uint64_t id = 0;
+        std::string_view name;
+        std::string_view guild;
+    };
+
+    ChannelDirectory() = default;
+    ~ChannelDirectory() {
+        if (data_) munmap(const_cast<char*>(data_), size_);
+    }
+
+    ChannelDirectory(const ChannelDirectory&) = delete;
+    ChannelDirectory& operator=(const ChannelDirectory&) = delete;
+
+    // Map the directory at `path`; false if there is none (or it is unreadable)
+    bool open(const std::string& path) {
+        int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) return false;
+        struct stat st;
+        if (fstat(fd, &st) < 0 || static_cast<size_t>(st.st_size) < sizeof(Header)) {
+            close(fd);
+            return false;
+        }
+        void* data = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if (data == MAP_FAILED) return false;
+        Header header;
+        std::memcpy(&header, data, sizeof(header));
+        size_t strings = sizeof(Header) + header.guild_count * sizeof(Guild) + header.channel_count * (sizeof(Entry) + sizeof(uint32_t));
+        bool valid = std::memcmp(header.magic, MAGIC, sizeof(MAGIC)) == 0 && strings <= static_cast<size_t>(st.st_size) &&
+                     header.strings_size <= static_cast<size_t>(st.st_size) - strings;
+        if (valid) {
+            data_ = static_cast<const char*>(data);
+            header_ = header;
+            guilds_ = reinterpret_cast<const Guild*>(data_ + sizeof(Header));
+            entries_ = reinterpret_cast<const Entry*>(guilds_ + header.guild_count);
+            by_name_ = reinterpret_cast<const uint32_t*>(entries_ + header.channel_count);
+            strings_ = data_ + strings;
+            valid = check_tables();
+        }
+        if (!valid) {
+            munmap(data, st.st_size);
+            data_ = nullptr;
+            header_ = Header{};
+            std::cerr << "Ignoring broken channel directory: " << path << std::endl;
+            return false;
+        }
+        size_ = st.st_size;
+        return true;
+    }
+
+    size_t size() const { return header_.channel_count; }
+    size_t guild_count() const { return header_.guild_count; }
+
+    // i-th channel in ID order / in name order
+    Channel at(size_t i) const {
+        const Entry& entry = entries_[i];
+        const Guild& guild = guilds_[entry.guild];
+        return {entry.id, string(entry.name_offset, entry.name_size), string(guild.name_offset, guild.name_size)};
+    }
+    Channel by_name(size_t k) const { return at(by_name_[k]); }
+
+    bool find(uint64_t id, Channel& channel) const {
+        const Entry* end = entries_ + size();
+        const Entry* it = std::lower_bound(entries_, end, id, [](const Entry& entry, uint64_t id) { return entry.id < id; });
+        if (it == end || it->id != id) return false;
+        channel = at(it - entries_);
+        return true;
+    }
+
+    // Positions in name order whose name starts with `prefix` (case-insensitive)
+    std::pair<size_t, size_t> name_range(std::string_view prefix) const {
+        std::string lower = ascii_lower(prefix);
+        auto key = [&](size_t k) { return ascii_lower(by_name(k).name.substr(0, lower.size())); };
+        size_t lo = 0, hi = size();
+        while (lo < hi) {
+            size_t mid = (lo + hi) / 2;
+            if (key(mid) < lower) lo = mid + 1; else hi = mid;
+        }
+        size_t first = lo;
+        hi = size();
+        while (lo < hi) {
+            size_t mid = (lo + hi) / 2;
+            if (key(mid) <= lower) lo = mid + 1; else hi = mid;
+        }
+        return {first, lo};
+    }
+
+    // Channel ID for "name" (when only one synced guild has it) or "guild/name", or ""
+    std::string resolve(std::string_view name) const {
+        if (!name.empty() && name[0] == '#') name.remove_prefix(1);
+        std::string_view guild;
+        size_t slash = name.find('/');
+        if (slash != std::string_view::npos) {
+            guild = name.substr(0, slash);
+            name = name.substr(slash + 1);
+            if (!name.empty() && name[0] == '#') name.remove_prefix(1);
+        }
+        auto [first, last] = name_range(name);
+        std::string found;
+        for (size_t k = first; k < last; ++k) {
+            Channel channel = by_name(k);
+            if (channel.name.size() != name.size()) continue;
+            if (!guild.empty() && ascii_lower(channel.guild) != ascii_lower(guild)) continue;
+            if (!found.empty()) return ""; // 複数のギルドにある名前は "guild/name" で指定する
+            found = std::to_string(channel.id);
+        }
+        return found;
+    }
+
+    // Copy out the channels of the guilds `wanted` accepts, to carry them over into a new directory
+    void read(std::map<uint64_t, std::string>& guilds, std::vector<DirectoryChannel>& channels,
+              const std::function<bool(uint64_t)>& wanted) const {
+        for (size_t i = 0; i < size(); ++i) {
+            const Guild& guild = guilds_[entries_[i].guild];
+            if (!wanted(guild.id)) continue;
+            guilds[guild.id] = std::string(string(guild.name_offset, guild.name_size));
+            channels.push_back({entries_[i].id, guild.id, std::string(at(i).name)});
+        }
+    }
+
+    // Write a directory file (via a temporary file and rename)
+    static bool write(const std::string& path, const std::map<uint64_t, std::string>& guilds, std::vector<DirectoryChannel> channels) {
+        std::sort(channels.begin(), channels.end(), [](const auto& a, const auto& b) { return a.id < b.id; });
+        channels.erase(std::unique(channels.begin(), channels.end(), [](const auto& a, const auto& b) { return a.id == b.id; }), channels.end());
+
+        std::string strings;
+        std::vector<Guild> guild_table;
+        std::map<uint64_t, uint32_t> guild_index;
+        for (const auto& [id, name] : guilds) {
+            guild_index[id] = static_cast<uint32_t>(guild_table.size());
+            guild_table.push_back({id, static_cast<uint32_t>(strings.size()), static_cast<uint32_t>(name.size())});
+            strings += name;
+        }
+        std::vector<Entry> entries;
+        for (const auto& channel : channels) {
+            auto guild = guild_index.find(channel.guild_id);
+            if (guild == guild_index.end()) continue;
+            entries.push_back({channel.id, guild->second, static_cast<uint32_t>(strings.size()), static_cast<uint32_t>(channel.name.size()), 0});
+            strings += channel.name;
+        }
+        std::vector<uint32_t> by_name(entries.size());
+        for (uint32_t i = 0; i < by_name.size(); ++i) by_name[i] = i;
+        auto name_of = [&](uint32_t i) { return ascii_lower(std::string_view(strings).substr(entries[i].name_offset, entries[i].name_size)); };
+        auto guild_of = [&](uint32_t i) { return entries[i].guild; };
+        std::sort(by_name.begin(), by_name.end(), [&](uint32_t a, uint32_t b) {
+            return std::make_pair(name_of(a), guild_of(a)) < std::make_pair(name_of(b), guild_of(b));
+        });
+
+        Header header{};
+        std::memcpy(header.magic, MAGIC, sizeof(MAGIC));
+        header.guild_count = static_cast<uint32_t>(guild_table.size());
+        header.channel_count = static_cast<uint32_t>(entries.size());
+        header.strings_size = strings.size();
+
+        std::string tmp = path + ".tmp";
+        std::ofstream file(tmp, std::ios::binary | std::ios::trunc);
+        if (!file) return false;
+        file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        file.write(reinterpret_cast<const char*>(guild_table.data()), guild_table.size() * sizeof(Guild));
+        file.write(reinterpret_cast<const char*>(entries.data()), entries.size() * sizeof(Entry));
+        file.write(reinterpret_cast<const char*>(by_name.data()), by_name.size() * sizeof(uint32_t));
+        file.write(strings.data(), strings.size());
+        file.close();
+        if (!file) {
+            unlink(tmp.c_str());
+            return false;
+        }
+        return rename(tmp.c_str(), path.c_str()) == 0;
+    }
+
+private:
+    struct Header {
+        char magic[8];
+        uint32_t guild_count;
+        uint32_t channel_count;
+        uint64_t strings_size;
+    };
+    struct Guild {
+        uint64_t id;
+        uint32_t name_offset;
+        uint32_t name_size;
+    };
+    struct Entry {
+        uint64_t id;
+        uint32_t guild; // Guild テーブルの位置
+        uint32_t name_offset;
+        uint32_t name_size;
+        uint32_t reserved;
+    };
+    static constexpr char MAGIC[8] = {'D', 'C', 'L', 'I', 'D', 'I', 'R', '1'};
+
+    std::string_view string(uint32_t offset, uint32_t size) const { return {strings_ + offset, size}; }
+
+    // Whether every offset and index in the mapped tables stays inside the file,
+    // so a truncated or corrupt directory can't make at()/by_name() read past it
+    bool check_tables() const {
+        auto in_strings = [&](uint32_t offset, uint32_t size) { return uint64_t(offset) + size <= header_.strings_size; };
+        for (size_t i = 0; i < header_.guild_count; ++i) {
+            if (!in_strings(guilds_[i].name_offset, guilds_[i].name_size)) return false;
+        }
+        for (size_t i = 0; i < header_.channel_count; ++i) {
+            const Entry& entry = entries_[i];
+            if (entry.guild >= header_.guild_count || !in_strings(entry.name_offset, entry.name_size)) return false;
+            if (by_name_[i] >= header_.channel_count) return false;
+        }
+        return true;
+    }
+
+    const char* data_ = nullptr;
+    size_t size_ = 0;
+    Header header_{};
+    const Guild* guilds_ = nullptr;
+    const Entry* entries_ = nullptr;
+    const uint32_t* by_name_ = nullptr;
+    const char* strings_ = nullptr;
+};
+
+// The synced channel directory, mapped on first use (empty if never synced)
+const ChannelDirectory& channel_directory() {
+    static ChannelDirectory directory;
+    static bool opened = directory.open(get_directory_path());
+    (void)opened;
+    return directory;
+}
+
+// Resolve a channel given by name (from the config, then the synced guild
+// directory, where "guild/name" picks between guilds) or by raw ID
+std::string resolve_channel(const std::map<std::string, std::string>& channels, const std::string& name_or_id) {
+    auto it = channels.find(name_or_id);
+    if (it != channels.end()) return it->second;
+    if (!name_or_id.empty() && std::all_of(name_or_id.begin(), name_or_id.end(), [](unsigned char c) { return std::isdigit(c); })) {
+        return name_or_id;
+    }
+    return channel_directory().resolve(name_or_id);
+}
+
+// Config channel names by channel ID
+using ChannelNames = std::unordered_map<std::string, std::string>;
+
+ChannelNames channel_names(const std::map<std::string, std::string>& channels) {
+    ChannelNames names;
+    for (const auto& [name, id] : channels) names.emplace(id, name);
+    return names;
+}
+
+// Name to show for a channel ID: its name in the config, else "guild/#name"
+// from the synced directory, else the ID itself
+std::string channel_label(const ChannelNames& names, const std::string& channel_id) {
+    auto it = names.find(channel_id);
+    if (it != names.end()) return it->second;
+    ChannelDirectory::Channel channel;
+    if (channel_directory().find(parse_snowflake(channel_id), channel)) {
+        return std::string(channel.guild) + "/#" + std::string(channel.name);
+    }
+    return channel_id;
+}
+
+// Fuzzy matcher over the configured channels and the synced directory. A query
+// that extends the previous one only re-checks the previous matches, so typing
+// a longer filter stays fast however many channels there are.
+class ChannelPicker {
+public:
+    struct Candidate {
+        std::string label; // "name" (config) or "guild/#name"
+        std::string id;
+        std::string match; // 照合用に小文字化したラベル
+        int score = 0;
+    };
+
+    ChannelPicker(const std::map<std::string, std::string>& channels, const ChannelDirectory& directory)
+        : names_(channel_names(channels)) {
+        for (const auto& [name, id] : channels) {
+            candidates_.push_back({name, id, ascii_lower(name)});
+        }
+        for (size_t k = 0; k < directory.size(); ++k) {
+            ChannelDirectory::Channel channel = directory.by_name(k);
+            std::string id = std::to_string(channel.id);
+            if (names_.count(id)) continue;
+            std::string label = std::string(channel.guild) + "/#" + std::string(channel.name);
+            candidates_.push_back({label, std::move(id), ascii_lower(label)});
+        }
+    }
+
+    size_t size() const { return candidates_.size(); }
+    const Candidate& at(size_t i) const { return candidates_[i]; }
+    const ChannelNames& names() const { return names_; }
+
+    // Candidates matching `query`, best first
+    const std::vector<Candidate*>& filter(const std::string& query) {
+        std::string lower = ascii_lower(query);
+        bool narrowing = !last_query_.empty() && lower.compare(0, last_query_.size(), last_query_) == 0;
+        std::vector<Candidate*> pool;
+        if (narrowing) {
+            pool.swap(matches_);
+        } else {
+            for (auto& candidate : candidates_) pool.push_back(&candidate);
+        }
+        matches_.clear();
+        for (Candidate* candidate : pool) {
+            int score = match_score(candidate->match, lower);
+            if (score < 0) continue;
+            candidate->score = score;
+            matches_.push_back(candidate);
+        }
+        std::stable_sort(matches_.begin(), matches_.end(), [](const Candidate* a, const Candidate* b) {
+            return a->score != b->score ? a->score < b->score : a->label < b->label;
+        });
+        last_query_ = lower;
+        return matches_;
+    }
+
+private:
+    // Lower is better; -1 if `query` is not a subsequence of `text`. A prefix of
+    // the channel name beats a substring, which beats scattered letters.
+    static int match_score(const std::string& text, const std::string& query) {
+        if (query.empty()) return 0;
+        size_t hash = text.find('#');
+        std::string_view name = hash == std::string::npos ? std::string_view(text) : std::string_view(text).substr(hash + 1);
+        if (name.compare(0, query.size(), query) == 0) return 0;
+        size_t at = text.find(query);
+        if (at != std::string::npos) return 100 + static_cast<int>(at);
+        int gaps = 0;
+        size_t pos = 0;
+        for (char c : query) {
+            size_t found = text.find(c, pos);
+            if (found == std::string::npos) return -1;
+            gaps += static_cast<int>(found - pos);
+            pos = found + 1;
+        }
+        return 1000 + gaps;
+    }
+
+    ChannelNames names_;
+    std::vector<Candidate> candidates_;
+    std::vector<Candidate*> matches_;
+    std::string last_query_;
+};
+
+// チャンネル一覧をそのまま番号で選ばせる上限と、絞り込み中に表示する件数
+const size_t PICKER_LIST_ALL = 20;
+const size_t PICKER_SHOWN = 10;
+
+// Ask the user for a channel, starting from `query`: with few channels they
+// are listed by number as before; otherwise the typed text filters them until
+// one is picked. Returns the channel ID and its label (the config name for a
+// configured channel), or an empty ID if cancelled. `verb` fills in the
+// "Select a channel to ..." prompt.
+std::pair<std::string, std::string> pick_channel(const std::map<std::string, std::string>& channels, std::string query,
+                                                 const ChannelDirectory& directory = channel_directory(), const char* verb = "use") {
+    ChannelPicker picker(channels, directory);
+    if (picker.size() == 0) {
+        std::cerr << "No channels configured.\n";
+        return {};
+    }
+    auto read_line = [](const char* prompt, std::string& line) {
+        std::cout << prompt << std::flush;
+        if (!std::getline(std::cin, line)) return false;
+        line = trim(line);
+        return true;
+    };
+    auto parse_index = [](const std::string& text, size_t count) -> size_t {
+        if (text.empty() || text.size() > 3 || !std::all_of(text.begin(), text.end(), [](unsigned char c) { return std::isdigit(c); })) return 0;
+        size_t index = std::stoul(text);
+        return index <= count ? index : 0;
+    };
+
+    if (query.empty() && picker.size() <= PICKER_LIST_ALL) {
+        std::cout << "Select a channel to " << verb << ":\n";
+        for (size_t i = 0; i < picker.size(); ++i) std::cout << i + 1 << ". " << picker.at(i).label << "\n";
+        std::string line;
+        if (!read_line("Enter the number of the channel: ", line)) return {};
+        size_t index = parse_index(line, picker.size());
+        if (index == 0) {
+            std::cerr << "Invalid selection.\n";
+            return {};
+        }
+        return {picker.at(index - 1).id, picker.at(index - 1).label};
+    }
+
+    for (;;) {
+        if (query.empty()) {
+            std::cout << picker.size() << " channels. ";
+            if (!read_line("Type part of a name (empty to cancel): ", query) || query.empty()) return {};
+            continue;
+        }
+        // 名前をそのまま指定されたら選ぶ ("ops", "guild/name")
+        auto exact = channels.find(query);
+        if (exact != channels.end()) return {exact->second, exact->first};
+        std::string exact_id = directory.resolve(query);
+        if (!exact_id.empty()) return {exact_id, channel_label(picker.names(), exact_id)};
+        const auto& matches = picker.filter(query);
+        if (matches.size() == 1) {
+            return {matches[0]->id, matches[0]->label};
+        }
+        if (matches.empty()) {
+            std::cout << "No channel matches \"" << query << "\".\n";
+        } else {
+            size_t shown = std::min(matches.size(), PICKER_SHOWN);
+            for (size_t i = 0; i < shown; ++i) std::cout << i + 1 << ". " << matches[i]->label << "\n";
+            if (matches.size() > shown) std::cout << "   ... and " << matches.size() - shown << " more\n";
+        }
+        std::string line;
+        if (!read_line("Number to pick, or a new filter (empty to cancel): ", line) || line.empty()) return {};
+        size_t index = parse_index(line, std::min(matches.size(), PICKER_SHOWN));
+        if (index > 0) return {matches[index - 1]->id, matches[index - 1]->label};
+        query = line;
+    }
+}
+
+// Parse a header value given in (fractional) seconds
+std::chrono::steady_clock::duration parse_seconds(const std::string& value) {
+    double seconds = std::strtod(value.c_str(), nullptr);
+    if (seconds < 0) seconds = 0;
+    return std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(seconds));
+}
+
+// Log-scale histogram of durations in microseconds (4 buckets per power of two,
+// so percentiles are accurate to within ~19%)
+class Histogram {
+public:
+    void record(uint64_t us) {
+        ++counts_[index(us)];
+        ++count_;
+        sum_ += us;
+        max_ = std::max(max_, us);
+    }
+
+    uint64_t count() const { return count_; }
+    double mean_ms() const { return count_ ? sum_ / 1000.0 / count_ : 0.0; }
+    double max_ms() const { return max_ / 1000.0; }
+
+    double percentile_ms(double p) const {
+        if (count_ == 0) return 0;
+        uint64_t rank = std::max<uint64_t>(1, static_cast<uint64_t>(std::ceil(p * count_)));
+        uint64_t seen = 0;
+        for (size_t i = 0; i < BUCKETS; ++i) {
+            seen += counts_[i];
+            if (seen >= rank) return std::min(upper_bound(i), max_) / 1000.0;
+        }
+        return max_ms();
+    }
+
+private:
+    static const size_t BUCKETS = 256;
+
+    static size_t index(uint64_t us) {
+        if (us < 4) return us;
+        int exponent = 63 - __builtin_clzll(us);
+        return (exponent - 1) * 4 + ((us >> (exponent - 2)) & 3);
+    }
+
+    static uint64_t upper_bound(size_t i) {
+        if (i < 4) return i;
+        int exponent = static_cast<int>(i / 4) + 1;
+        uint64_t lower = uint64_t(4 + i % 4) << (exponent - 2);
+        return lower + (uint64_t(1) << (exponent - 2)) - 1;
+    }
+
+    uint64_t counts_[BUCKETS] = {};
+    uint64_t count_ = 0;
+    uint64_t sum_ = 0;
+    uint64_t max_ = 0;
+};
+
+// Rate limit bucket state as seen right after a response
+struct BucketSnapshot {
+    std::string_view key; // RateLimiter が持つ文字列を指す
+    long limit = 0;
+    long remaining = 0;
+    double reset_after = 0; // seconds
+};
+
+// Per-route request statistics, shown by /stats and optionally written to an
+// NDJSON file (--metrics) with one line per request. Thread-safe.
+class Metrics {
+public:
+    // Append one NDJSON line per request to `path`
+    bool open_log(const std::string& path) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        log_.open(path, std::ios::app);
+        return log_.is_open();
+    }
+
+    void record(const std::string& route, const std::string& major, const HttpResponse& response, const BucketSnapshot& bucket) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        RouteStats& stats = routes_[route];
+        const RequestTiming& t = response.timing;
+        ++stats.requests;
+        if (response.result != CURLE_OK) {
+            ++stats.errors;
+        } else {
+            ++stats.statuses[response.status / 100];
+            if (response.status == 429) ++stats.rate_limited;
+        }
+        stats.namelookup.record(t.namelookup);
+        stats.connect.record(t.connect);
+        stats.appconnect.record(t.appconnect);
+        stats.starttransfer.record(t.starttransfer);
+        stats.total.record(t.total);
+        stats.bytes_sent += t.bytes_sent;
+        stats.bytes_received += t.bytes_received;
+        if (t.new_connections > 0) stats.new_connections += t.new_connections;
+        if (!bucket.key.empty()) {
+            auto it = buckets_.find(bucket.key);
+            if (it == buckets_.end()) it = buckets_.emplace(std::string(bucket.key), bucket).first;
+            it->second = bucket;
+            it->second.key = it->first;
+        }
+
+        if (log_.is_open()) {
+            auto now = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+            json line = {{"ts", now},
+                         {"route", route},
+                         {"major", major},
+                         {"status", response.status},
+                         {"curl_code", static_cast<int>(response.result)},
+                         {"namelookup_us", t.namelookup},
+                         {"connect_us", t.connect},
+                         {"appconnect_us", t.appconnect},
+                         {"starttransfer_us", t.starttransfer},
+                         {"total_us", t.total},
+                         {"bytes_sent", t.bytes_sent},
+                         {"bytes_received", t.bytes_received},
+                         {"new_connections", t.new_connections},
+                         {"bucket", bucket.key},
+                         {"bucket_limit", bucket.limit},
+                         {"bucket_remaining", bucket.remaining},
+                         {"bucket_reset_after", bucket.reset_after}};
+            log_ << line.dump() << '\n' << std::flush;
+        }
+    }
+
+    // Time a request was held back by the rate limiter (only requests that had to wait)
+    void record_wait(const std::string& route, std::chrono::steady_clock::duration wait) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        routes_[route].rate_limit_wait.record(std::chrono::duration_cast<std::chrono::microseconds>(wait).count());
+    }
+
+    void print(std::ostream& out) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (routes_.empty()) {
+            out << "No requests yet.\n";
+            return;
+        }
+        auto ms = [](double value) {
+            std::ostringstream text;
+            text << std::fixed << std::setprecision(value < 10 ? 1 : 0) << value << "ms";
+            return text.str();
+        };
+        auto phase = [&](const char* name, const Histogram& h) {
+            out << "    " << std::left << std::setw(16) << name << std::right
+                << " p50 " << std::setw(8) << ms(h.percentile_ms(0.5))
+                << " p99 " << std::setw(8) << ms(h.percentile_ms(0.99))
+                << " max " << std::setw(8) << ms(h.max_ms()) << "\n";
+        };
+        for (const auto& [route, stats] : routes_) {
+            out << route << "\n";
+            out << "  " << stats.requests << " requests";
+            for (const auto& [status_class, count] : stats.statuses) out << ", " << count << " " << status_class << "xx";
+            if (stats.errors) out << ", " << stats.errors << " network errors";
+            if (stats.rate_limited) out << " (" << stats.rate_limited << " rate limited)";
+            out << "\n";
+            out << "  connections: " << stats.new_connections << " new, "
+                << (stats.requests > stats.new_connections ? stats.requests - stats.new_connections : 0) << " reused; "
+                << stats.bytes_sent << " bytes sent, " << stats.bytes_received << " received\n";
+            phase("namelookup", stats.namelookup);
+            phase("connect", stats.connect);
+            phase("appconnect", stats.appconnect);
+            phase("starttransfer", stats.starttransfer);
+            phase("total", stats.total);
+            if (stats.rate_limit_wait.count()) {
+                out << "  " << stats.rate_limit_wait.count() << " held back by the rate limiter:\n";
+                phase("rate-limit wait", stats.rate_limit_wait);
+            }
+        }
+        if (!buckets_.empty()) {
+            out << "Rate limit buckets:\n";
+            for (const auto& [key, bucket] : buckets_) {
+                out << "  " << key << ": " << bucket.remaining << "/" << bucket.limit << " remaining, resets in "
+                    << std::fixed << std::setprecision(2) << bucket.reset_after << "s (at last response)\n";
+            }
+        }
+    }
+
+private:
+    struct RouteStats {
+        uint64_t requests = 0;
+        uint64_t errors = 0;
+        uint64_t rate_limited = 0;
+        uint64_t new_connections = 0;
+        uint64_t bytes_sent = 0;
+        uint64_t bytes_received = 0;
+        std::map<long, uint64_t> statuses; // 2xx, 4xx ...
+        Histogram namelookup, connect, appconnect, starttransfer, total;
+        Histogram rate_limit_wait;
+    };
+
+    std::mutex mutex_;
+    std::map<std::string, RouteStats> routes_;
+    std::map<std::string, BucketSnapshot, std::less<>> buckets_;
+    std::ofstream log_;
+};
+
+// Rate limit state of a single Discord bucket
+struct RateLimitBucket {
+    long limit = 1;
+    long remaining = 1;
+    std::chrono::steady_clock::time_point reset_at{};
+    std::string snapshot_key; // Metrics に渡す名前 ("label/bucket:major")
+};
+
+// Token scheduler driven by the X-RateLimit-* / Retry-After response headers.
+// Each route is mapped to the bucket reported in X-RateLimit-Bucket; buckets are
+// further split by their major parameter (the channel ID), as Discord does.
+class RateLimiter {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    // `metrics`, if given, receives every response passed to update(); `label`
+    // tells apart the buckets of different identities in it
+    explicit RateLimiter(Metrics* metrics = nullptr, std::string label = "") : metrics_(metrics), label_(std::move(label)) {}
+
+    // Take a token for `route`; returns how long to wait if none is available (zero = taken)
+    Clock::duration reserve(const std::string& route, const std::string& major) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto now = Clock::now();
+        if (now < global_reset_) return global_reset_ - now;
+        RateLimitBucket& bucket = bucket_for(route, major);
+        if (bucket.remaining <= 0 && now >= bucket.reset_at) bucket.remaining = bucket.limit;
+        if (bucket.remaining > 0) {
+            --bucket.remaining;
+            return Clock::duration::zero();
+        }
+        return bucket.reset_at - now;
+    }
+
+    // How long until a request on `route` could be sent, without taking a token
+    Clock::duration delay(const std::string& route, const std::string& major) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto now = Clock::now();
+        if (now < global_reset_) return global_reset_ - now;
+        RateLimitBucket& bucket = bucket_for(route, major);
+        if (bucket.remaining > 0 || now >= bucket.reset_at) return Clock::duration::zero();
+        return bucket.reset_at - now;
+    }
+
+    // Block until a request on `route` may be sent
+    void acquire(const std::string& route, const std::string& major) {
+        auto start = Clock::now();
+        bool waited = false;
+        for (;;) {
+            auto wait = reserve(route, major);
+            if (wait <= Clock::duration::zero()) break;
+            std::this_thread::sleep_for(wait);
+            waited = true;
+        }
+        if (waited && metrics_) metrics_->record_wait(route, Clock::now() - start);
+    }
+
+    // Update bucket state from a response
+    void update(const std::string& route, const std::string& major, const HttpResponse& response) {
+        if (!metrics_) {
+            update_bucket(route, major, response, nullptr);
+            return;
+        }
+        BucketSnapshot snapshot;
+        update_bucket(route, major, response, &snapshot);
+        metrics_->record(route, major, response, snapshot);
+    }
+
+    Metrics* metrics() const { return metrics_; }
+
+private:
+    void update_bucket(const std::string& route, const std::string& major, const HttpResponse& response, BucketSnapshot* snapshot) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto now = Clock::now();
+        const HeaderMap& h = response.headers;
+
+        auto it = h.find("x-ratelimit-bucket");
+        if (it != h.end()) route_buckets_[route] = it->second;
+
+        RateLimitBucket& bucket = bucket_for(route, major);
+        if ((it = h.find("x-ratelimit-limit")) != h.end()) bucket.limit = std::max(1L, std::atol(it->second.c_str()));
+        if ((it = h.find("x-ratelimit-remaining")) != h.end()) bucket.remaining = std::atol(it->second.c_str());
+        if ((it = h.find("x-ratelimit-reset-after")) != h.end()) bucket.reset_at = now + parse_seconds(it->second);
+
+        if (response.status == 429) {
+            Clock::duration retry_after = std::chrono::seconds(1);
+            if ((it = h.find("retry-after")) != h.end()) {
+                retry_after = parse_seconds(it->second);
+            } else {
+                try {
+                    retry_after = parse_seconds(std::to_string(json::parse(response.body).value("retry_after", 1.0)));
+                } catch (const std::exception&) {}
+            }
+            bool global = h.count("x-ratelimit-global") || (h.count("x-ratelimit-scope") && h.at("x-ratelimit-scope") == "global");
+            if (global) {
+                global_reset_ = now + retry_after;
+            } else {
+                bucket.remaining = 0;
+                bucket.reset_at = std::max(bucket.reset_at, now + retry_after);
+            }
+        }
+
+        if (snapshot) {
+            *snapshot = {bucket.snapshot_key, bucket.limit, bucket.remaining,
+                         std::chrono::duration<double>(std::max(Clock::duration::zero(), bucket.reset_at - now)).count()};
+        }
+    }
+
+    // Bucket for route+major; the key is built in key_ so lookups of known buckets don't allocate
+    RateLimitBucket& bucket_for(const std::string& route, const std::string& major) {
+        auto it = route_buckets_.find(route);
+        key_.assign(it != route_buckets_.end() ? it->second : route).append(1, ':').append(major);
+        auto bucket = buckets_.find(key_);
+        if (bucket == buckets_.end()) {
+            bucket = buckets_.emplace(key_, RateLimitBucket()).first;
+            bucket->second.snapshot_key = label_.empty() ? key_ : label_ + "/" + key_;
+        }
+        return bucket->second;
+    }
+
+    std::mutex mutex_;
+    std::map<std::string, std::string> route_buckets_;
+    std::map<std::string, RateLimitBucket> buckets_;
+    std::string key_;
+    Clock::time_point global_reset_{};
+    Metrics* metrics_;
+    std::string label_;
+};
+
+// Route used to rate limit message creation
+const std::string CREATE_MESSAGE_ROUTE = "POST /channels/{channel.id}/messages";
+const int MAX_SEND_ATTEMPTS = 5;
+
+// Request and response buffers kept by a sender and reused for every message,
+// so that once they have grown the send path does not allocate
+struct SendBuffers {
+    std::string url;
+    std::string payload;
+    HttpResponse response;
+};
+
+// Build the create-message body; a non-zero nonce is sent with enforce_nonce
+void build_message_payload(std::string& payload, std::string_view content, uint64_t nonce) {
+    payload.assign("{\"content\": \"");
+    json_escape::append_escaped(payload, content);
+    payload += '"';
+    if (nonce) {
+        char digits[20];
+        auto result = std::to_chars(digits, digits + sizeof(digits), nonce);
+        payload.append(", \"nonce\": \"").append(digits, result.ptr).append("\", \"enforce_nonce\": true");
+    }
+    payload += '}';
+}
+
+// Send one message on `curl`, waiting on the rate limiter and retrying on 429.
+// The result is left in buffers.response.
+// A nonce makes Discord drop duplicates if the same message is sent twice.
+void send_message(ConnectionManager& conn, CURL* curl, RateLimiter& limiter, const std::string& channel_id,
+                  std::string_view content, SendBuffers& buffers, int max_attempts = MAX_SEND_ATTEMPTS, uint64_t nonce = 0) {
+    build_message_payload(buffers.payload, content, nonce);
+    messages_url(buffers.url, channel_id);
+
+    for (int attempt = 0; attempt < max_attempts; ++attempt) {
+        limiter.acquire(CREATE_MESSAGE_ROUTE, channel_id);
+        conn.post(curl, buffers.url, buffers.payload, buffers.response);
+        limiter.update(CREATE_MESSAGE_ROUTE, channel_id, buffers.response);
+        if (buffers.response.status != 429) break;
+    }
+}
+
+HttpResponse send_message(ConnectionManager& conn, RateLimiter& limiter, const std::string& channel_id, const std::string& content) {
+    SendBuffers buffers;
+    send_message(conn, conn.handle(), limiter, channel_id, content, buffers);
+    return std::move(buffers.response);
+}
+
+// "1.5 MB" 形式のサイズ表示
+std::string format_bytes(double bytes) {
+    const char* units[] = {"B", "KB", "MB", "GB", "TB"};
+    size_t unit = 0;
+    while (bytes >= 1024 && unit + 1 < sizeof(units) / sizeof(units[0])) {
+        bytes /= 1024;
+        ++unit;
+    }
+    std::ostringstream text;
+    text << std::fixed << std::setprecision(unit == 0 ? 0 : 1) << bytes << " " << units[unit];
+    return text.str();
+}
+
+const size_t UPLOAD_MAX_IN_FLIGHT = 4;
+
+// Uploads files as attachments, one message per file, several at once over
+// curl_multi. File bodies are streamed with pread from a read callback, so memory
+// use does not depend on file size.
+class Uploader {
+public:
+    Uploader(ConnectionManager& conn, RateLimiter& limiter, size_t max_in_flight = UPLOAD_MAX_IN_FLIGHT)
+        : limiter_(limiter), multi_(curl_multi_init()) {
+        if (!multi_) throw std::runtime_error("Failed to initialize curl");
+        curl_multi_setopt(multi_.get(), CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+        for (size_t i = 0; i < max_in_flight; ++i) {
+            auto transfer = std::make_unique<Transfer>();
+            transfer->curl = conn.new_form_handle();
+            curl_easy_setopt(transfer->curl.get(), CURLOPT_PRIVATE, transfer.get());
+            transfers_.push_back(std::move(transfer));
+        }
+    }
+
+    ~Uploader() {
+        for (auto& transfer : transfers_) {
+            if (transfer->upload) curl_multi_remove_handle(multi_.get(), transfer->curl.get());
+            if (transfer->mime) curl_mime_free(transfer->mime);
+        }
+    }
+
+    // Upload every file in `paths` to `channel_id`, printing progress; returns how many failed
+    size_t upload(const std::string& channel_id, const std::vector<std::string>& paths) {
+        std::vector<std::unique_ptr<Upload>> uploads;
+        std::deque<Upload*> queue;
+        size_t failed = 0;
+        for (const auto& path : paths) {
+            auto upload = std::make_unique<Upload>();
+            upload->path = path;
+            upload->name = path.substr(path.find_last_of('/') + 1);
+            upload->fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+            struct stat info{};
+            if (upload->fd < 0 || fstat(upload->fd, &info) != 0 || !S_ISREG(info.st_mode)) {
+                std::cerr << "Cannot upload " << path << ": " << (upload->fd < 0 ? std::strerror(errno) : "not a regular file") << std::endl;
+                ++failed;
+                continue;
+            }
+            upload->size = info.st_size;
+            queue.push_back(upload.get());
+            uploads.push_back(std::move(upload));
+        }
+        if (uploads.empty()) return failed;
+
+        curl_off_t total_bytes = 0;
+        for (const auto& upload : uploads) total_bytes += upload->size;
+        std::string url = messages_url(channel_id);
+        auto start = RateLimiter::Clock::now();
+        auto last_progress = start;
+        size_t finished = 0, in_flight = 0;
+        bool bucket_known = false; // 最初の応答でバケットの上限が分かるまでは 1 件ずつ
+
+        while (finished < uploads.size()) {
+            // 空いているハンドルとレート制限の許す限り開始する
+            auto now = RateLimiter::Clock::now();
+            auto next_start = std::chrono::milliseconds(200);
+            for (auto& transfer : transfers_) {
+                if (transfer->upload || queue.empty()) continue;
+                if (!bucket_known && in_flight > 0) break;
+                Upload* upload = queue.front();
+                auto wait = limiter_.reserve(CREATE_MESSAGE_ROUTE, channel_id);
+                if (wait > RateLimiter::Clock::duration::zero()) {
+                    next_start = std::min(next_start, std::chrono::duration_cast<std::chrono::milliseconds>(wait));
+                    break;
+                }
+                queue.pop_front();
+                start_transfer(*transfer, upload, url);
+                ++in_flight;
+            }
+
+            int running = 0;
+            curl_multi_perform(multi_.get(), &running);
+            bool completed = false;
+            int queued = 0;
+            while (CURLMsg* msg = curl_multi_info_read(multi_.get(), &queued)) {
+                if (msg->msg != CURLMSG_DONE) continue;
+                Transfer* transfer = nullptr;
+                curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, &transfer);
+                transfer->response.result = msg->data.result;
+                read_transfer_info(msg->easy_handle, transfer->response);
+                curl_multi_remove_handle(multi_.get(), msg->easy_handle);
+                curl_mime_free(transfer->mime);
+                transfer->mime = nullptr;
+                Upload* upload = transfer->upload;
+                transfer->upload = nullptr;
+                --in_flight;
+                completed = true;
+
+                const HttpResponse& response = transfer->response;
+                limiter_.update(CREATE_MESSAGE_ROUTE, channel_id, response);
+                bucket_known = bucket_known || response.headers.count("x-ratelimit-limit");
+                if (response.status == 429 && upload->attempts < MAX_SEND_ATTEMPTS) {
+                    upload->sent = 0;
+                    queue.push_front(upload);
+                    continue;
+                }
+                ++finished;
+                close(upload->fd);
+                upload->fd = -1;
+                upload->sent = upload->size;
+                double seconds = std::chrono::duration<double>(RateLimiter::Clock::now() - upload->started).count();
+                clear_line();
+                if (response.ok()) {
+                    std::cout << "Uploaded " << upload->name << " (" << format_bytes(upload->size) << ") in " << std::fixed
+                              << std::setprecision(1) << seconds << "s, " << format_bytes(seconds > 0 ? upload->size / seconds : 0) << "/s\n";
+                } else if (response.result != CURLE_OK) {
+                    ++failed;
+                    std::cout << "Failed to upload " << upload->name << ": " << curl_easy_strerror(response.result) << "\n";
+                } else {
+                    ++failed;
+                    std::cout << "Failed to upload " << upload->name << ": API Error [" << response.status << "]: " << response.body << "\n";
+                }
+            }
+
+            now = RateLimiter::Clock::now();
+            if (tty_ && (completed || now - last_progress >= std::chrono::milliseconds(250))) {
+                last_progress = now;
+                print_progress(uploads, finished, total_bytes, now - start);
+            }
+            if (!completed && finished < uploads.size()) {
+                curl_multi_poll(multi_.get(), nullptr, 0, static_cast<int>(in_flight > 0 ? std::min<long>(250, next_start.count()) : next_start.count()), nullptr);
+            }
+        }
+
+        double seconds = std::chrono::duration<double>(RateLimiter::Clock::now() - start).count();
+        clear_line();
+        std::cout << paths.size() - failed << " of " << paths.size() << " file(s) uploaded, "
+                  << format_bytes(total_bytes) << " in " << std::fixed << std::setprecision(1) << seconds << "s ("
+                  << format_bytes(seconds > 0 ? total_bytes / seconds : 0) << "/s)" << std::endl;
+        return failed;
+    }
+
+private:
+    struct Upload {
+        std::string path;
+        std::string name;
+        int fd = -1;
+        curl_off_t size = 0;
+        curl_off_t offset = 0; // 次に読む位置
+        curl_off_t sent = 0; // 進捗表示用
+        int attempts = 0;
+        RateLimiter::Clock::time_point started;
+
+        ~Upload() {
+            if (fd >= 0) close(fd);
+        }
+    };
+
+    struct Transfer {
+        CurlHandle curl;
+        curl_mime* mime = nullptr;
+        Upload* upload = nullptr;
+        HttpResponse response;
+        std::string payload;
+    };
+
+    void start_transfer(Transfer& transfer, Upload* upload, const std::string& url) {
+        CURL* curl = transfer.curl.get();
+        ++upload->attempts;
+        upload->offset = 0;
+        upload->sent = 0;
+        if (upload->attempts == 1) upload->started = RateLimiter::Clock::now();
+        transfer.upload = upload;
+        transfer.response.reset();
+
+        transfer.payload = json{{"attachments", {{{"id", 0}, {"filename", upload->name}}}}}.dump();
+        transfer.mime = curl_mime_init(curl);
+        curl_mimepart* part = curl_mime_addpart(transfer.mime);
+        curl_mime_name(part, "payload_json");
+        curl_mime_type(part, "application/json");
+        curl_mime_data(part, transfer.payload.data(), transfer.payload.size());
+        part = curl_mime_addpart(transfer.mime);
+        curl_mime_name(part, "files[0]");
+        curl_mime_filename(part, upload->name.c_str());
+        curl_mime_type(part, "application/octet-stream");
+        curl_mime_data_cb(part, upload->size, read_file, seek_file, nullptr, upload);
+
+        curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
+        curl_easy_setopt(curl, CURLOPT_MIMEPOST, transfer.mime);
+        curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, WriteCallback);
+        curl_easy_setopt(curl, CURLOPT_WRITEDATA, &transfer.response.body);
+        curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, HeaderCallback);
+        curl_easy_setopt(curl, CURLOPT_HEADERDATA, &transfer.response);
+        curl_easy_setopt(curl, CURLOPT_NOPROGRESS, 0L);
+        curl_easy_setopt(curl, CURLOPT_XFERINFOFUNCTION, on_progress);
+        curl_easy_setopt(curl, CURLOPT_XFERINFODATA, upload);
+        curl_multi_add_handle(multi_.get(), curl);
+    }
+
+    // ファイルの中身は必要な分だけ pread で読む
+    static size_t read_file(char* buffer, size_t size, size_t nitems, void* arg) {
+        auto* upload = static_cast<Upload*>(arg);
+        ssize_t n;
+        do {
+            n = pread(upload->fd, buffer, size * nitems, upload->offset);
+        } while (n < 0 && errno == EINTR);
+        if (n < 0) return CURL_READFUNC_ABORT;
+        upload->offset += n;
+        return static_cast<size_t>(n);
+    }
+
+    static int seek_file(void* arg, curl_off_t offset, int origin) {
+        auto* upload = static_cast<Upload*>(arg);
+        if (origin != SEEK_SET) return CURL_SEEKFUNC_CANTSEEK;
+        upload->offset = offset;
+        return CURL_SEEKFUNC_OK;
+    }
+
+    static int on_progress(void* arg, curl_off_t, curl_off_t, curl_off_t, curl_off_t uploaded) {
+        auto* upload = static_cast<Upload*>(arg);
+        upload->sent = std::min(uploaded, upload->size);
+        return 0;
+    }
+
+    void print_progress(const std::vector<std::unique_ptr<Upload>>& uploads, size_t finished, curl_off_t total_bytes,
+                        RateLimiter::Clock::duration elapsed) {
+        curl_off_t sent = 0;
+        for (const auto& upload : uploads) sent += upload->sent;
+        double seconds = std::chrono::duration<double>(elapsed).count();
+        clear_line();
+        std::cout << "Uploading " << finished << "/" << uploads.size() << " files: " << format_bytes(sent) << " / "
+                  << format_bytes(total_bytes) << " (" << (total_bytes > 0 ? sent * 100 / total_bytes : 100) << "%) "
+                  << format_bytes(seconds > 0 ? sent / seconds : 0) << "/s" << std::flush;
+    }
+
+    // 端末のときだけ進捗行を書き換える
+    void clear_line() {
+        if (tty_) std::cout << "\r\033[K";
+    }
+
+    RateLimiter& limiter_;
+    bool tty_ = isatty(STDOUT_FILENO);
+    // 破棄順序: ハンドルを外してから multi を解放
+    CurlMulti multi_;
+    std::vector<std::unique_ptr<Transfer>> transfers_;
+};
+
+// Route used to rate limit message fetches
+const std::string GET_MESSAGES_ROUTE = "GET /channels/{channel.id}/messages";
+const int MESSAGES_PAGE_SIZE = 100;
+
+// SAX handler that pulls id, author and content out of a messages page without
+// building a DOM. Nested objects (embeds, referenced_message, ...) are skipped.
+class MessageSaxHandler : public nlohmann::json_sax<json> {
+public:
+    explicit MessageSaxHandler(std::vector<StoredMessage>& page) : page_(page) {}
+
+    bool null() override { return true; }
+    bool boolean(bool) override { return true; }
+    bool number_integer(number_integer_t) override { return true; }
+    bool number_unsigned(number_unsigned_t) override { return true; }
+    bool number_float(number_float_t, const string_t&) override { return true; }
+    bool binary(binary_t&) override { return true; }
+
+    bool string(string_t& value) override {
+        if (depth_ == 2 && keys_[2] == "id") {
+            current_.id = parse_snowflake(value);
+        } else if (depth_ == 2 && keys_[2] == "content") {
+            current_.content = std::move(value);
+        } else if (depth_ == 3 && keys_[2] == "author" && keys_[3] == "username") {
+            current_.author = std::move(value);
+        }
+        return true;
+    }
+
+    bool key(string_t& value) override {
+        if (depth_ < MAX_TRACKED_DEPTH) keys_[depth_] = value;
+        return true;
+    }
+
+    bool start_object(std::size_t) override {
+        if (++depth_ == 2) current_ = StoredMessage();
+        return true;
+    }
+
+    bool end_object() override {
+        if (depth_-- == 2 && current_.id != 0) page_.push_back(std::move(current_));
+        return true;
+    }
+
+    bool start_array(std::size_t) override {
+        ++depth_;
+        return true;
+    }
+
+    bool end_array() override {
+        --depth_;
+        return true;
+    }
+
+    bool parse_error(std::size_t, const std::string&, const nlohmann::detail::exception& e) override {
+        error_ = e.what();
+        return false;
+    }
+
+    const std::string& error() const { return error_; }
+
+private:
+    static constexpr int MAX_TRACKED_DEPTH = 4;
+    std::vector<StoredMessage>& page_;
+    StoredMessage current_;
+    std::string keys_[MAX_TRACKED_DEPTH];
+    int depth_ = 0;
+    std::string error_;
+};
+
+// Parse a page of messages returned by GET /channels/{id}/messages
+bool parse_messages(const std::string& body, std::vector<StoredMessage>& page, std::string& error) {
+    MessageSaxHandler handler(page);
+    if (!json::sax_parse(body, &handler)) {
+        error = "JSON parse error: " + handler.error();
+        return false;
+    }
+    return true;
+}
+
+// GET a messages page for `channel_id`, honouring the rate limiter
+HttpResponse fetch_messages(ConnectionManager& conn, RateLimiter& limiter, const std::string& channel_id, const std::string& query) {
+    HttpResponse response;
+    for (int attempt = 0; attempt < MAX_SEND_ATTEMPTS; ++attempt) {
+        limiter.acquire(GET_MESSAGES_ROUTE, channel_id);
+        response = conn.get(messages_url(channel_id) + "?" + query);
+        limiter.update(GET_MESSAGES_ROUTE, channel_id, response);
+        if (response.status != 429) break;
+    }
+    return response;
+}
+
+// Check a messages response and add its page to the store; prints any error.
+// `page_size` receives the number of messages in the page.
+bool store_page(const HttpResponse& response, MessageStore& store, size_t& page_size) {
+    if (response.result != CURLE_OK) {
+        std::cerr << "Request failed: " << curl_easy_strerror(response.result) << std::endl;
+        return false;
+    }
+    if (response.status != 200) {
+        std::cerr << "API Error [" << response.status << "]: " << response.body << std::endl;
+        return false;
+    }
+    std::vector<StoredMessage> page;
+    std::string error;
+    if (!parse_messages(response.body, page, error)) {
+        std::cerr << error << std::endl;
+        return false;
+    }
+    std::sort(page.begin(), page.end(), [](const StoredMessage& a, const StoredMessage& b) { return a.id < b.id; });
+    store.append(page);
+    page_size = page.size();
+    return true;
+}
+
+// Query for the next sync page: the latest page for an empty cache, else ?after=<last_id>
+std::string sync_query(const MessageStore& store) {
+    std::string query = "limit=" + std::to_string(MESSAGES_PAGE_SIZE);
+    if (store.size() > 0) query += "&after=" + std::to_string(store.last_id());
+    return query;
+}
+
+// Bring a channel's cache up to date. Once the cache holds anything, only messages
+// newer than the last cached snowflake are requested (?after=<last_id>).
+bool sync_channel(ConnectionManager& conn, RateLimiter& limiter, MessageStore& store, const std::string& channel_id) {
+    for (;;) {
+        bool delta = store.size() > 0;
+        HttpResponse response = fetch_messages(conn, limiter, channel_id, sync_query(store));
+        size_t page_size = 0;
+        if (!store_page(response, store, page_size)) return false;
+        if (!delta || page_size < static_cast<size_t>(MESSAGES_PAGE_SIZE)) return true;
+    }
+}
+
+const size_t SYNC_MAX_IN_FLIGHT = 16;
+
+// Sync several channels at once over curl_multi, one request per channel in flight,
+// so the wall time follows the slowest channel rather than the sum of all of them
+bool sync_channels(ConnectionManager& conn, RateLimiter& limiter, const std::vector<std::pair<std::string, MessageStore*>>& channels) {
+    if (channels.empty()) return true;
+    MultiFetcher fetcher(conn, std::min(channels.size(), SYNC_MAX_IN_FLIGHT));
+    std::deque<size_t> ready;
+    std::vector<bool> delta(channels.size());
+    for (size_t i = 0; i < channels.size(); ++i) ready.push_back(i);
+
+    bool ok = true;
+    while (!ready.empty() || fetcher.in_flight() > 0) {
+        auto wait = RateLimiter::Clock::duration::max();
+        for (size_t tries = ready.size(); tries > 0 && !fetcher.full(); --tries) {
+            size_t index = ready.front();
+            ready.pop_front();
+            const auto& [channel_id, store] = channels[index];
+            auto delay = limiter.reserve(GET_MESSAGES_ROUTE, channel_id);
+            if (delay > RateLimiter::Clock::duration::zero()) {
+                ready.push_back(index);
+                wait = std::min(wait, delay);
+                continue;
+            }
+            delta[index] = store->size() > 0;
+            fetcher.start(messages_url(channel_id) + "?" + sync_query(*store), index);
+        }
+        if (fetcher.in_flight() == 0) {
+            std::this_thread::sleep_for(wait);
+            continue;
+        }
+
+        for (auto& [index, response] : fetcher.poll(std::chrono::milliseconds(100))) {
+            const auto& [channel_id, store] = channels[index];
+            limiter.update(GET_MESSAGES_ROUTE, channel_id, response);
+            if (response.status == 429) {
+                ready.push_back(index);
+                continue;
+            }
+            size_t page_size = 0;
+            if (!store_page(response, *store, page_size)) {
+                std::cerr << "(channel " << channel_id << ")" << std::endl;
+                ok = false;
+            } else if (delta[index] && page_size == static_cast<size_t>(MESSAGES_PAGE_SIZE)) {
+                ready.push_back(index);
+            }
+        }
+    }
+    return ok;
+}
+
+const std::string GET_GUILDS_ROUTE = "GET /users/@me/guilds";
+const std::string GET_GUILD_ROUTE = "GET /guilds/{guild.id}";
+const std::string GET_GUILD_CHANNELS_ROUTE = "GET /guilds/{guild.id}/channels";
+const int GUILDS_PAGE_SIZE = 200;
+
+// GET one URL through the rate limiter, retrying on 429; prints API errors
+bool get_json(ConnectionManager& conn, RateLimiter& limiter, const std::string& route, const std::string& major,
+              const std::string& url, json& body) {
+    for (int attempt = 0; attempt < MAX_SEND_ATTEMPTS; ++attempt) {
+        limiter.acquire(route, major);
+        HttpResponse response = conn.get(url);
+        limiter.update(route, major, response);
+        if (response.status == 429) continue;
+        if (response.result != CURLE_OK) {
+            std::cerr << "Request failed: " << curl_easy_strerror(response.result) << std::endl;
+            return false;
+        }
+        if (!response.ok()) {
+            std::cerr << "API Error [" << response.status << "]: " << response.body << std::endl;
+            return false;
+        }
+        body = json::parse(response.body, nullptr, false);
+        return !body.is_discarded();
+    }
+    std::cerr << "Still rate limited after " << MAX_SEND_ATTEMPTS << " attempts" << std::endl;
+    return false;
+}
+
+// --sync-guild: fetch the text channels of every guild the bot is in (or only
+// `guild_id`) and rewrite the channel directory. The channel lists are fetched
+// concurrently; a single-guild sync keeps the other guilds already in the directory.
+bool sync_guilds(ConnectionManager& conn, RateLimiter& limiter, const std::string& guild_id) {
+    std::map<uint64_t, std::string> guilds;
+    std::vector<DirectoryChannel> channels;
+    if (!guild_id.empty()) {
+        json guild;
+        if (!get_json(conn, limiter, GET_GUILD_ROUTE, guild_id, API_BASE + "/guilds/" + guild_id, guild)) return false;
+        guilds[parse_snowflake(guild_id)] = guild.value("name", guild_id);
+        uint64_t synced = parse_snowflake(guild_id);
+        channel_directory().read(guilds, channels, [synced](uint64_t id) { return id != synced; });
+    } else {
+        std::string after = "0";
+        for (;;) {
+            json page;
+            std::string url = API_BASE + "/users/@me/guilds?limit=" + std::to_string(GUILDS_PAGE_SIZE) + "&after=" + after;
+            if (!get_json(conn, limiter, GET_GUILDS_ROUTE, "", url, page) || !page.is_array()) return false;
+            for (const auto& guild : page) {
+                after = guild.value("id", "0");
+                guilds[parse_snowflake(after)] = guild.value("name", after);
+            }
+            if (page.size() < static_cast<size_t>(GUILDS_PAGE_SIZE)) break;
+        }
+    }
+
+    std::vector<uint64_t> pending;
+    for (const auto& [id, name] : guilds) {
+        if (guild_id.empty() || id == parse_snowflake(guild_id)) pending.push_back(id);
+    }
+    MultiFetcher fetcher(conn, std::max<size_t>(1, std::min(pending.size(), SYNC_MAX_IN_FLIGHT)));
+    std::deque<size_t> ready;
+    for (size_t i = 0; i < pending.size(); ++i) ready.push_back(i);
+    bool ok = true;
+    while (!ready.empty() || fetcher.in_flight() > 0) {
+        auto wait = RateLimiter::Clock::duration::max();
+        for (size_t tries = ready.size(); tries > 0 && !fetcher.full(); --tries) {
+            size_t index = ready.front();
+            ready.pop_front();
+            std::string id = std::to_string(pending[index]);
+            auto delay = limiter.reserve(GET_GUILD_CHANNELS_ROUTE, id);
+            if (delay > RateLimiter::Clock::duration::zero()) {
+                ready.push_back(index);
+                wait = std::min(wait, delay);
+                continue;
+            }
+            fetcher.start(API_BASE + "/guilds/" + id + "/channels", index);
+        }
+        if (fetcher.in_flight() == 0) {
+            std::this_thread::sleep_for(wait);
+            continue;
+        }
+
+        for (auto& [index, response] : fetcher.poll(std::chrono::milliseconds(100))) {
+            std::string id = std::to_string(pending[index]);
+            limiter.update(GET_GUILD_CHANNELS_ROUTE, id, response);
+            if (response.status == 429) {
+                ready.push_back(index);
+                continue;
+            }
+            json list = response.ok() ? json::parse(response.body, nullptr, false) : json();
+            if (!list.is_array()) {
+                std::cerr << "Cannot fetch channels of guild " << guilds[pending[index]] << " (" << id << "): ";
+                if (response.result != CURLE_OK) {
+                    std::cerr << curl_easy_strerror(response.result) << std::endl;
+                } else {
+                    std::cerr << "API Error [" << response.status << "]: " << response.body << std::endl;
+                }
+                // 前回の一覧を残す
+                uint64_t failed = pending[index];
+                channel_directory().read(guilds, channels, [failed](uint64_t id) { return id == failed; });
+                ok = false;
+                continue;
+            }
+            for (const auto& channel : list) {
+                // テキストチャンネル (0) とアナウンスチャンネル (5) のみ
+                int type = channel.value("type", -1);
+                if (type != 0 && type != 5) continue;
+                channels.push_back({parse_snowflake(channel.value("id", "0")), pending[index], channel.value("name", "")});
+            }
+        }
+    }
+
+    if (!ChannelDirectory::write(get_directory_path(), guilds, channels)) {
+        std::cerr << "Cannot write channel directory: " << get_directory_path() << std::endl;
+        return false;
+    }
+    struct stat st{};
+    stat(get_directory_path().c_str(), &st);
+    std::cout << "Synced " << channels.size() << " channels in " << guilds.size() << " guild(s) to " << get_directory_path()
+              << " (" << format_bytes(st.st_size) << ")" << std::endl;
+    return ok;
+}
+
+// Smallest snowflake created at `ms` (Unix epoch milliseconds)
+uint64_t snowflake_from_ms(uint64_t ms) {
+    return ms <= 1420070400000ULL ? 0 : (ms - 1420070400000ULL) << 22;
+}
+
+const size_t HISTORY_MAX_IN_FLIGHT = 4;
+
+// Fetch older messages until the cache holds at least `count` of them, or the channel
+// has no more. The time below the oldest cached message is cut into windows sized
+// from the observed message rate; windows are paged back with ?before= independently,
+// so several pages are in flight at once (as the rate limit allows). Each page is
+// parsed with the SAX handler and appended straight to the store, keeping memory flat.
+bool fetch_history(ConnectionManager& conn, RateLimiter& limiter, MessageStore& store, const std::string& channel_id, size_t count) {
+    if (!sync_channel(conn, limiter, store, channel_id)) return false;
+    if (store.size() >= count || store.size() == 0) return true;
+
+    struct Window {
+        uint64_t lower;  // oldest snowflake this window is responsible for
+        uint64_t before; // next ?before= to request
+        size_t fetched = 0;
+    };
+    std::vector<Window> windows;
+    std::deque<size_t> ready; // windows waiting for a request slot
+
+    const uint64_t top_ms = snowflake_timestamp_ms(store.first_id());
+    uint64_t span_ms = snowflake_timestamp_ms(store.last_id()) - top_ms;
+    // 1 ページに収まる程度 (約 9 割) の幅にして、窓ごとの往復を 1 回で済ませる
+    uint64_t window_ms = std::max<uint64_t>(60000, span_ms * MESSAGES_PAGE_SIZE * 9 / 10 / std::max<size_t>(1, store.size() - 1));
+    uint64_t next_top_ms = top_ms;
+    bool reached_start = false;
+    bool ok = true;
+
+    auto open_window = [&] {
+        uint64_t upper = windows.empty() ? store.first_id() : snowflake_from_ms(next_top_ms);
+        uint64_t bottom_ms = next_top_ms > window_ms ? next_top_ms - window_ms : 0;
+        windows.push_back({snowflake_from_ms(bottom_ms), upper});
+        ready.push_back(windows.size() - 1);
+        next_top_ms = bottom_ms;
+    };
+    auto active_windows = [&] {
+        size_t active = 0;
+        for (const auto& window : windows) active += window.before != 0;
+        return active;
+    };
+
+    MultiFetcher fetcher(conn, HISTORY_MAX_IN_FLIGHT);
+    for (;;) {
+        // 必要な件数に届くまで新しい時間窓を開く
+        while (ok && !reached_start && snowflake_from_ms(next_top_ms) > 0 && ready.size() + fetcher.in_flight() < HISTORY_MAX_IN_FLIGHT &&
+               store.size() + active_windows() * MESSAGES_PAGE_SIZE < count) {
+            open_window();
+        }
+
+        auto wait = RateLimiter::Clock::duration::zero();
+        while (!ready.empty() && !fetcher.full()) {
+            wait = limiter.reserve(GET_MESSAGES_ROUTE, channel_id);
+            if (wait > RateLimiter::Clock::duration::zero()) break;
+            size_t index = ready.front();
+            ready.pop_front();
+            fetcher.start(messages_url(channel_id) + "?limit=" + std::to_string(MESSAGES_PAGE_SIZE) +
+                          "&before=" + std::to_string(windows[index].before), index);
+        }
+        if (fetcher.in_flight() == 0) {
+            if (ready.empty()) break;
+            std::this_thread::sleep_for(wait);
+            continue;
+        }
+
+        for (auto& [index, response] : fetcher.poll(std::chrono::milliseconds(100))) {
+            limiter.update(GET_MESSAGES_ROUTE, channel_id, response);
+            Window& window = windows[index];
+            if (response.status == 429) {
+                ready.push_front(index);
+                continue;
+            }
+            std::vector<StoredMessage> page;
+            std::string error;
+            if (response.result != CURLE_OK) {
+                std::cerr << "Request failed: " << curl_easy_strerror(response.result) << std::endl;
+            } else if (response.status != 200) {
+                std::cerr << "API Error [" << response.status << "]: " << response.body << std::endl;
+            } else if (!parse_messages(response.body, page, error)) {
+                std::cerr << error << std::endl;
+            } else {
+                uint64_t oldest = window.before;
+                for (const auto& message : page) oldest = std::min(oldest, message.id);
+                if (page.size() < static_cast<size_t>(MESSAGES_PAGE_SIZE)) reached_start = true;
+                // 次の窓の範囲に入ったメッセージはそちらに任せる
+                page.erase(std::remove_if(page.begin(), page.end(), [&](const StoredMessage& m) { return m.id < window.lower; }), page.end());
+                window.fetched += store.append(page);
+                if (page.size() == static_cast<size_t>(MESSAGES_PAGE_SIZE) && oldest > window.lower) {
+                    window.before = oldest;
+                    ready.push_back(index);
+                } else {
+                    window.before = 0;
+                    // 疎な時間帯では窓を広げる
+                    if (window.fetched < MESSAGES_PAGE_SIZE / 4) window_ms *= 2;
+                }
+                continue;
+            }
+            window.before = 0;
+            ok = false;
+        }
+        if (!ok) ready.clear();
+    }
+    return ok;
+}
+
+// Format a snowflake's creation time as local "YYYY-MM-DD HH:MM"
+std::string format_snowflake_time(uint64_t id) {
+    std::time_t seconds = static_cast<std::time_t>(snowflake_timestamp_ms(id) / 1000);
+    std::tm local{};
+    localtime_r(&seconds, &local);
+    char buffer[32];
+    std::strftime(buffer, sizeof(buffer), "%Y-%m-%d %H:%M", &local);
+    return buffer;
+}
+
+// Print the last `count` cached messages of a channel, oldest first
+void print_history(const MessageStore& store, size_t count) {
+    size_t begin = store.size() > count ? store.size() - count : 0;
+    for (size_t i = begin; i < store.size(); ++i) {
+        MessageView message = store.at(i);
+        std::cout << "[" << format_snowflake_time(message.id) << "] " << message.author << ": " << message.content << "\n";
+    }
+    std::cout << std::flush;
+}
+
+// Print the latest `count` messages across several channels, k-way merged by
+// snowflake into one time-ordered stream labelled with the channel name
+void print_merged(const std::vector<std::pair<std::string, const MessageStore*>>& sources, size_t count) {
+    // 各チャンネルの末尾から新しい順に取り出す (max-heap)
+    using Cursor = std::tuple<uint64_t, size_t, size_t>; // (snowflake, source, index)
+    std::priority_queue<Cursor> heap;
+    for (size_t i = 0; i < sources.size(); ++i) {
+        const MessageStore* store = sources[i].second;
+        if (store->size() > 0) heap.emplace(store->at(store->size() - 1).id, i, store->size() - 1);
+    }
+    std::vector<std::pair<size_t, size_t>> picked;
+    while (!heap.empty() && picked.size() < count) {
+        auto [id, source, index] = heap.top();
+        heap.pop();
+        picked.emplace_back(source, index);
+        if (index > 0) heap.emplace(sources[source].second->at(index - 1).id, source, index - 1);
+    }
+    for (auto it = picked.rbegin(); it != picked.rend(); ++it) {
+        MessageView message = sources[it->first].second->at(it->second);
+        std::cout << "[" << format_snowflake_time(message.id) << "] #" << sources[it->first].first << " "
+                  << message.author << ": " << message.content << "\n";
+    }
+    std::cout << std::flush;
+}
+
+const size_t TAIL_DEFAULT_COUNT = 50;
+
+// Fetch new messages from every configured channel at once and print a merged view
+bool tail_all(ConnectionManager& conn, RateLimiter& limiter, MessageCache& cache,
+              const std::map<std::string, std::string>& channels, size_t count) {
+    std::vector<std::pair<std::string, MessageStore*>> targets;
+    std::vector<std::pair<std::string, const MessageStore*>> sources;
+    for (const auto& [name, id] : channels) {
+        MessageStore& store = cache.channel(id);
+        targets.emplace_back(id, &store);
+        sources.emplace_back(name, &store);
+    }
+    bool ok = sync_channels(conn, limiter, targets);
+    print_merged(sources, count);
+    return ok;
+}
+
+// 全文検索インデックスのディレクトリ
+std::string get_search_dir() {
+    return get_cache_dir() + "search/";
+}
+
+// Append the index terms of `text` to `terms`: lowercased ASCII words, and pairs
+// of adjacent characters inside non-ASCII runs (Japanese has no spaces to split on)
+void tokenize(std::string_view text, std::vector<std::string>& terms) {
+    size_t i = 0;
+    while (i < text.size()) {
+        unsigned char c = text[i];
+        if (std::isalnum(c)) {
+            size_t start = i;
+            while (i < text.size() && std::isalnum(static_cast<unsigned char>(text[i]))) ++i;
+            std::string word(text.substr(start, i - start));
+            for (auto& ch : word) ch = static_cast<char>(std::tolower(static_cast<unsigned char>(ch)));
+            terms.push_back(std::move(word));
+        } else if (c >= 0x80) {
+            // 文字単位に区切り、隣り合う 2 文字ずつを語とする
+            std::vector<std::string_view> chars;
+            while (i < text.size() && static_cast<unsigned char>(text[i]) >= 0x80) {
+                size_t start = i++;
+                while (i < text.size() && (static_cast<unsigned char>(text[i]) & 0xc0) == 0x80) ++i;
+                chars.push_back(text.substr(start, i - start));
+            }
+            for (size_t k = 0; k + 1 < chars.size(); ++k) {
+                std::string pair(chars[k]);
+                pair += chars[k + 1];
+                terms.push_back(std::move(pair));
+            }
+            // 最後の文字は 2 文字語の先頭にならないので、1 文字でも索引に入れる
+            // (1 文字の検索は前方一致でそれ以外の位置の 2 文字語に当たる)
+            terms.emplace_back(chars.back());
+        } else {
+            ++i;
+        }
+    }
+}
+
+// Term under which a message's author is indexed ("\x01" keeps it apart from words)
+std::string author_term(std::string_view author) {
+    std::string term = "\x01";
+    for (unsigned char c : author) term += static_cast<char>(std::tolower(c));
+    return term;
+}
+
+// A parsed /search query: words (all must appear) plus filters
+//   from:<author>  in:<channel>  after:<time>  before:<time>
+// where a time is a date (YYYY-MM-DD, local time) or an age like 30m / 12h / 7d / 2w.
+struct SearchQuery {
+    std::vector<std::string> words;
+    std::string author;
+    std::string channel_id;
+    uint64_t after = 0;                                   // snowflake, exclusive
+    uint64_t before = std::numeric_limits<uint64_t>::max(); // snowflake, exclusive
+    size_t limit = 20;
+};
+
+// Parse a time filter into milliseconds since the Unix epoch
+bool parse_search_time(const std::string& value, uint64_t& ms) {
+    auto now = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+    if (!value.empty() && std::isdigit(static_cast<unsigned char>(value[0])) && std::strchr("mhdw", value.back())) {
+        char* end = nullptr;
+        uint64_t amount = std::strtoull(value.c_str(), &end, 10);
+        if (end != value.c_str() + value.size() - 1) return false;
+        static const std::map<char, uint64_t> UNITS{{'m', 60000}, {'h', 3600000}, {'d', 86400000}, {'w', 604800000}};
+        uint64_t age = amount * UNITS.at(value.back());
+        ms = age < static_cast<uint64_t>(now) ? now - age : 0;
+        return true;
+    }
+    std::tm date{};
+    const char* end = strptime(value.c_str(), "%Y-%m-%d", &date);
+    if (!end || *end) return false;
+    ms = static_cast<uint64_t>(mktime(&date)) * 1000; // ローカル時刻の 0 時
+    return true;
+}
+
+bool parse_search_query(const std::string& text, const std::map<std::string, std::string>& channels,
+                        SearchQuery& query, std::string& error) {
+    std::istringstream input(text);
+    std::string token;
+    while (input >> token) {
+        size_t colon = token.find(':');
+        std::string key = colon == std::string::npos ? "" : token.substr(0, colon);
+        std::string value = colon == std::string::npos ? "" : token.substr(colon + 1);
+        if (key == "from" && !value.empty()) {
+            query.author = value;
+        } else if (key == "in" && !value.empty()) {
+            query.channel_id = resolve_channel(channels, value);
+            if (query.channel_id.empty()) {
+                error = "Unknown channel: " + value;
+                return false;
+            }
+        } else if ((key == "after" || key == "before") && !value.empty()) {
+            uint64_t ms;
+            if (!parse_search_time(value, ms)) {
+                error = "Invalid time: " + value + " (use YYYY-MM-DD or an age like 12h, 7d)";
+                return false;
+            }
+            (key == "after" ? query.after : query.before) = snowflake_from_ms(ms);
+        } else {
+            query.words.push_back(ascii_lower(token));
+        }
+    }
+    if (query.words.empty() && query.author.empty() && query.channel_id.empty() && query.after == 0 &&
+        query.before == std::numeric_limits<uint64_t>::max()) {
+        error = "Empty search query";
+        return false;
+    }
+    return true;
+}
+
+// One immutable index segment, memory-mapped. Layout (native byte order):
+//   SegmentHeader | Doc[doc_count] | TermEntry[term_count] (sorted by term) |
+//   term bytes | uint32 postings (doc numbers, ascending per term)
+class SearchSegment {
+public:
+    struct Doc {
+        uint64_t id;      // snowflake
+        uint64_t channel; // channel ID
+    };
+
+    explicit SearchSegment(const std::string& path) : path_(path) {
+        int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) throw std::runtime_error("Cannot open search segment: " + path);
+        struct stat st;
+        if (fstat(fd, &st) < 0 || static_cast<size_t>(st.st_size) < sizeof(SegmentHeader)) {
+            close(fd);
+            throw std::runtime_error("Broken search segment: " + path);
+        }
+        size_ = st.st_size;
+        void* data = mmap(nullptr, size_, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if (data == MAP_FAILED) throw std::runtime_error("Cannot map search segment: " + path);
+        data_ = static_cast<const char*>(data);
+        std::memcpy(&header_, data_, sizeof(header_));
+        if (std::memcmp(header_.magic, MAGIC, sizeof(MAGIC)) != 0 ||
+            header_.postings_offset + uint64_t(header_.postings_count) * sizeof(uint32_t) > size_) {
+            munmap(const_cast<char*>(data_), size_);
+            throw std::runtime_error("Broken search segment: " + path);
+        }
+        docs_ = reinterpret_cast<const Doc*>(data_ + sizeof(SegmentHeader));
+        terms_ = reinterpret_cast<const TermEntry*>(data_ + header_.terms_offset);
+        postings_ = reinterpret_cast<const uint32_t*>(data_ + header_.postings_offset);
+    }
+
+    ~SearchSegment() { munmap(const_cast<char*>(data_), size_); }
+
+    SearchSegment(const SearchSegment&) = delete;
+    SearchSegment& operator=(const SearchSegment&) = delete;
+
+    const std::string& path() const { return path_; }
+    size_t doc_count() const { return header_.doc_count; }
+    size_t term_count() const { return header_.term_count; }
+    const Doc& doc(size_t i) const { return docs_[i]; }
+    std::string_view term(size_t i) const { return {data_ + header_.strings_offset + terms_[i].string_offset, terms_[i].string_size}; }
+    std::pair<const uint32_t*, const uint32_t*> postings(size_t i) const {
+        const uint32_t* begin = postings_ + terms_[i].postings_offset;
+        return {begin, begin + terms_[i].postings_count};
+    }
+
+    // Range of term indexes starting with `prefix` (exactly `prefix` if !is_prefix)
+    std::pair<size_t, size_t> find(std::string_view prefix, bool is_prefix) const {
+        size_t lo = 0, hi = header_.term_count;
+        while (lo < hi) {
+            size_t mid = (lo + hi) / 2;
+            if (term(mid) < prefix) lo = mid + 1; else hi = mid;
+        }
+        size_t end = lo;
+        if (!is_prefix) return {lo, lo < header_.term_count && term(lo) == prefix ? lo + 1 : lo};
+        while (end < header_.term_count && term(end).substr(0, prefix.size()) == prefix) ++end;
+        return {lo, end};
+    }
+
+    // Documents matching any term in [first, last), ascending
+    void collect(std::pair<size_t, size_t> range, std::vector<uint32_t>& out) const {
+        out.clear();
+        if (range.second - range.first == 1) {
+            auto [begin, end] = postings(range.first);
+            out.assign(begin, end);
+            return;
+        }
+        for (size_t i = range.first; i < range.second; ++i) {
+            auto [begin, end] = postings(i);
+            out.insert(out.end(), begin, end);
+        }
+        std::sort(out.begin(), out.end());
+        out.erase(std::unique(out.begin(), out.end()), out.end());
+    }
+
+    struct SegmentHeader {
+        char magic[8];
+        uint32_t doc_count;
+        uint32_t term_count;
+        uint64_t terms_offset;
+        uint64_t strings_offset;
+        uint64_t postings_offset;
+        uint32_t postings_count;
+        uint32_t reserved;
+    };
+    struct TermEntry {
+        uint32_t string_offset;
+        uint32_t string_size;
+        uint32_t postings_offset; // postings 配列内の位置
+        uint32_t postings_count;
+    };
+    static constexpr char MAGIC[8] = {'D', 'C', 'L', 'I', 'I', 'D', 'X', '1'};
+
+private:
+    std::string path_;
+    const char* data_ = nullptr;
+    size_t size_ = 0;
+    SegmentHeader header_{};
+    const Doc* docs_ = nullptr;
+    const TermEntry* terms_ = nullptr;
+    const uint32_t* postings_ = nullptr;
+};
+
+// Collects documents in memory and writes them out as a SearchSegment
+class SegmentBuilder {
+public:
+    bool empty() const { return docs_.empty(); }
+    size_t doc_count() const { return docs_.size(); }
+
+    void add(uint64_t id, uint64_t channel, std::string_view author, std::string_view content) {
+        uint32_t doc = static_cast<uint32_t>(docs_.size());
+        docs_.push_back({id, channel});
+        terms_.clear();
+        tokenize(content, terms_);
+        terms_.push_back(author_term(author));
+        for (auto& term : terms_) {
+            auto& list = postings_[term];
+            if (list.empty() || list.back() != doc) list.push_back(doc); // 同じ語は 1 回だけ
+        }
+    }
+
+    // Append every document of `segment`, keeping doc numbers ascending
+    void add(const SearchSegment& segment) {
+        uint32_t base = static_cast<uint32_t>(docs_.size());
+        for (size_t i = 0; i < segment.doc_count(); ++i) docs_.push_back(segment.doc(i));
+        for (size_t t = 0; t < segment.term_count(); ++t) {
+            auto& list = postings_[std::string(segment.term(t))];
+            auto [begin, end] = segment.postings(t);
+            for (const uint32_t* p = begin; p != end; ++p) list.push_back(base + *p);
+        }
+    }
+
+    // Write to `path` via a temporary file and rename, so readers never see half a segment
+    bool write(const std::string& path) const {
+        std::vector<const std::pair<const std::string, std::vector<uint32_t>>*> sorted;
+        sorted.reserve(postings_.size());
+        for (const auto& entry : postings_) sorted.push_back(&entry);
+        std::sort(sorted.begin(), sorted.end(), [](const auto* a, const auto* b) { return a->first < b->first; });
+
+        using Header = SearchSegment::SegmentHeader;
+        using TermEntry = SearchSegment::TermEntry;
+        std::vector<TermEntry> entries;
+        std::string strings;
+        std::vector<uint32_t> postings;
+        for (const auto* entry : sorted) {
+            entries.push_back({static_cast<uint32_t>(strings.size()), static_cast<uint32_t>(entry->first.size()),
+                               static_cast<uint32_t>(postings.size()), static_cast<uint32_t>(entry->second.size())});
+            strings += entry->first;
+            postings.insert(postings.end(), entry->second.begin(), entry->second.end());
+        }
+
+        Header header{};
+        std::memcpy(header.magic, SearchSegment::MAGIC, sizeof(header.magic));
+        header.doc_count = static_cast<uint32_t>(docs_.size());
+        header.term_count = static_cast<uint32_t>(entries.size());
+        header.terms_offset = sizeof(Header) + docs_.size() * sizeof(SearchSegment::Doc);
+        header.strings_offset = header.terms_offset + entries.size() * sizeof(TermEntry);
+        header.postings_offset = (header.strings_offset + strings.size() + 3) & ~uint64_t(3); // 4 バイト境界
+        header.postings_count = static_cast<uint32_t>(postings.size());
+
+        std::string tmp = path + ".tmp";
+        std::ofstream file(tmp, std::ios::binary | std::ios::trunc);
+        if (!file) return false;
+        file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        file.write(reinterpret_cast<const char*>(docs_.data()), docs_.size() * sizeof(SearchSegment::Doc));
+        file.write(reinterpret_cast<const char*>(entries.data()), entries.size() * sizeof(TermEntry));
+        file.write(strings.data(), strings.size());
+        file.write("\0\0\0", header.postings_offset - header.strings_offset - strings.size());
+        file.write(reinterpret_cast<const char*>(postings.data()), postings.size() * sizeof(uint32_t));
+        file.close();
+        if (!file) {
+            unlink(tmp.c_str());
+            return false;
+        }
+        return rename(tmp.c_str(), path.c_str()) == 0;
+    }
+
+private:
+    std::vector<SearchSegment::Doc> docs_;
+    std::unordered_map<std::string, std::vector<uint32_t>> postings_;
+    std::vector<std::string> terms_;
+};
+
+// A search result: message and the channel it is in
+struct SearchHit {
+    uint64_t id;
+    std::string channel_id;
+};
+
+// Inverted index over every cached channel (~/.config/dcli/cache/*.msgs), kept
+// in ~/.config/dcli/cache/search/ as immutable segment files plus a manifest of
+// how far into each channel's cache has been indexed. update() indexes only
+// records appended since the last run into a new segment, and merges segments
+// once there are too many. Queries read the mapped segments and the message
+// caches only, never the network.
+class SearchIndex {
+public:
+    static const size_t MAX_SEGMENTS = 8;
+    // Bumped when tokenize() changes; an index built by another version is rebuilt
+    static constexpr int VERSION = 2;
+
+    SearchIndex() : dir_(get_search_dir()) {
+        mkdir(get_config_dir().c_str(), 0700);
+        mkdir(get_cache_dir().c_str(), 0700);
+        mkdir(dir_.c_str(), 0700);
+        lock_fd_ = ::open((dir_ + "lock").c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+        if (lock_fd_ < 0) throw std::runtime_error("Cannot open search index: " + dir_);
+    }
+
+    ~SearchIndex() { close(lock_fd_); }
+
+    SearchIndex(const SearchIndex&) = delete;
+    SearchIndex& operator=(const SearchIndex&) = delete;
+
+    // Index messages cached since the last update; returns how many were added.
+    // Each cache file is opened, indexed and closed in turn, so only one is
+    // mapped at a time however many channels have been cached.
+    size_t update() {
+        flock(lock_fd_, LOCK_EX);
+        try {
+            json manifest = load_manifest();
+            bool rebuilt = manifest.value("version", 1) != VERSION;
+            if (rebuilt) {
+                for (const auto& name : manifest["segments"]) unlink((dir_ + name.get<std::string>()).c_str());
+                manifest = {{"version", VERSION}, {"channels", json::object()}, {"segments", json::array()}};
+            }
+            json& indexed = manifest["channels"];
+            SegmentBuilder builder;
+            for (const auto& channel_id : cached_channels()) {
+                MessageStore store(channel_id);
+                uint64_t from = indexed.value(channel_id, uint64_t(0));
+                if (from > store.end_offset()) from = 0; // キャッシュが作り直された
+                if (from == store.end_offset()) continue;
+                uint64_t channel = parse_snowflake(channel_id);
+                for (size_t i = 0; i < store.size(); ++i) {
+                    if (store.offset(i) < from) continue;
+                    MessageView message = store.at(i);
+                    builder.add(message.id, channel, message.author, message.content);
+                }
+                indexed[channel_id] = store.end_offset();
+            }
+
+            size_t added = builder.doc_count();
+            json& segments = manifest["segments"];
+            if (!builder.empty()) {
+                std::string name = "segment-" + std::to_string(manifest.value("next_segment", 1)) + ".idx";
+                manifest["next_segment"] = manifest.value("next_segment", 1) + 1;
+                if (!builder.write(dir_ + name)) throw std::runtime_error("Cannot write search segment: " + dir_ + name);
+                segments.push_back(name);
+            }
+            if (segments.size() > MAX_SEGMENTS) merge(manifest);
+            if (added > 0 || rebuilt) save_manifest(manifest);
+            load_segments(manifest);
+            flock(lock_fd_, LOCK_UN);
+            return added;
+        } catch (...) {
+            flock(lock_fd_, LOCK_UN);
+            throw;
+        }
+    }
+
+    size_t doc_count() const {
+        size_t count = 0;
+        for (const auto& segment : segments_) count += segment->doc_count();
+        return count;
+    }
+
+    // Newest matches first, at most query.limit of them
+    std::vector<SearchHit> search(const SearchQuery& query, MessageCache& cache) const {
+        uint64_t channel_filter = query.channel_id.empty() ? 0 : parse_snowflake(query.channel_id);
+        std::vector<std::pair<uint64_t, uint64_t>> candidates; // (snowflake, channel)
+        std::vector<uint32_t> matches, term_docs, merged;
+        for (const auto& segment : segments_) {
+            bool all = true;
+            auto narrow = [&](std::pair<size_t, size_t> range) {
+                segment->collect(range, term_docs);
+                if (all) {
+                    matches.swap(term_docs);
+                    all = false;
+                } else {
+                    merged.clear();
+                    std::set_intersection(matches.begin(), matches.end(), term_docs.begin(), term_docs.end(), std::back_inserter(merged));
+                    matches.swap(merged);
+                }
+            };
+            if (!query.author.empty()) narrow(segment->find(author_term(query.author), false));
+            for (const auto& word : query.words) {
+                terms_.clear();
+                tokenize(word, terms_);
+                // 各語の末尾は前方一致 ("deploy" で "deployed" にも当たる)
+                for (size_t t = 0; t < terms_.size(); ++t) narrow(segment->find(terms_[t], t + 1 == terms_.size()));
+            }
+            auto consider = [&](uint32_t i) {
+                const SearchSegment::Doc& doc = segment->doc(i);
+                if (channel_filter && doc.channel != channel_filter) return;
+                if (doc.id <= query.after || doc.id >= query.before) return;
+                candidates.emplace_back(doc.id, doc.channel);
+            };
+            if (all) {
+                for (size_t i = 0; i < segment->doc_count(); ++i) consider(static_cast<uint32_t>(i));
+            } else {
+                for (uint32_t i : matches) consider(i);
+            }
+        }
+        std::sort(candidates.begin(), candidates.end(), std::greater<>());
+        candidates.erase(std::unique(candidates.begin(), candidates.end()), candidates.end());
+
+        // 語の区切りをまたぐ一致などを除くため、本文に各語が含まれるか確かめる
+        std::vector<SearchHit> hits;
+        for (const auto& [id, channel] : candidates) {
+            if (hits.size() >= query.limit) break;
+            std::string channel_id = std::to_string(channel);
+            MessageView message;
+            if (!cache.channel(channel_id).find(id, message)) continue;
+            std::string content = ascii_lower(message.content);
+            bool ok = std::all_of(query.words.begin(), query.words.end(),
+                                  [&](const std::string& word) { return content.find(word) != std::string::npos; });
+            if (ok) hits.push_back({id, std::move(channel_id)});
+        }
+        return hits;
+    }
+
+private:
+    // チャンネル ID (キャッシュファイル名) の一覧
+    std::vector<std::string> cached_channels() const {
+        std::vector<std::string> channels;
+        DIR* dir = opendir(get_cache_dir().c_str());
+        if (!dir) return channels;
+        while (dirent* entry = readdir(dir)) {
+            std::string name = entry->d_name;
+            if (name.size() > 5 && name.compare(name.size() - 5, 5, ".msgs") == 0) channels.push_back(name.substr(0, name.size() - 5));
+        }
+        closedir(dir);
+        std::sort(channels.begin(), channels.end());
+        return channels;
+    }
+
+    json load_manifest() const {
+        std::ifstream file(dir_ + "manifest.json");
+        json manifest = file ? json::parse(file, nullptr, false) : json::object();
+        if (!manifest.is_object()) manifest = json::object();
+        if (!manifest.contains("channels") || !manifest["channels"].is_object()) manifest["channels"] = json::object();
+        if (!manifest.contains("segments") || !manifest["segments"].is_array()) manifest["segments"] = json::array();
+        return manifest;
+    }
+
+    void save_manifest(const json& manifest) const {
+        std::string path = dir_ + "manifest.json", tmp = path + ".tmp";
+        {
+            std::ofstream file(tmp, std::ios::trunc);
+            file << manifest.dump();
+            if (!file) throw std::runtime_error("Cannot write search manifest: " + path);
+        }
+        if (rename(tmp.c_str(), path.c_str()) != 0) throw std::runtime_error("Cannot write search manifest: " + path);
+    }
+
+    // Fold the small segments written since the first one into one segment; the
+    // first (usually large) one is only rewritten once the rest add up to half its size
+    void merge(json& manifest) {
+        std::vector<std::unique_ptr<SearchSegment>> segments;
+        size_t rest = 0;
+        for (const auto& name : manifest["segments"]) {
+            segments.push_back(std::make_unique<SearchSegment>(dir_ + name.get<std::string>()));
+            if (segments.size() > 1) rest += segments.back()->doc_count();
+        }
+        size_t first = rest * 2 >= segments.front()->doc_count() ? 0 : 1;
+
+        SegmentBuilder builder;
+        std::vector<std::string> old;
+        json kept = json::array();
+        for (size_t i = 0; i < segments.size(); ++i) {
+            if (i < first) {
+                kept.push_back(manifest["segments"][i]);
+                continue;
+            }
+            builder.add(*segments[i]);
+            old.push_back(manifest["segments"][i]);
+        }
+        segments.clear();
+        std::string name = "segment-" + std::to_string(manifest.value("next_segment", 1)) + ".idx";
+        manifest["next_segment"] = manifest.value("next_segment", 1) + 1;
+        if (!builder.write(dir_ + name)) throw std::runtime_error("Cannot write search segment: " + dir_ + name);
+        kept.push_back(name);
+        manifest["segments"] = kept;
+        save_manifest(manifest);
+        segments_.clear();
+        for (const auto& path : old) unlink((dir_ + path).c_str());
+    }
+
+    void load_segments(const json& manifest) {
+        std::map<std::string, std::unique_ptr<SearchSegment>> open;
+        for (auto& segment : segments_) open[segment->path()] = std::move(segment);
+        segments_.clear();
+        for (const auto& name : manifest["segments"]) {
+            std::string path = dir_ + name.get<std::string>();
+            auto it = open.find(path);
+            segments_.push_back(it != open.end() ? std::move(it->second) : std::make_unique<SearchSegment>(path));
+        }
+    }
+
+    std::string dir_;
+    int lock_fd_ = -1;
+    std::vector<std::unique_ptr<SearchSegment>> segments_;
+    mutable std::vector<std::string> terms_;
+};
+
+// Bring the index up to date with the message caches, then print the matches
+void run_search(SearchIndex& index, MessageCache& cache, const std::map<std::string, std::string>& channels,
+                const ChannelNames& names, const std::string& text) {
+    SearchQuery query;
+    std::string error;
+    if (!parse_search_query(text, channels, query, error)) {
+        std::cerr << error << "\n";
+        return;
+    }
+    auto start = std::chrono::steady_clock::now();
+    size_t added = index.update();
+    auto indexed = std::chrono::steady_clock::now();
+    auto hits = index.search(query, cache);
+    auto done = std::chrono::steady_clock::now();
+
+    for (auto it = hits.rbegin(); it != hits.rend(); ++it) {
+        std::string channel_name = channel_label(names, it->channel_id);
+        MessageView message;
+        if (!cache.channel(it->channel_id).find(it->id, message)) continue;
+        std::cout << "[" << format_snowflake_time(message.id) << "] #" << channel_name << " " << message.author << ": "
+                  << message.content << "\n";
+    }
+    auto ms = [](auto duration) { return std::chrono::duration<double, std::milli>(duration).count(); };
+    std::cout << (hits.empty() ? "No matches"
+                               : std::to_string(hits.size()) + (hits.size() == query.limit ? "+" : "") + (hits.size() == 1 ? " match" : " matches"))
+              << " in " << index.doc_count() << " messages (" << std::fixed << std::setprecision(1) << ms(done - indexed) << "ms";
+    if (added > 0) std::cout << "; indexed " << added << " new in " << ms(indexed - start) << "ms";
+    std::cout << ")" << std::endl;
+}
+
+// Blocking bounded FIFO between pipeline stages. push() waits while the queue is
+// full and pop() while it is empty; close() wakes both sides, after which push()
+// fails and pop() drains what is left.
+template <typename T>
+class BoundedQueue {
+public:
+    explicit BoundedQueue(size_t capacity) : capacity_(capacity) {}
+
+    bool push(T value) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        not_full_.wait(lock, [this] { return closed_ || items_.size() < capacity_; });
+        if (closed_) return false;
+        items_.push_back(std::move(value));
+        not_empty_.notify_one();
+        return true;
+    }
+
+    bool pop(T& value) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        not_empty_.wait(lock, [this] { return closed_ || !items_.empty(); });
+        if (items_.empty()) return false;
+        value = std::move(items_.front());
+        items_.pop_front();
+        not_full_.notify_one();
+        return true;
+    }
+
+    void close() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        closed_ = true;
+        not_full_.notify_all();
+        not_empty_.notify_all();
+    }
+
+private:
+    size_t capacity_;
+    std::deque<T> items_;
+    bool closed_ = false;
+    std::mutex mutex_;
+    std::condition_variable not_full_;
+    std::condition_variable not_empty_;
+};
+
+// 未送信のページと圧縮待ちのチャンクの上限 (メモリ使用量を一定に保つ)
+const size_t EXPORT_QUEUE_DEPTH = 4;
+// A gzip member is closed and the state file updated after this many messages or this long
+const size_t EXPORT_CHECKPOINT_MESSAGES = 5000;
+const std::chrono::seconds EXPORT_CHECKPOINT_INTERVAL{10};
+
+// Call `element` with each top-level element of a JSON array, as raw text.
+// `compact` is false when the element has whitespace outside its strings.
+// Returns false if `body` is not a well-formed array at this level.
+bool split_json_array(std::string_view body, const std::function<void(std::string_view, bool compact)>& element) {
+    size_t i = body.find_first_not_of(" \t\r\n");
+    if (i == std::string_view::npos || body[i] != '[') return false;
+    int depth = 0;
+    bool in_string = false, compact = true;
+    size_t start = 0;
+    for (++i; i < body.size(); ++i) {
+        char c = body[i];
+        if (in_string) {
+            if (c == '\\') {
+                ++i;
+            } else if (c == '"') {
+                in_string = false;
+            }
+            continue;
+        }
+        switch (c) {
+            case '"':
+                if (depth == 0) return false;
+                in_string = true;
+                break;
+            case '{':
+            case '[':
+                if (depth++ == 0) {
+                    start = i;
+                    compact = true;
+                }
+                break;
+            case '}':
+            case ']':
+                if (depth == 0) return c == ']';
+                if (--depth == 0) element(body.substr(start, i + 1 - start), compact);
+                break;
+            case ' ':
+            case '\t':
+            case '\r':
+            case '\n':
+                if (depth > 0) compact = false;
+                break;
+            default:
+                // メッセージはオブジェクトのみ (数値などのトップレベル要素は想定しない)
+                if (depth == 0 && c != ',') return false;
+        }
+    }
+    return false;
+}
+
+// Resume point of an export, kept next to the output as <out>.state
+struct ExportState {
+    std::string channel_id;
+    uint64_t last_id = 0;  // newest message already in the output
+    uint64_t bytes = 0;    // output size at the last checkpoint
+    uint64_t messages = 0;
+};
+
+bool load_export_state(const std::string& path, ExportState& state) {
+    std::ifstream file(path);
+    if (!file) return false;
+    json record = json::parse(file, nullptr, false);
+    if (!record.is_object()) return false;
+    state.channel_id = record.value("channel", "");
+    state.last_id = parse_snowflake(record.value("last_id", "0"));
+    state.bytes = record.value("bytes", 0ULL);
+    state.messages = record.value("messages", 0ULL);
+    return !state.channel_id.empty();
+}
+
+bool save_export_state(const std::string& path, const ExportState& state) {
+    std::string tmp = path + ".tmp";
+    {
+        std::ofstream file(tmp, std::ios::trunc);
+        file << json{{"channel", state.channel_id},
+                     {"last_id", std::to_string(state.last_id)},
+                     {"bytes", state.bytes},
+                     {"messages", state.messages}}.dump() << "\n";
+        if (!file) return false;
+    }
+    return rename(tmp.c_str(), path.c_str()) == 0;
+}
+
+// Stream a channel's whole history, oldest first, into `out_path` as gzip-compressed
+// NDJSON (one message object per line, exactly as the API returned it).
+//
+// Three threads with bounded queues between them:
+//   fetch:    GET ?after=<cursor>&limit=100 through the rate limiter (compressed responses)
+//   parse:    hands the next cursor straight back to the fetcher, then splits the page
+//             into lines and puts them in snowflake order
+//   compress: the calling thread deflates the lines and writes them out
+// Each cursor depends on the previous page, so one request is in flight at a time and
+// parsing and compression overlap with it; the rate limit, not the CPU, sets the pace.
+//
+// Every EXPORT_CHECKPOINT_MESSAGES messages the current gzip member is finished and
+// fdatasync'd and the state file records the output size and the last snowflake.
+// A rerun truncates the output back to that point and continues after it, and once
+// the export is complete a rerun appends only the messages posted since.
+bool export_channel(ConnectionManager& conn, RateLimiter& limiter, const std::string& channel_id, const std::string& label,
+                    const std::string& out_path) {
+    const std::string state_path = out_path + ".state";
+    ExportState state;
+    bool resuming = load_export_state(state_path, state);
+    if (resuming && state.channel_id != channel_id) {
+        std::cerr << out_path << " is an export of channel " << state.channel_id << ", not " << channel_id << std::endl;
+        return false;
+    }
+    int fd = ::open(out_path.c_str(), O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        std::cerr << "Cannot open " << out_path << ": " << std::strerror(errno) << std::endl;
+        return false;
+    }
+    if (flock(fd, LOCK_EX | LOCK_NB) < 0) {
+        std::cerr << out_path << " is being written by another dcli process." << std::endl;
+        close(fd);
+        return false;
+    }
+    struct stat st{};
+    fstat(fd, &st);
+    if (!resuming && st.st_size > 0) {
+        std::cerr << out_path << " already exists and has no " << state_path << " to resume from." << std::endl;
+        close(fd);
+        return false;
+    }
+    if (resuming && static_cast<uint64_t>(st.st_size) < state.bytes) {
+        std::cerr << out_path << " is shorter than " << state_path << " records; cannot resume." << std::endl;
+        close(fd);
+        return false;
+    }
+    // 最後のチェックポイント以降に書かれた途中の gzip メンバーを捨てる
+    if (ftruncate(fd, state.bytes) < 0 || lseek(fd, state.bytes, SEEK_SET) < 0) {
+        std::cerr << "Cannot truncate " << out_path << ": " << std::strerror(errno) << std::endl;
+        close(fd);
+        return false;
+    }
+    state.channel_id = channel_id;
+    if (resuming) {
+        std::cout << "Resuming export of " << label << " after " << state.messages << " messages ("
+                  << format_snowflake_time(state.last_id) << ")" << std::endl;
+    }
+
+    struct Chunk {
+        std::string lines;
+        uint64_t last_id = 0;
+        size_t count = 0;
+    };
+    BoundedQueue<uint64_t> cursors(1);
+    BoundedQueue<std::string> pages(EXPORT_QUEUE_DEPTH);
+    BoundedQueue<Chunk> chunks(EXPORT_QUEUE_DEPTH);
+    std::mutex error_mutex;
+    std::string error;
+    auto fail = [&](const std::string& message) {
+        std::lock_guard<std::mutex> lock(error_mutex);
+        if (error.empty()) error = message;
+    };
+    std::atomic<uint64_t> wire_bytes{0}, body_bytes{0};
+
+    std::thread fetcher([&] {
+        const std::string query = "limit=" + std::to_string(MESSAGES_PAGE_SIZE) + "&after=";
+        uint64_t cursor;
+        while (cursors.pop(cursor)) {
+            HttpResponse response = fetch_messages(conn, limiter, channel_id, query + std::to_string(cursor));
+            if (response.result != CURLE_OK) {
+                fail(std::string("Request failed: ") + curl_easy_strerror(response.result));
+                break;
+            }
+            if (response.status != 200) {
+                fail("API Error [" + std::to_string(response.status) + "]: " + response.body);
+                break;
+            }
+            wire_bytes += response.timing.bytes_received;
+            body_bytes += response.body.size();
+            if (!pages.push(std::move(response.body))) break;
+        }
+        cursors.close();
+        pages.close();
+    });
+
+    std::thread parser([&] {
+        std::string body;
+        std::vector<StoredMessage> page;
+        std::vector<std::pair<uint64_t, std::string_view>> elements;
+        std::string parse_error;
+        while (pages.pop(body)) {
+            page.clear();
+            elements.clear();
+            if (!parse_messages(body, page, parse_error)) {
+                fail(parse_error);
+                break;
+            }
+            // 次のページの取得を先に始めさせる
+            uint64_t newest = 0;
+            for (const auto& message : page) newest = std::max(newest, message.id);
+            if (page.size() == static_cast<size_t>(MESSAGES_PAGE_SIZE)) {
+                cursors.push(newest);
+            } else {
+                cursors.close();
+            }
+
+            std::deque<std::string> compacted;
+            Chunk chunk;
+            size_t index = 0;
+            bool ok = split_json_array(body, [&](std::string_view raw, bool compact) {
+                if (index >= page.size()) return;
+                if (!compact) {
+                    // 整形された JSON は 1 行に詰め直す
+                    compacted.push_back(json::parse(raw).dump());
+                    raw = compacted.back();
+                }
+                elements.emplace_back(page[index++].id, raw);
+            });
+            if (!ok || elements.size() != page.size()) {
+                fail("Unexpected messages page: " + body.substr(0, 200));
+                break;
+            }
+            // API は新しい順に返すので snowflake 順に並べ直す
+            std::sort(elements.begin(), elements.end());
+            for (const auto& [id, raw] : elements) {
+                chunk.lines.append(raw.data(), raw.size());
+                chunk.lines += '\n';
+                chunk.last_id = id;
+                ++chunk.count;
+            }
+            if (chunk.count > 0 && !chunks.push(std::move(chunk))) break;
+        }
+        cursors.close();
+        pages.close();
+        chunks.close();
+    });
+
+    cursors.push(state.last_id);
+
+    // 圧縮と書き込み (このスレッド)
+    z_stream stream{};
+    deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY); // gzip
+    std::vector<char> out(1 << 16);
+    uint64_t written = state.bytes;
+    bool write_ok = true;
+    auto deflate_into_file = [&](const std::string& input, int flush) {
+        stream.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(input.data()));
+        stream.avail_in = static_cast<uInt>(input.size());
+        do {
+            stream.next_out = reinterpret_cast<Bytef*>(out.data());
+            stream.avail_out = static_cast<uInt>(out.size());
+            deflate(&stream, flush);
+            size_t have = out.size() - stream.avail_out, done = 0;
+            while (write_ok && done < have) {
+                ssize_t n = write(fd, out.data() + done, have - done);
+                if (n < 0 && errno == EINTR) continue;
+                if (n <= 0) {
+                    fail("Cannot write " + out_path + ": " + std::strerror(errno));
+                    write_ok = false;
+                    break;
+                }
+                done += n;
+            }
+            written += done;
+        } while (stream.avail_out == 0);
+    };
+
+    uint64_t member_id = state.last_id;
+    size_t member_messages = 0, exported = 0;
+    auto member_started = std::chrono::steady_clock::now();
+    auto checkpoint = [&] {
+        if (member_messages == 0 || !write_ok) return;
+        deflate_into_file(std::string(), Z_FINISH);
+        deflateReset(&stream);
+        if (!write_ok) return;
+        if (fdatasync(fd) < 0) {
+            fail("Cannot sync " + out_path + ": " + std::strerror(errno));
+            return;
+        }
+        state.last_id = member_id;
+        state.bytes = written;
+        state.messages += member_messages;
+        member_messages = 0;
+        if (!save_export_state(state_path, state)) fail("Cannot write " + state_path);
+    };
+
+    bool tty = isatty(STDOUT_FILENO);
+    auto start = std::chrono::steady_clock::now(), last_progress = start;
+    Chunk chunk;
+    while (chunks.pop(chunk)) {
+        deflate_into_file(chunk.lines, Z_NO_FLUSH);
+        if (!write_ok) break;
+        member_id = chunk.last_id;
+        member_messages += chunk.count;
+        exported += chunk.count;
+        auto now = std::chrono::steady_clock::now();
+        if (member_messages >= EXPORT_CHECKPOINT_MESSAGES || now - member_started >= EXPORT_CHECKPOINT_INTERVAL) {
+            checkpoint();
+            member_started = now;
+        }
+        if (tty && now - last_progress >= std::chrono::milliseconds(250)) {
+            last_progress = now;
+            double seconds = std::chrono::duration<double>(now - start).count();
+            std::cout << "\r\033[KExported " << state.messages + member_messages << " messages (up to "
+                      << format_snowflake_time(member_id) << "), " << std::fixed << std::setprecision(0)
+                      << (seconds > 0 ? exported / seconds : 0) << " msgs/s, " << format_bytes(written) << std::flush;
+        }
+    }
+    // 書き込みに失敗したら前段も止める
+    chunks.close();
+    pages.close();
+    cursors.close();
+    fetcher.join();
+    parser.join();
+    checkpoint();
+    deflateEnd(&stream);
+    close(fd);
+
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    if (tty) std::cout << "\r\033[K";
+    std::cout << "Exported " << exported << (resuming ? " new" : "") << " messages from " << label << " to " << out_path << " in "
+              << std::fixed << std::setprecision(1) << seconds << "s (" << std::setprecision(0)
+              << (seconds > 0 ? exported / seconds : 0) << " msgs/s); " << state.messages << " in total, "
+              << format_bytes(state.bytes) << " compressed";
+    if (body_bytes > 0) std::cout << ", " << format_bytes(wire_bytes) << " fetched for " << format_bytes(body_bytes) << " of JSON";
+    std::cout << std::endl;
+    if (!error.empty()) {
+        std::cerr << error << std::endl;
+        std::cerr << "Run the same command again to resume." << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// Minimal WebSocket client (RFC 6455) on top of a curl CONNECT_ONLY connection, so
+// TLS comes from libcurl. Covers what the Gateway needs: text/binary messages,
+// fragmentation, ping/pong and close.
+class WebSocket {
+public:
+    enum class Status { Message, Timeout, Closed };
+
+    // Connect to a ws:// or wss:// URL and perform the upgrade handshake
+    bool connect(const std::string& url, std::string& error) {
+        bool tls = url.rfind("wss://", 0) == 0;
+        if (!tls && url.rfind("ws://", 0) != 0) {
+            error = "Not a WebSocket URL: " + url;
+            return false;
+        }
+        std::string rest = url.substr(tls ? 6 : 5);
+        size_t slash = rest.find_first_of("/?");
+        std::string host = rest.substr(0, slash);
+        std::string target = slash == std::string::npos ? "/" : rest.substr(slash);
+        if (target[0] == '?') target = "/" + target;
+
+        curl_.reset(curl_easy_init());
+        if (!curl_) {
+            error = "Failed to initialize curl";
+            return false;
+        }
+        curl_easy_setopt(curl_.get(), CURLOPT_URL, ((tls ? "https://" : "http://") + host + "/").c_str());
+        curl_easy_setopt(curl_.get(), CURLOPT_CONNECT_ONLY, 1L);
+        curl_easy_setopt(curl_.get(), CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_1_1);
+        CURLcode res = curl_easy_perform(curl_.get());
+        if (res != CURLE_OK) {
+            error = curl_easy_strerror(res);
+            return false;
+        }
+        curl_easy_getinfo(curl_.get(), CURLINFO_ACTIVESOCKET, &socket_);
+
+        unsigned char nonce[16];
+        RAND_bytes(nonce, sizeof(nonce));
+        std::string key = base64_encode(nonce, sizeof(nonce));
+        std::string request = "GET " + target + " HTTP/1.1\r\n"
+                              "Host: " + host + "\r\n"
+                              "Upgrade: websocket\r\n"
+                              "Connection: Upgrade\r\n"
+                              "Sec-WebSocket-Key: " + key + "\r\n"
+                              "Sec-WebSocket-Version: 13\r\n\r\n";
+        if (!send_raw(request.data(), request.size())) {
+            error = "Failed to send the WebSocket handshake";
+            return false;
+        }
+
+        buffer_.clear();
+        size_t header_end;
+        while ((header_end = buffer_.find("\r\n\r\n")) == std::string::npos) {
+            if (!fill(std::chrono::milliseconds(10000))) {
+                error = "No WebSocket handshake response";
+                return false;
+            }
+        }
+        std::string headers = buffer_.substr(0, header_end);
+        buffer_.erase(0, header_end + 4);
+        std::transform(headers.begin(), headers.end(), headers.begin(), [](unsigned char c) { return std::tolower(c); });
+        std::string accept = key + "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+        unsigned char digest[EVP_MAX_MD_SIZE];
+        unsigned int digest_size = 0;
+        EVP_Digest(accept.data(), accept.size(), digest, &digest_size, EVP_sha1(), nullptr);
+        std::string expected = base64_encode(digest, digest_size);
+        std::transform(expected.begin(), expected.end(), expected.begin(), [](unsigned char c) { return std::tolower(c); });
+        if (headers.rfind("http/1.1 101", 0) != 0 || headers.find("sec-websocket-accept: " + expected) == std::string::npos) {
+            error = "WebSocket upgrade rejected: " + headers.substr(0, headers.find("\r\n"));
+            return false;
+        }
+        open_ = true;
+        close_code_ = 0;
+        fragments_.clear();
+        return true;
+    }
+
+    bool send_text(const std::string& text) { return send_frame(0x1, text); }
+
+    // Wait up to `timeout` for a complete data message
+    Status receive(std::string& message, bool& binary, std::chrono::milliseconds timeout) {
+        auto deadline = std::chrono::steady_clock::now() + timeout;
+        for (;;) {
+            if (!open_) return Status::Closed;
+            uint8_t opcode;
+            bool fin;
+            std::string payload;
+            if (!parse_frame(opcode, fin, payload)) {
+                auto left = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now());
+                if (left.count() <= 0) return Status::Timeout;
+                if (!fill(left)) {
+                    if (!open_) return Status::Closed;
+                    if (std::chrono::steady_clock::now() >= deadline) return Status::Timeout;
+                }
+                continue;
+            }
+            switch (opcode) {
+                case 0x8: // close
+                    close_code_ = payload.size() >= 2 ? (uint8_t(payload[0]) << 8) | uint8_t(payload[1]) : 1005;
+                    send_frame(0x8, payload.substr(0, 2));
+                    open_ = false;
+                    return Status::Closed;
+                case 0x9: // ping
+                    send_frame(0xA, payload);
+                    continue;
+                case 0xA: // pong
+                    continue;
+                case 0x0: // continuation
+                    fragments_ += payload;
+                    break;
+                default:
+                    fragment_opcode_ = opcode;
+                    fragments_ = std::move(payload);
+                    break;
+            }
+            if (!fin) continue;
+            message = std::move(fragments_);
+            fragments_.clear();
+            binary = fragment_opcode_ == 0x2;
+            return Status::Message;
+        }
+    }
+
+    void close(uint16_t code) {
+        if (!open_) return;
+        std::string payload{char(code >> 8), char(code & 0xff)};
+        send_frame(0x8, payload);
+        open_ = false;
+        close_code_ = code;
+    }
+
+    uint16_t close_code() const { return close_code_; }
+
+private:
+    static std::string base64_encode(const unsigned char* data, size_t size) {
+        std::string out(4 * ((size + 2) / 3), '\0');
+        EVP_EncodeBlock(reinterpret_cast<unsigned char*>(&out[0]), data, static_cast<int>(size));
+        return out;
+    }
+
+    // Client frames are always masked
+    bool send_frame(uint8_t opcode, const std::string& payload) {
+        std::string frame;
+        frame += char(0x80 | opcode);
+        if (payload.size() < 126) {
+            frame += char(0x80 | payload.size());
+        } else if (payload.size() <= 0xffff) {
+            frame += char(0x80 | 126);
+            frame += char(payload.size() >> 8);
+            frame += char(payload.size() & 0xff);
+        } else {
+            frame += char(0x80 | 127);
+            for (int shift = 56; shift >= 0; shift -= 8) frame += char((uint64_t(payload.size()) >> shift) & 0xff);
+        }
+        unsigned char mask[4];
+        RAND_bytes(mask, sizeof(mask));
+        frame.append(reinterpret_cast<char*>(mask), sizeof(mask));
+        for (size_t i = 0; i < payload.size(); ++i) frame += char(payload[i] ^ mask[i % 4]);
+        return send_raw(frame.data(), frame.size());
+    }
+
+    // Take one complete frame from the buffer, if there is one
+    bool parse_frame(uint8_t& opcode, bool& fin, std::string& payload) {
+        if (buffer_.size() < 2) return false;
+        const auto* bytes = reinterpret_cast<const unsigned char*>(buffer_.data());
+        fin = bytes[0] & 0x80;
+        opcode = bytes[0] & 0x0f;
+        bool masked = bytes[1] & 0x80;
+        uint64_t length = bytes[1] & 0x7f;
+        size_t offset = 2;
+        if (length == 126) {
+            if (buffer_.size() < 4) return false;
+            length = (uint64_t(bytes[2]) << 8) | bytes[3];
+            offset = 4;
+        } else if (length == 127) {
+            if (buffer_.size() < 10) return false;
+            length = 0;
+            for (int i = 0; i < 8; ++i) length = (length << 8) | bytes[2 + i];
+            offset = 10;
+        }
+        size_t mask_offset = offset;
+        if (masked) offset += 4;
+        if (buffer_.size() < offset + length) return false;
+        payload = buffer_.substr(offset, length);
+        if (masked) {
+            for (size_t i = 0; i < payload.size(); ++i) payload[i] ^= buffer_[mask_offset + i % 4];
+        }
+        buffer_.erase(0, offset + length);
+        return true;
+    }
+
+    bool send_raw(const char* data, size_t size) {
+        while (size > 0) {
+            size_t sent = 0;
+            CURLcode res = curl_easy_send(curl_.get(), data, size, &sent);
+            if (res == CURLE_AGAIN) {
+                pollfd pfd{static_cast<int>(socket_), POLLOUT, 0};
+                poll(&pfd, 1, 1000);
+                continue;
+            }
+            if (res != CURLE_OK) {
+                open_ = false;
+                return false;
+            }
+            data += sent;
+            size -= sent;
+        }
+        return true;
+    }
+
+    // Read whatever is available into the buffer, waiting up to `timeout`
+    bool fill(std::chrono::milliseconds timeout) {
+        char chunk[16384];
+        for (int round = 0; round < 2; ++round) {
+            size_t received = 0;
+            CURLcode res = curl_easy_recv(curl_.get(), chunk, sizeof(chunk), &received);
+            if (res == CURLE_OK) {
+                if (received == 0) {
+                    open_ = false; // 接続が切れた
+                    return false;
+                }
+                buffer_.append(chunk, received);
+                return true;
+            }
+            if (res != CURLE_AGAIN) {
+                open_ = false;
+                return false;
+            }
+            if (round == 0) {
+                pollfd pfd{static_cast<int>(socket_), POLLIN, 0};
+                if (poll(&pfd, 1, static_cast<int>(timeout.count())) <= 0) return false;
+            }
+        }
+        return false;
+    }
+
+    CurlHandle curl_;
+    curl_socket_t socket_ = CURL_SOCKET_BAD;
+    std::string buffer_;
+    std::string fragments_;
+    uint8_t fragment_opcode_ = 0x1;
+    uint16_t close_code_ = 0;
+    bool open_ = false;
+};
+
+// Decoder for the Gateway's zlib-stream transport compression: one inflate context
+// spans the whole connection, and a payload is complete once it ends in 00 00 ff ff
+class ZlibStream {
+public:
+    ZlibStream() { inflateInit(&stream_); }
+    ~ZlibStream() { inflateEnd(&stream_); }
+
+    ZlibStream(const ZlibStream&) = delete;
+    ZlibStream& operator=(const ZlibStream&) = delete;
+
+    void reset() {
+        inflateReset(&stream_);
+        pending_.clear();
+    }
+
+    // Feed one WebSocket message; returns true with `out` set once a payload is complete
+    bool feed(const std::string& data, std::string& out) {
+        pending_ += data;
+        static const char SUFFIX[] = {'\x00', '\x00', '\xff', '\xff'};
+        if (pending_.size() < 4 || pending_.compare(pending_.size() - 4, 4, SUFFIX, 4) != 0) return false;
+
+        out.clear();
+        stream_.next_in = reinterpret_cast<Bytef*>(&pending_[0]);
+        stream_.avail_in = static_cast<uInt>(pending_.size());
+        char chunk[16384];
+        do {
+            stream_.next_out = reinterpret_cast<Bytef*>(chunk);
+            stream_.avail_out = sizeof(chunk);
+            int res = inflate(&stream_, Z_SYNC_FLUSH);
+            if (res != Z_OK && res != Z_BUF_ERROR) {
+                pending_.clear();
+                throw std::runtime_error("Gateway zlib-stream error");
+            }
+            out.append(chunk, sizeof(chunk) - stream_.avail_out);
+        } while (stream_.avail_out == 0);
+        pending_.clear();
+        return true;
+    }
+
+private:
+    z_stream stream_{};
+    std::string pending_;
+};
+
+// Gateway intents: GUILD_MESSAGES | DIRECT_MESSAGES | MESSAGE_CONTENT
+const long GATEWAY_INTENTS = (1 << 9) | (1 << 12) | (1 << 15);
+const std::string GATEWAY_QUERY = "?v=10&encoding=json&compress=zlib-stream";
+
+// Gateway URL: DCLI_GATEWAY_URL if set (e.g. a local stand-in server), else asked from the API
+std::string get_gateway_url(ConnectionManager& conn) {
+    if (const char* url = getenv("DCLI_GATEWAY_URL")) return url;
+    HttpResponse response = conn.get(API_BASE + "/gateway");
+    if (response.ok()) {
+        try {
+            return json::parse(response.body).at("url").get<std::string>();
+        } catch (const std::exception&) {}
+    }
+    return "wss://gateway.discord.gg";
+}
+
+// Receives MESSAGE_CREATE events over the Discord Gateway and prints the ones for
+// configured channels. Handles heartbeats, reconnects and session resume.
+class GatewayClient {
+public:
+    GatewayClient(const std::string& token, const std::map<std::string, std::string>& channels, const std::string& url)
+        : token_(token.rfind("Bot ", 0) == 0 ? token.substr(4) : token), url_(url) {
+        for (const auto& [name, id] : channels) channel_names_[id] = name;
+    }
+
+    // Stay connected until `stop` is set
+    void run(const std::atomic<bool>& stop) {
+        int failures = 0;
+        while (!stop) {
+            std::string error;
+            bool retry = true;
+            try {
+                retry = session(stop, error);
+            } catch (const std::exception& e) {
+                error = e.what();
+                session_id_.clear(); // 圧縮ストリームが壊れたら新しいセッションで
+                seq_ = -1;
+            }
+            if (!error.empty()) std::cerr << "\nGateway: " << error << std::endl;
+            if (!retry) return;
+            if (stop) return;
+            // 失敗が続く場合は間隔を広げて再接続
+            failures = error.empty() ? 0 : failures + 1;
+            auto wait = std::chrono::milliseconds(failures == 0 ? 250 : std::min(30000, 1000 << std::min(failures, 5)));
+            for (auto until = std::chrono::steady_clock::now() + wait; !stop && std::chrono::steady_clock::now() < until;) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(100));
+            }
+        }
+    }
+
+private:
+    using Clock = std::chrono::steady_clock;
+
+    // One connection; returns whether to reconnect
+    bool session(const std::atomic<bool>& stop, std::string& error) {
+        WebSocket ws;
+        ZlibStream zlib;
+        std::string base = resume_url_.empty() || session_id_.empty() ? url_ : resume_url_;
+        if (!ws.connect(base + GATEWAY_QUERY, error)) return true;
+
+        std::chrono::milliseconds interval{0};
+        Clock::time_point next_heartbeat = Clock::time_point::max();
+        bool awaiting_ack = false;
+
+        while (!stop) {
+            auto now = Clock::now();
+            if (now >= next_heartbeat) {
+                if (awaiting_ack) {
+                    // 応答のない接続は閉じて再開する
+                    ws.close(4000);
+                    error = "heartbeat not acknowledged, reconnecting";
+                    return true;
+                }
+                send(ws, 1, seq_ < 0 ? json(nullptr) : json(seq_));
+                awaiting_ack = true;
+                next_heartbeat = now + interval;
+            }
+            auto timeout = std::chrono::milliseconds(250);
+            if (next_heartbeat != Clock::time_point::max()) {
+                timeout = std::min(timeout, std::chrono::duration_cast<std::chrono::milliseconds>(next_heartbeat - now));
+            }
+
+            std::string data, text;
+            bool binary = false;
+            auto status = ws.receive(data, binary, std::max(timeout, std::chrono::milliseconds(1)));
+            if (status == WebSocket::Status::Closed) return handle_close(ws.close_code(), error);
+            if (status == WebSocket::Status::Timeout) continue;
+            if (binary) {
+                if (!zlib.feed(data, text)) continue;
+            } else {
+                text = std::move(data);
+            }
+
+            json payload;
+            try {
+                payload = json::parse(text);
+            } catch (const json::parse_error& e) {
+                error = std::string("invalid payload: ") + e.what();
+                continue;
+            }
+            if (payload.contains("s") && payload["s"].is_number()) seq_ = payload["s"].get<long>();
+
+            switch (payload.value("op", -1)) {
+                case 10: { // Hello
+                    interval = std::chrono::milliseconds(payload["d"]["heartbeat_interval"].get<long>());
+                    std::uniform_real_distribution<double> jitter(0.0, 1.0);
+                    next_heartbeat = Clock::now() + std::chrono::milliseconds(static_cast<long>(interval.count() * jitter(rng_)));
+                    if (!session_id_.empty() && seq_ >= 0) {
+                        send(ws, 6, {{"token", token_}, {"session_id", session_id_}, {"seq", seq_}});
+                    } else {
+                        send(ws, 2, {{"token", token_},
+                                     {"intents", GATEWAY_INTENTS},
+                                     {"properties", {{"os", "linux"}, {"browser", "dcli"}, {"device", "dcli"}}}});
+                    }
+                    break;
+                }
+                case 11: // Heartbeat ACK
+                    awaiting_ack = false;
+                    break;
+                case 1: // Heartbeat request
+                    send(ws, 1, seq_ < 0 ? json(nullptr) : json(seq_));
+                    break;
+                case 7: // Reconnect
+                    ws.close(4000);
+                    return true;
+                case 9: // Invalid Session
+                    if (!payload.value("d", false)) {
+                        session_id_.clear();
+                        seq_ = -1;
+                    }
+                    std::this_thread::sleep_for(std::chrono::milliseconds(1000 + rng_() % 4000));
+                    ws.close(4000);
+                    return true;
+                case 0:
+                    dispatch(payload.value("t", ""), payload["d"]);
+                    break;
+            }
+        }
+        ws.close(1000);
+        return false;
+    }
+
+    void dispatch(const std::string& type, const json& data) {
+        if (type == "READY") {
+            session_id_ = data.value("session_id", "");
+            resume_url_ = data.value("resume_gateway_url", "");
+        } else if (type == "MESSAGE_CREATE") {
+            auto it = channel_names_.find(data.value("channel_id", ""));
+            if (it == channel_names_.end()) return;
+            uint64_t id = parse_snowflake(data.value("id", "0"));
+            std::string author = data.contains("author") ? data["author"].value("username", "") : "";
+            std::cout << "\r[" << format_snowflake_time(id) << "] #" << it->second << " " << author << ": "
+                      << data.value("content", "") << "\n> " << std::flush;
+        }
+    }
+
+    // Closed by the server: resume unless the close code says it cannot work
+    bool handle_close(uint16_t code, std::string& error) {
+        switch (code) {
+            case 4004: case 4010: case 4011: case 4012: case 4013: case 4014:
+                error = "connection closed (" + std::to_string(code) + "), not reconnecting";
+                return false; // 認証失敗・intents 不正などは再接続しても直らない
+            case 4007: case 4009:
+                session_id_.clear();
+                seq_ = -1;
+                break;
+        }
+        return true;
+    }
+
+    void send(WebSocket& ws, int op, const json& data) {
+        ws.send_text(json{{"op", op}, {"d", data}}.dump());
+    }
+
+    std::string token_;
+    std::string url_;
+    std::map<std::string, std::string> channel_names_; // id -> name
+    std::string session_id_;
+    std::string resume_url_;
+    long seq_ = -1;
+    std::mt19937 rng_{std::random_device{}()};
+};
+
+// Parse one batch input line: an NDJSON object {"content": ..., "channel": ...}, or
+// plain text. A line that only looks like JSON ("{foo} started", a JSON log record
+// without a string "content") is sent as it is.
+bool parse_batch_line(const std::string& line, const std::map<std::string, std::string>& channels,
+                      const std::string& default_channel, std::string& channel_id, std::string& content, std::string& error) {
+    channel_id = default_channel;
+    content = line;
+    if (line.empty() || line[0] != '{') return true;
+    json object = json::parse(line, nullptr, false);
+    if (object.is_discarded() || !object.is_object()) return true;
+    auto field = object.find("content");
+    if (field == object.end() || !field->is_string()) return true;
+    content = field->get<std::string>();
+    auto channel = object.find("channel");
+    if (channel != object.end()) {
+        std::string name = channel->is_string() ? channel->get<std::string>() : channel->dump();
+        channel_id = resolve_channel(channels, name);
+        if (channel_id.empty()) {
+            error = "Unknown channel: " + name;
+            return false;
+        }
+    }
+    if (content.empty()) {
+        error = "Cannot send an empty message.";
+        return false;
+    }
+    return true;
+}
+
+// デーモンのソケットパス
+std::string get_socket_path() {
+    return get_config_dir() + "dcli.sock";
+}
+
+// Channel ID shared by every queued message for that channel, so queuing one
+// doesn't copy it
+using ChannelId = std::shared_ptr<const std::string>;
+
+// A message waiting to be sent
+struct OutgoingMessage {
+    ChannelId channel_id;
+    std::string content;
+    int attempts = 0;
+    uint64_t outbox_id = 0;
+    uint64_t nonce = 0; // 送信ごとに一意 (outbox に保存され、再送でも同じ値を使う)
+    std::chrono::steady_clock::time_point not_before{};
+    int identity = -1; // 失敗した送信は同じ ID で再送する (-1: 未定)
+};
+
+// Bounded lock-free single-producer/single-consumer ring buffer
+template <typename T>
+class SpscQueue {
+public:
+    explicit SpscQueue(size_t capacity) {
+        size_t size = 1;
+        while (size < capacity) size <<= 1;
+        slots_.resize(size);
+        mask_ = size - 1;
+    }
+
+    bool try_push(T&& value) {
+        size_t head = head_.load(std::memory_order_relaxed);
+        if (head - tail_.load(std::memory_order_acquire) > mask_) return false;
+        slots_[head & mask_] = std::move(value);
+        head_.store(head + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool try_pop(T& value) {
+        size_t tail = tail_.load(std::memory_order_relaxed);
+        if (tail == head_.load(std::memory_order_acquire)) return false;
+        value = std::move(slots_[tail & mask_]);
+        tail_.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool empty() const {
+        return tail_.load(std::memory_order_acquire) == head_.load(std::memory_order_acquire);
+    }
+
+private:
+    std::vector<T> slots_;
+    size_t mask_ = 0;
+    alignas(64) std::atomic<size_t> head_{0};
+    alignas(64) std::atomic<size_t> tail_{0};
+};
+
+// 送信待ちメッセージの永続キュー (outbox) のパス
+std::string get_outbox_path() {
+    return get_config_dir() + "outbox.log";
+}
+
+// Write-ahead outbox: every message is journaled before it is sent and marked done
+// after a 2xx, so nothing is lost if dcli exits or crashes mid-send. Records are
+// NDJSON lines appended to one file; writes are buffered and committed with a single
+// fdatasync per batch. Only the send worker touches it once it is open.
+// Ownership is an flock on <path>.lock, since compaction replaces the journal file.
+class Outbox {
+public:
+    ~Outbox() {
+        if (fd_ >= 0) {
+            commit();
+            close(fd_);
+        }
+        if (lock_fd_ >= 0) close(lock_fd_);
+    }
+
+    // Lock and open the outbox, returning the messages a previous run left unsent.
+    // Fails if another dcli process holds the lock.
+    bool open(const std::string& path, std::vector<OutgoingMessage>& pending) {
+        mkdir(get_config_dir().c_str(), 0700);
+        lock_fd_ = ::open((path + ".lock").c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+        if (lock_fd_ < 0) return false;
+        if (flock(lock_fd_, LOCK_EX | LOCK_NB) < 0) {
+            close(lock_fd_);
+            lock_fd_ = -1;
+            return false;
+        }
+
+        std::map<uint64_t, OutgoingMessage> unsent;
+        std::ifstream file(path);
+        std::string line;
+        while (std::getline(file, line)) {
+            try {
+                auto record = json::parse(line);
+                uint64_t id = record.at("id").get<uint64_t>();
+                next_id_ = std::max(next_id_, id + 1);
+                if (record.at("op") == "add") {
+                    OutgoingMessage message;
+                    message.channel_id = std::make_shared<const std::string>(record.at("channel").get<std::string>());
+                    message.content = record.at("content").get<std::string>();
+                    message.outbox_id = id;
+                    message.nonce = record.value("nonce", 0ULL);
+                    unsent[id] = std::move(message);
+                } else {
+                    unsent.erase(id);
+                }
+            } catch (const std::exception&) {
+                // 書き込み途中でクラッシュした末尾の行は無視する
+            }
+        }
+
+        // Compact: write the unsent messages to a new journal and swap it in with
+        // rename(), so a crash at any point leaves either the old or the new one
+        for (auto& [id, message] : unsent) {
+            write_add(message);
+            pending.push_back(message);
+        }
+        live_ = unsent.size();
+        std::string tmp = path + ".tmp";
+        int fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+        if (fd < 0) return false;
+        bool written = write_buffer(fd) && fdatasync(fd) == 0;
+        close(fd);
+        if (!written || rename(tmp.c_str(), path.c_str()) != 0) return false;
+        int dir = ::open(get_config_dir().c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (dir >= 0) {
+            fsync(dir);
+            close(dir);
+        }
+        fd_ = ::open(path.c_str(), O_WRONLY | O_APPEND | O_CLOEXEC);
+        return fd_ >= 0;
+    }
+
+    // Journal a new message (assigns its outbox ID); durable after the next commit()
+    void append(OutgoingMessage& message) {
+        message.outbox_id = next_id_++;
+        write_add(message);
+        ++live_;
+    }
+
+    void mark_done(uint64_t id) {
+        buffer_.append("{\"op\":\"done\",\"id\":");
+        append_number(id);
+        buffer_.append("}\n");
+        if (live_ > 0) --live_;
+    }
+
+    // Write buffered records and fdatasync them
+    void commit() {
+        if (buffer_.empty()) return;
+        // 全て送信済みなら journal を空にする
+        if (live_ == 0) {
+            buffer_.clear();
+            if (ftruncate(fd_, 0) == 0) fdatasync(fd_);
+            return;
+        }
+        write_buffer(fd_);
+        fdatasync(fd_);
+    }
+
+private:
+    // Write out and clear buffer_
+    bool write_buffer(int fd) {
+        size_t written = 0;
+        while (written < buffer_.size()) {
+            ssize_t n = write(fd, buffer_.data() + written, buffer_.size() - written);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) {
+                std::cerr << "Outbox write failed: " << std::strerror(errno) << std::endl;
+                buffer_.clear();
+                return false;
+            }
+            written += n;
+        }
+        buffer_.clear();
+        return true;
+    }
+
+    // {"op":"add","id":N,"nonce":N,"channel":"...","content":"..."} written straight into the buffer
+    void write_add(const OutgoingMessage& message) {
+        buffer_.append("{\"op\":\"add\",\"id\":");
+        append_number(message.outbox_id);
+        buffer_.append(",\"nonce\":");
+        append_number(message.nonce);
+        buffer_.append(",\"channel\":\"");
+        json_escape::append_escaped(buffer_, *message.channel_id);
+        buffer_.append("\",\"content\":\"");
+        json_escape::append_escaped(buffer_, message.content);
+        buffer_.append("\"}\n");
+    }
+
+    void append_number(uint64_t value) {
+        char digits[20];
+        auto result = std::to_chars(digits, digits + sizeof(digits), value);
+        buffer_.append(digits, result.ptr);
+    }
+
+    int fd_ = -1;
+    int lock_fd_ = -1;
+    std::string buffer_;
+    uint64_t next_id_ = 1;
+    size_t live_ = 0;
+};
+
+// Open the outbox, collecting what a previous run left unsent into `pending`
+std::unique_ptr<Outbox> open_outbox(std::vector<OutgoingMessage>& pending) {
+    auto outbox = std::make_unique<Outbox>();
+    if (!outbox->open(get_outbox_path(), pending)) {
+        std::cerr << "Outbox is unavailable (in use by another dcli process?); messages will not be journaled.\n";
+        return nullptr;
+    }
+    if (!pending.empty()) {
+        std::cout << "Replaying " << pending.size() << " unsent message(s) from the outbox.\n";
+    }
+    return outbox;
+}
+
+const int MAX_RETRY_ATTEMPTS = 8;
+// While sends keep running, how often the outbox syncs the "done" records
+const auto OUTBOX_COMMIT_INTERVAL = std::chrono::milliseconds(200);
+
+// Jittered exponential backoff for retrying failed sends
+RateLimiter::Clock::duration retry_backoff(int attempts, std::mt19937& rng) {
+    double base = std::min(30.0, 0.5 * std::pow(2.0, attempts - 1));
+    std::uniform_real_distribution<double> jitter(0.5, 1.0);
+    return std::chrono::duration_cast<RateLimiter::Clock::duration>(std::chrono::duration<double>(base * jitter(rng)));
+}
+
+// Route used to rate limit webhook executions
+const std::string EXECUTE_WEBHOOK_ROUTE = "POST /webhooks/{webhook.id}/{webhook.token}";
+
+// Extra sender identities from the config:
+//   "tokens": ["Bot ...", ...]                    more bot tokens, used for any channel
+//   "webhooks": {"<channel name or ID>": ["https://discord.com/api/webhooks/ID/TOKEN", ...]}
+struct IdentityConfig {
+    std::vector<std::string> tokens;
+    std::vector<std::pair<std::string, std::string>> webhooks; // (channel ID, URL)
+};
+
+IdentityConfig load_identity_config(const std::map<std::string, std::string>& channels) {
+    IdentityConfig identities;
+    std::ifstream file(get_config_path());
+    if (!file) return identities;
+    json config = json::parse(file, nullptr, false);
+    if (!config.is_object()) return identities;
+
+    if (config.contains("tokens") && config["tokens"].is_array()) {
+        for (const auto& token : config["tokens"]) {
+            if (token.is_string() && !token.get<std::string>().empty()) identities.tokens.push_back(token);
+        }
+    }
+    if (config.contains("webhooks") && config["webhooks"].is_object()) {
+        for (const auto& [channel, urls] : config["webhooks"].items()) {
+            std::string channel_id = resolve_channel(channels, channel);
+            if (channel_id.empty()) {
+                std::cerr << "Ignoring webhooks for unknown channel: " << channel << std::endl;
+                continue;
+            }
+            for (const auto& url : urls.is_array() ? urls : json::array({urls})) {
+                if (url.is_string()) identities.webhooks.emplace_back(channel_id, url.get<std::string>());
+            }
+        }
+    }
+    return identities;
+}
+
+// One way of posting messages: a bot token (any channel) or a webhook (its own
+// channel only). Each has its own rate limit buckets.
+struct Identity {
+    std::string label;      // "token 2", "webhook 1" (/stats と集計表示用)
+    std::string channel_id; // webhook の送信先; bot なら空
+    std::string url;        // webhook の URL (?wait=true 付き)
+    std::string major;      // webhook ID
+    CurlSlist headers;
+    RateLimiter* limiter;
+    std::unique_ptr<RateLimiter> own_limiter;
+    std::atomic<size_t> sent{0};
+
+    bool can_send(const std::string& channel) const { return channel_id.empty() || channel_id == channel; }
+    const std::string& route() const { return url.empty() ? CREATE_MESSAGE_ROUTE : EXECUTE_WEBHOOK_ROUTE; }
+    const std::string& major_for(const std::string& channel) const { return url.empty() ? channel : major; }
+};
+
+// The bot tokens and webhooks messages can be sent as. The first identity is
+// the main token, sharing `limiter` with the rest of dcli; the others get their
+// own limiters. pick() returns whichever identity can post to a channel soonest,
+// so a busy channel gets the combined rate limit of all of them.
+// Handles come from `conn`, so every identity shares its connections.
+class IdentityPool {
+public:
+    IdentityPool(ConnectionManager& conn, RateLimiter& limiter, const std::string& token, const IdentityConfig& config) : conn_(conn) {
+        Metrics* metrics = limiter.metrics();
+        auto add = [&](std::string label, CurlSlist headers) -> Identity& {
+            auto identity = std::make_unique<Identity>();
+            identity->label = std::move(label);
+            identity->headers = std::move(headers);
+            identities_.push_back(std::move(identity));
+            return *identities_.back();
+        };
+
+        add("token 1", make_headers(token)).limiter = &limiter;
+        for (const auto& extra : config.tokens) {
+            if (extra == token) continue;
+            Identity& identity = add("token " + std::to_string(++tokens_ + 1), make_headers(extra));
+            identity.own_limiter = std::make_unique<RateLimiter>(metrics, identity.label);
+            identity.limiter = identity.own_limiter.get();
+        }
+        for (const auto& [channel_id, url] : config.webhooks) {
+            // .../webhooks/{id}/{token}
+            size_t at = url.find("/webhooks/");
+            if (at == std::string::npos) {
+                std::cerr << "Ignoring invalid webhook URL for channel " << channel_id << std::endl;
+                continue;
+            }
+            CurlSlist headers;
+            headers.reset(curl_slist_append(nullptr, "Content-Type: application/json"));
+            Identity& identity = add("webhook " + std::to_string(++webhooks_), std::move(headers));
+            identity.channel_id = channel_id;
+            identity.major = url.substr(at + 10, url.find('/', at + 10) - (at + 10));
+            identity.url = url + (url.find('?') == std::string::npos ? "?wait=true" : "&wait=true");
+            identity.own_limiter = std::make_unique<RateLimiter>(metrics, identity.label);
+            identity.limiter = identity.own_limiter.get();
+        }
+    }
+
+    size_t size() const { return identities_.size(); }
+    Metrics* metrics() const { return identities_.front()->limiter->metrics(); }
+
+    // Index of the identity that can post to `channel_id` soonest and how long
+    // until it can (zero = now). Ties go round-robin so the load is spread.
+    int pick(const std::string& channel_id, RateLimiter::Clock::duration& wait) {
+        int best = -1;
+        wait = RateLimiter::Clock::duration::max();
+        for (size_t n = 0; n < identities_.size(); ++n) {
+            size_t i = (next_ + n) % identities_.size();
+            Identity& identity = *identities_[i];
+            if (!identity.can_send(channel_id)) continue;
+            auto delay = identity.limiter->delay(identity.route(), identity.major_for(channel_id));
+            if (delay < wait) {
+                wait = delay;
+                best = static_cast<int>(i);
+                if (delay <= RateLimiter::Clock::duration::zero()) break;
+            }
+        }
+        next_ = (best + 1) % identities_.size();
+        return best;
+    }
+
+    // How long until identity `index` can post to `channel_id`
+    RateLimiter::Clock::duration delay(int index, const std::string& channel_id) {
+        Identity& identity = *identities_[index];
+        return identity.limiter->delay(identity.route(), identity.major_for(channel_id));
+    }
+
+    // A handle for the SendWorker thread; prepare() sets the identity's headers on it per message
+    CurlHandle new_handle() { return conn_.new_thread_handle(); }
+
+    // Take a rate limit token for identity `index` and set `curl` up to post one
+    // message (one attempt) into buffers.response. False if no token is free yet.
+    bool prepare(int index, CURL* curl, const std::string& channel_id, std::string_view content, SendBuffers& buffers, uint64_t nonce) {
+        Identity& identity = *identities_[index];
+        if (identity.limiter->reserve(identity.route(), identity.major_for(channel_id)) > RateLimiter::Clock::duration::zero()) {
+            return false;
+        }
+        // webhook は nonce を受け付けない
+        build_message_payload(buffers.payload, content, identity.url.empty() ? nonce : 0);
+        if (identity.url.empty()) {
+            messages_url(buffers.url, channel_id);
+        } else {
+            buffers.url.assign(identity.url);
+        }
+        buffers.response.reset();
+        curl_easy_setopt(curl, CURLOPT_HTTPHEADER, identity.headers.get());
+        curl_easy_setopt(curl, CURLOPT_URL, buffers.url.c_str());
+        curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE, static_cast<long>(buffers.payload.size()));
+        curl_easy_setopt(curl, CURLOPT_POSTFIELDS, buffers.payload.c_str());
+        curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, WriteCallback);
+        curl_easy_setopt(curl, CURLOPT_WRITEDATA, &buffers.response.body);
+        curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, HeaderCallback);
+        curl_easy_setopt(curl, CURLOPT_HEADERDATA, &buffers.response);
+        return true;
+    }
+
+    // Feed the response of a prepare()d send back to the identity's rate limiter
+    void finish(int index, const std::string& channel_id, const HttpResponse& response) {
+        Identity& identity = *identities_[index];
+        identity.limiter->update(identity.route(), identity.major_for(channel_id), response);
+        if (response.ok()) ++identity.sent;
+    }
+
+    // "token 1: 120, webhook 1: 118"
+    std::string usage() const {
+        std::string text;
+        for (const auto& identity : identities_) {
+            if (!text.empty()) text += ", ";
+            text += identity->label + ": " + std::to_string(identity->sent.load());
+        }
+        return text;
+    }
+
+    std::string describe() const {
+        return std::to_string(identities_.size()) + " identities (" + std::to_string(tokens_ + 1) + " bot token(s), " +
+               std::to_string(webhooks_) + " webhook(s))";
+    }
+
+private:
+    ConnectionManager& conn_;
+    std::vector<std::unique_ptr<Identity>> identities_;
+    size_t tokens_ = 0, webhooks_ = 0;
+    size_t next_ = 0;
+};
+
+// Background sender. Messages are handed over through a lock-free queue, so the
+// submitting thread never waits on the network; the worker keeps one FIFO per
+// channel, which preserves per-channel order without letting a rate-limited
+// channel hold up the others. With an outbox, each drained batch is journaled
+// (one fdatasync) before any of it is sent, and failed or 429/5xx sends are
+// retried with backoff. Each send goes out as whichever identity of the pool can
+// post to the channel soonest. Sends run on a curl_multi event loop with one
+// request in flight per channel, so channels proceed concurrently (up to the rate
+// limit) while each channel's order holds across identities.
+class SendWorker {
+public:
+    using Callback = std::function<void(const OutgoingMessage&, const HttpResponse&)>;
+
+    SendWorker(IdentityPool& identities, Outbox* outbox, Callback on_result)
+        : identities_(identities), outbox_(outbox), on_result_(std::move(on_result)), multi_(curl_multi_init()) {
+        if (!multi_) throw std::runtime_error("Failed to initialize curl");
+        curl_multi_setopt(multi_.get(), CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+        thread_ = std::thread([this] { run(); });
+    }
+
+    ~SendWorker() {
+        stop();
+        // 破棄順序: ハンドルを multi から外してから解放する
+        for (auto& [channel_id, channel] : channels_) {
+            if (channel.in_flight) curl_multi_remove_handle(multi_.get(), channel.curl.get());
+        }
+    }
+
+    // Hand a message to the worker (single producer thread only)
+    void submit(OutgoingMessage message) {
+        submitted_.fetch_add(1);
+        while (!ring_.try_push(std::move(message))) {
+            std::this_thread::yield();
+        }
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (sleeping_.load()) curl_multi_wakeup(multi_.get());
+    }
+
+    // Deliver everything still queued, then stop the worker. Messages that are
+    // backing off after a failure are left in the outbox for the next run.
+    void stop() {
+        if (!thread_.joinable()) return;
+        stopping_.store(true);
+        curl_multi_wakeup(multi_.get());
+        thread_.join();
+    }
+
+    size_t pending() const { return submitted_.load() - sent_.load() - failed_.load(); }
+    size_t sent() const { return sent_.load(); }
+    size_t failed() const { return failed_.load(); }
+
+    // Snapshot of the messages not yet delivered, in send order per channel
+    std::vector<OutgoingMessage> pending_messages() {
+        std::lock_guard<std::mutex> lock(state_mutex_);
+        std::vector<OutgoingMessage> result;
+        for (const auto& [channel_id, channel] : channels_) {
+            result.insert(result.end(), channel.queue.begin(), channel.queue.end());
+        }
+        return result;
+    }
+
+private:
+    // A channel's queue and the handle and buffers its sends reuse
+    struct Channel {
+        std::string id;
+        std::deque<OutgoingMessage> queue; // 先頭が送信中のメッセージ
+        CurlHandle curl;
+        SendBuffers buffers;
+        int identity = -1; // 送信中の identity
+        bool in_flight = false;
+    };
+
+    void run() {
+        for (;;) {
+            bool backing_off = false;
+            auto next_wake = RateLimiter::Clock::duration::max();
+
+            incoming_.clear();
+            OutgoingMessage item;
+            while (ring_.try_pop(item)) {
+                incoming_.push_back(std::move(item));
+            }
+            if (!incoming_.empty()) {
+                // outbox の ID は journal が空になると 1 に戻るので、nonce は別に乱数で振る
+                for (auto& item : incoming_) {
+                    while (item.nonce == 0) item.nonce = nonce_rng_();
+                }
+                // 送信前にまとめて journal へ書き込む
+                if (outbox_) {
+                    for (auto& item : incoming_) {
+                        if (item.outbox_id == 0) outbox_->append(item);
+                    }
+                    outbox_->commit();
+                }
+                std::lock_guard<std::mutex> lock(state_mutex_);
+                for (auto& item : incoming_) {
+                    auto it = channels_.find(*item.channel_id);
+                    if (it == channels_.end()) {
+                        it = channels_.emplace(*item.channel_id, Channel()).first;
+                        it->second.id = *item.channel_id;
+                        it->second.curl = identities_.new_handle();
+                        curl_easy_setopt(it->second.curl.get(), CURLOPT_PRIVATE, &it->second);
+                    }
+                    it->second.queue.push_back(std::move(item));
+                }
+            }
+
+            // 送信中でないチャンネルの先頭を送り始める
+            // (空になったチャンネルも残しておき、ハンドルを作り直さない)
+            ready_.clear();
+            {
+                std::lock_guard<std::mutex> lock(state_mutex_);
+                for (auto& [channel_id, channel] : channels_) {
+                    if (!channel.queue.empty() && !channel.in_flight) ready_.push_back(&channel);
+                }
+            }
+            for (Channel* channel : ready_) {
+                // キューを変更するのはこのスレッドだけなので、先頭は参照のままで良い
+                OutgoingMessage* front;
+                {
+                    std::lock_guard<std::mutex> lock(state_mutex_);
+                    front = &channel->queue.front();
+                }
+                OutgoingMessage& message = *front;
+                const std::string& channel_id = channel->id;
+                auto now = RateLimiter::Clock::now();
+                if (message.not_before > now) {
+                    backing_off = true;
+                    next_wake = std::min(next_wake, message.not_before - now);
+                    continue;
+                }
+                // 一度失敗したメッセージは nonce で重複を防げるよう同じ ID で再送する
+                RateLimiter::Clock::duration wait;
+                int identity = message.identity;
+                if (identity >= 0) {
+                    wait = identities_.delay(identity, channel_id);
+                } else {
+                    identity = identities_.pick(channel_id, wait);
+                }
+                if (wait > RateLimiter::Clock::duration::zero() ||
+                    !identities_.prepare(identity, channel->curl.get(), channel_id, message.content, channel->buffers, message.nonce)) {
+                    if (!limited_since_.count(channel_id)) limited_since_.emplace(channel_id, now);
+                    next_wake = std::min(next_wake, std::max(wait, RateLimiter::Clock::duration(std::chrono::milliseconds(1))));
+                    continue;
+                }
+                auto limited = limited_since_.find(channel_id);
+                if (limited != limited_since_.end()) {
+                    if (identities_.metrics()) identities_.metrics()->record_wait(CREATE_MESSAGE_ROUTE, now - limited->second);
+                    limited_since_.erase(limited);
+                }
+                channel->identity = identity;
+                channel->in_flight = true;
+                ++in_flight_;
+                curl_multi_add_handle(multi_.get(), channel->curl.get());
+            }
+
+            int running = 0;
+            bool completed = false;
+            if (in_flight_ > 0) {
+                curl_multi_perform(multi_.get(), &running);
+                completed = collect();
+            }
+            // 送信が途切れなくても done を溜め込まず、一定間隔で同期する (クラッシュ時の再送を減らす)
+            auto now = RateLimiter::Clock::now();
+            if (outbox_ && ((!completed && in_flight_ == 0) || now - last_commit_ >= OUTBOX_COMMIT_INTERVAL)) {
+                outbox_->commit();
+                last_commit_ = now;
+            }
+            if (completed) continue;
+
+            bool drained = ring_.empty() && pending() == 0;
+            if (stopping_.load() && ring_.empty() && in_flight_ == 0 && (drained || (outbox_ && backing_off))) return;
+
+            // 応答・新しいメッセージ (curl_multi_wakeup)・次に送れる時刻のどれかまで待つ
+            sleeping_.store(true);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (ring_.empty()) {
+                auto timeout = std::chrono::ceil<std::chrono::milliseconds>(std::min(next_wake, RateLimiter::Clock::duration(std::chrono::seconds(1))));
+                curl_multi_poll(multi_.get(), nullptr, 0, static_cast<int>(timeout.count()), nullptr);
+            }
+            sleeping_.store(false);
+        }
+    }
+
+    // Handle the sends that finished; true if there were any
+    bool collect() {
+        bool any = false;
+        int queued = 0;
+        while (CURLMsg* msg = curl_multi_info_read(multi_.get(), &queued)) {
+            if (msg->msg != CURLMSG_DONE) continue;
+            any = true;
+            Channel* channel = nullptr;
+            curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, &channel);
+            HttpResponse& response = channel->buffers.response;
+            response.result = msg->data.result;
+            read_transfer_info(msg->easy_handle, response);
+            curl_multi_remove_handle(multi_.get(), msg->easy_handle);
+            channel->in_flight = false;
+            --in_flight_;
+            int identity = channel->identity;
+            identities_.finish(identity, channel->id, response);
+
+            bool retryable = response.result != CURLE_OK || response.status == 429 || response.status >= 500;
+            std::unique_lock<std::mutex> lock(state_mutex_);
+            OutgoingMessage& message = channel->queue.front();
+            ++message.attempts;
+            if (!response.ok() && retryable && message.attempts < MAX_RETRY_ATTEMPTS) {
+                // 429 は届いていないので別の ID で送って良い
+                if (response.status != 429) {
+                    message.not_before = RateLimiter::Clock::now() + retry_backoff(message.attempts, rng_);
+                    message.identity = identity;
+                }
+                continue;
+            }
+            OutgoingMessage done = std::move(message);
+            channel->queue.pop_front();
+            lock.unlock();
+            // 再送しても成功しないものは outbox から外す
+            if (outbox_ && done.outbox_id && (response.ok() || !retryable)) outbox_->mark_done(done.outbox_id);
+            (response.ok() ? sent_ : failed_).fetch_add(1);
+            if (on_result_) on_result_(done, response);
+        }
+        return any;
+    }
+
+    IdentityPool& identities_;
+    Outbox* outbox_;
+    Callback on_result_;
+    SpscQueue<OutgoingMessage> ring_{1024};
+    std::mutex state_mutex_;
+    std::map<std::string, Channel> channels_;
+    // 以下はワーカースレッドのみが使う
+    CurlMulti multi_;
+    size_t in_flight_ = 0;
+    RateLimiter::Clock::time_point last_commit_{};
+    std::map<std::string, RateLimiter::Clock::time_point> limited_since_;
+    std::vector<OutgoingMessage> incoming_;
+    std::vector<Channel*> ready_;
+    std::atomic<size_t> submitted_{0}, sent_{0}, failed_{0};
+    std::atomic<bool> sleeping_{false};
+    std::atomic<bool> stopping_{false};
+    std::mt19937 rng_{std::random_device{}()};
+    std::mt19937_64 nonce_rng_{(static_cast<uint64_t>(std::random_device{}()) << 32) ^ std::random_device{}()};
+    std::thread thread_;
+};
+
+// Discord のメッセージ長の上限 (文字数)
+const size_t MESSAGE_MAX_LENGTH = 2000;
+
+// Number of characters (UTF-8 code points) in `text`
+size_t utf8_length(std::string_view text) {
+    size_t length = 0;
+    for (unsigned char c : text) {
+        if ((c & 0xc0) != 0x80) ++length;
+    }
+    return length;
+}
+
+// Byte offset just past the first `count` code points of `text`
+size_t utf8_offset(std::string_view text, size_t count) {
+    size_t offset = 0;
+    while (offset < text.size() && count > 0) {
+        ++offset;
+        while (offset < text.size() && (static_cast<unsigned char>(text[offset]) & 0xc0) == 0x80) ++offset;
+        --count;
+    }
+    return offset;
+}
+
+// Split `text` into messages of at most `limit` characters. Splits happen at line
+// breaks, then at spaces, then anywhere (never inside a UTF-8 sequence). A ``` code
+// block cut in two is closed at the end of one part and reopened in the next.
+std::vector<std::string> split_message(const std::string& text, size_t limit = MESSAGE_MAX_LENGTH) {
+    limit = std::max<size_t>(limit, 1);
+    if (utf8_length(text) <= limit) return {text};
+    const std::string CLOSE_FENCE = "\n```";
+    const size_t MAX_FENCE_LINE = 32;
+    // フェンス行・1 文字・閉じるフェンスが 1 パートに収まらないほど短い上限では
+    // コードブロックを扱わない (開き直したフェンスだけで埋まり先へ進めなくなる)
+    bool track_fences = limit > MAX_FENCE_LINE + 1 + CLOSE_FENCE.size();
+
+    std::vector<std::string> parts;
+    std::string current, fence; // fence: 開いているコードブロックの開始行 ("```cpp" など)
+    size_t current_length = 0;
+    // 開始行の後にまだ何もなければ、その開始行の current 内の位置
+    size_t opener_at = std::string::npos;
+    auto finish = [&]() {
+        if (current_length == 0) return;
+        if (opener_at != std::string::npos) {
+            // 中身のないコードブロックは閉じずに開始行ごと次のパートへ回す
+            current.resize(opener_at);
+            current_length = utf8_length(current);
+        } else if (!fence.empty()) {
+            current += CLOSE_FENCE;
+        }
+        if (current_length > 0) parts.push_back(std::move(current));
+        current.clear();
+        current_length = 0;
+        opener_at = std::string::npos;
+        if (!fence.empty()) {
+            current = fence;
+            current_length = utf8_length(fence);
+            opener_at = 0;
+        }
+    };
+    auto append = [&](std::string_view piece, size_t length) {
+        if (!current.empty()) {
+            current += '\n';
+            ++current_length;
+        }
+        current.append(piece);
+        current_length += length;
+    };
+
+    size_t start = 0;
+    while (start <= text.size()) {
+        size_t end = text.find('\n', start);
+        if (end == std::string::npos) end = text.size();
+        std::string_view line(text.data() + start, end - start);
+        start = end + 1;
+
+        // 言語名付きの短いフェンス行だけを扱う
+        bool is_fence = track_fences && line.substr(0, 3) == "```" && line.size() <= MAX_FENCE_LINE;
+        // コードブロックの中、または開始行なら閉じるための余白を残す (閉じる行自体は不要)
+        bool closes = is_fence && !fence.empty();
+        size_t reserve = (!fence.empty() || is_fence) && !closes ? CLOSE_FENCE.size() : 0;
+        size_t length = utf8_length(line);
+        if (current_length + (current.empty() ? 0 : 1) + length + reserve > limit) finish();
+
+        // 1 行だけで収まらない場合は空白か文字の境界で切る
+        while (current_length + (current.empty() ? 0 : 1) + length + reserve > limit) {
+            size_t room = limit - reserve - current_length - (current.empty() ? 0 : 1);
+            if (room == 0 || room > limit) {
+                finish();
+                continue;
+            }
+            size_t cut = utf8_offset(line, room);
+            size_t space = line.substr(0, cut).find_last_of(' ');
+            if (space != std::string_view::npos && space > cut / 2) cut = space + 1;
+            append(line.substr(0, cut), utf8_length(line.substr(0, cut)));
+            opener_at = std::string::npos;
+            finish();
+            line.remove_prefix(cut);
+            length = utf8_length(line);
+        }
+        size_t line_at = current.size();
+        append(line, length);
+        opener_at = std::string::npos;
+        if (is_fence) {
+            if (fence.empty()) {
+                fence = std::string(line);
+                opener_at = line_at;
+            } else {
+                fence.clear();
+            }
+        }
+    }
+    if (current_length > 0) {
+        parts.push_back(std::move(current));
+    }
+    return parts;
+}
+
+const auto DEFAULT_COALESCE_WINDOW = std::chrono::milliseconds(500);
+// How often a held buffer re-checks whether the sender has gone idle
+const auto COALESCE_POLL_INTERVAL = std::chrono::milliseconds(5);
+
+// Sits in front of the SendWorker. Messages over the length limit are always
+// split. With a flush window, consecutive lines for the same channel are packed
+// into one message, like Nagle's algorithm: a channel's buffer goes out when
+// the next line would not fit, when the window has passed since its first
+// line, or straight away if the sender has nothing pending.
+// add() may be called from one thread; with a window, a flush thread does the
+// submitting so SendWorker keeps a single producer.
+class Coalescer {
+public:
+    Coalescer(SendWorker& worker, std::chrono::milliseconds window, size_t limit = MESSAGE_MAX_LENGTH)
+        : worker_(worker), window_(window), limit_(limit) {
+        if (window_.count() > 0) thread_ = std::thread([this] { run(); });
+    }
+
+    ~Coalescer() { stop(); }
+
+    void add(const std::string& channel_id, std::string text) {
+        ++lines_;
+        const ChannelId& id = intern(channel_id);
+        size_t length = utf8_length(text);
+        if (window_.count() == 0) {
+            // 上限以内なら分割せずそのまま渡す
+            if (length <= limit_) {
+                submit(id, std::move(text));
+            } else {
+                for (auto& part : split_message(text, limit_)) submit(id, std::move(part));
+            }
+            return;
+        }
+        std::lock_guard<std::mutex> lock(mutex_);
+        Buffer& buffer = buffers_[id];
+        if (buffer.length > 0 && buffer.length + 1 + length > limit_) {
+            ready_.push_back({id, std::move(buffer.text)});
+            buffer = Buffer();
+        }
+        if (length > limit_) {
+            for (auto& part : split_message(text, limit_)) ready_.push_back({id, std::move(part)});
+        } else {
+            if (buffer.length == 0) buffer.first = Clock::now();
+            if (buffer.length > 0) buffer.text += '\n';
+            buffer.text += text;
+            buffer.length += length + (buffer.length > 0 ? 1 : 0);
+        }
+        wake_.notify_one();
+    }
+
+    // Send everything still buffered and stop the flush thread
+    void stop() {
+        if (!thread_.joinable()) return;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stopping_ = true;
+        }
+        wake_.notify_one();
+        thread_.join();
+    }
+
+    size_t lines() const { return lines_; }
+    size_t messages() const { return messages_; }
 
-// 設定ファイルのディレクトリとパスを取得
-std::string get_config_dir() {
-    const char* home = getenv("HOME");
-    if (!home) throw std::runtime_error("HOME environment variable not set");
-    return std::string(home) + "/.config/dcli/";
-}
+private:
+    using Clock = std::chrono::steady_clock;
 
-std::string get_config_path() {
-    return get_config_dir() + "config.json";
-}
+    struct Buffer {
+        std::string text;
+        size_t length = 0;
+        Clock::time_point first;
+    };
 
-// 設定を保存
-void save_config(const std::string& token, const std::map<std::string, std::string>& channels, const std::string& last_used_channel) {
-    try {
-        const std::string config_dir = get_config_dir();
-        mkdir(config_dir.c_str(), 0700);
+    // The shared copy of `channel_id` (only add()'s thread uses channel_ids_)
+    const ChannelId& intern(const std::string& channel_id) {
+        auto it = channel_ids_.find(channel_id);
+        if (it == channel_ids_.end()) it = channel_ids_.emplace(channel_id, std::make_shared<const std::string>(channel_id)).first;
+        return it->second;
+    }
 
-        json config;
-        config["token"] = token;
-        config["channels"] = channels;
-        config["last_used_channel"] = last_used_channel;
+    void submit(const ChannelId& channel_id, std::string text) {
+        ++messages_;
+        worker_.submit({channel_id, std::move(text)});
+    }
 
-        std::ofstream file(get_config_path());
-        if (!file) throw std::runtime_error("Cannot open config file");
+    void run() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        for (;;) {
+            auto now = Clock::now();
+            auto next = Clock::time_point::max();
+            bool idle = worker_.pending() == 0;
+            for (auto& [channel_id, buffer] : buffers_) {
+                if (buffer.length == 0) continue;
+                if (stopping_ || idle || now >= buffer.first + window_) {
+                    ready_.push_back({channel_id, std::move(buffer.text)});
+                    buffer = Buffer();
+                } else {
+                    next = std::min({next, buffer.first + window_, now + COALESCE_POLL_INTERVAL});
+                }
+            }
+            if (!ready_.empty()) {
+                auto batch = std::move(ready_);
+                ready_.clear();
+                lock.unlock();
+                for (auto& [channel_id, text] : batch) submit(channel_id, std::move(text));
+                lock.lock();
+                continue;
+            }
+            if (stopping_) return;
+            if (next == Clock::time_point::max()) {
+                wake_.wait(lock);
+            } else {
+                wake_.wait_until(lock, next);
+            }
+        }
+    }
 
-        file << config.dump(4);
+    SendWorker& worker_;
+    std::chrono::milliseconds window_;
+    size_t limit_;
+    std::atomic<size_t> lines_{0}, messages_{0};
+    std::mutex mutex_;
+    std::condition_variable wake_;
+    std::map<std::string, ChannelId> channel_ids_;
+    std::map<ChannelId, Buffer> buffers_; // interned なのでポインタで比べて良い
+    std::vector<std::pair<ChannelId, std::string>> ready_;
+    bool stopping_ = false;
+    std::thread thread_;
+};
 
-        chmod(get_config_path().c_str(), 0600);
-        std::cout << "Config saved successfully." << std::endl;
-    } catch (const std::exception& e) {
-        std::cerr << "Error saving config: " << e.what() << std::endl;
-        throw;
+// Send every message from `source` ("-" for stdin) and report throughput
+int run_batch(const std::string& token, const std::map<std::string, std::string>& channels,
+              const std::string& default_channel, const std::string& source, Metrics& metrics,
+              std::chrono::milliseconds coalesce_window) {
+    std::ifstream file;
+    if (source != "-") {
+        file.open(source);
+        if (!file) {
+            std::cerr << "Cannot open batch input: " << source << std::endl;
+            return 1;
+        }
     }
-}
+    std::istream& input = source == "-" ? std::cin : file;
 
-// 設定を読み込み
-std::tuple<std::string, std::map<std::string, std::string>, std::string> load_config() {
-    try {
-        std::ifstream file(get_config_path());
-        if (!file) throw std::runtime_error("Config file not found");
+    ConnectionManager conn(token);
+    RateLimiter limiter(&metrics);
+    std::vector<OutgoingMessage> replay;
+    std::unique_ptr<Outbox> outbox = open_outbox(replay);
+    IdentityPool identities(conn, limiter, token, load_identity_config(channels));
+    if (identities.size() > 1) std::cout << "Sending as " << identities.describe() << "." << std::endl;
+    SendWorker worker(identities, outbox.get(), [](const OutgoingMessage& message, const HttpResponse& response) {
+        if (response.result != CURLE_OK) {
+            std::cerr << "Failed to send \"" << message.content << "\": " << curl_easy_strerror(response.result) << std::endl;
+        } else if (!response.ok()) {
+            std::cerr << "Failed to send \"" << message.content << "\": API Error [" << response.status << "]: " << response.body << std::endl;
+        }
+    });
 
-        json config;
-        file >> config;
+    size_t invalid = 0, line_number = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (auto& message : replay) {
+        worker.submit(std::move(message));
+    }
 
-        std::string token = config["token"];
-        std::map<std::string, std::string> channels = config["channels"].get<std::map<std::string, std::string>>();
-        std::string last_used_channel = config.value("last_used_channel", "");
+    Coalescer coalescer(worker, coalesce_window);
+    std::string line, channel_id, content, error; // 行ごとに作り直さない
+    while (std::getline(input, line)) {
+        ++line_number;
+        if (!line.empty() && line.back() == '\r') line.pop_back();
+        if (line.empty()) continue;
 
-        return {token, channels, last_used_channel};
-    } catch (const std::exception& e) {
-        std::cerr << "Error loading config: " << e.what() << std::endl;
-        throw;
+        if (!parse_batch_line(line, channels, default_channel, channel_id, content, error)) {
+            std::cerr << "Line " << line_number << ": " << error << std::endl;
+            ++invalid;
+            continue;
+        }
+        coalescer.add(channel_id, std::move(content));
+    }
+    coalescer.stop();
+    worker.stop();
+
+    size_t sent = worker.sent(), failed = worker.failed() + invalid;
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::cout << "Batch complete: " << sent << " sent, " << failed << " failed in "
+              << std::fixed << std::setprecision(2) << elapsed << "s ("
+              << (elapsed > 0 ? sent / elapsed : 0.0) << " msgs/sec)" << std::endl;
+    if (identities.size() > 1) {
+        std::cout << "Sent by identity: " << identities.usage() << std::endl;
+    }
+    if (coalescer.messages() != coalescer.lines()) {
+        std::cout << coalescer.lines() << " lines sent as " << coalescer.messages() << " messages." << std::endl;
     }
+    if (worker.pending() > 0) {
+        std::cout << worker.pending() << " message(s) kept in the outbox for the next run." << std::endl;
+    }
+    return failed == 0 && worker.pending() == 0 ? 0 : 1;
 }
 
-// ヘルプメッセージを表示
-void print_help() {
-    std::cout << "Usage: dcli [options]\n";
-    std::cout << "Options:\n";
-    std::cout << "  --token <TOKEN>            Set Discord Bot Token\n";
-    std::cout << "  --switch                   Switch to a different channel by name\n";
-    std::cout << "  --add                      Add a new channel ID and name\n";
-    std::cout << "  --remove                   Remove a channel ID and name\n";
-    std::cout << "  --help                     Show this help message\n";
+// Read one '\n'-terminated line from a socket, buffering any excess in `buffer`
+bool read_line(int fd, std::string& buffer, std::string& line) {
+    for (;;) {
+        size_t newline = buffer.find('\n');
+        if (newline != std::string::npos) {
+            line.assign(buffer, 0, newline);
+            buffer.erase(0, newline + 1);
+            return true;
+        }
+        char chunk[4096];
+        ssize_t n = recv(fd, chunk, sizeof(chunk), 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            if (buffer.empty()) return false;
+            line.swap(buffer);
+            buffer.clear();
+            return true;
+        }
+        buffer.append(chunk, n);
+    }
 }
 
-// コールバック関数を定義
-size_t WriteCallback(void* ptr, size_t size, size_t nmemb, void* userp) {
-    ((std::string*)userp)->append((char*)ptr, size * nmemb);
-    return size * nmemb;
+bool write_all(int fd, const std::string& data) {
+    size_t written = 0;
+    while (written < data.size()) {
+        ssize_t n = send(fd, data.data() + written, data.size() - written, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        written += n;
+    }
+    return true;
 }
 
-// Function to retrieve recent messages from a specific user
-void get_recent_messages(CurlHandle& curl, const std::string& url, CurlSlist& headers, const std::string& username) {
-    std::string readBuffer;
+sockaddr_un make_socket_address(const std::string& path) {
+    sockaddr_un addr{};
+    addr.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(addr.sun_path)) throw std::runtime_error("Socket path too long: " + path);
+    std::strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+    return addr;
+}
 
-    curl_easy_setopt(curl.get(), CURLOPT_URL, (url + "?limit=100").c_str());
-    curl_easy_setopt(curl.get(), CURLOPT_HTTPHEADER, headers.get());
-    curl_easy_setopt(curl.get(), CURLOPT_WRITEFUNCTION, WriteCallback);
-    curl_easy_setopt(curl.get(), CURLOPT_WRITEDATA, &readBuffer);
+volatile std::sig_atomic_t daemon_stop = 0;
 
-    CURLcode res = curl_easy_perform(curl.get());
-    if (res != CURLE_OK) {
-        std::cerr << "Request failed: " << curl_easy_strerror(res) << std::endl;
-    } else {
-        long response_code;
-        curl_easy_getinfo(curl.get(), CURLINFO_RESPONSE_CODE, &response_code);
-        if (response_code != 200) {
-            std::cerr << "API Error [" << response_code << "]: " << readBuffer << std::endl;
+void handle_daemon_signal(int) {
+    daemon_stop = 1;
+}
+
+// Reply to a line the daemon has queued (same as json{{"queued", true}}.dump())
+const std::string QUEUED_REPLY = "{\"queued\":true}\n";
+// A client that neither sends nor reads replies for this long is disconnected
+const auto DAEMON_CLIENT_TIMEOUT = std::chrono::seconds(1);
+
+// A connected `dcli send`. Its socket is non-blocking: input is taken as it
+// arrives and replies wait in `out`, so one slow client can't stall the others.
+struct DaemonClient {
+    int fd = -1;
+    std::string in, out;
+    bool eof = false;
+    std::chrono::steady_clock::time_point last_active;
+};
+
+// Long-lived process that keeps the config and a warm connection, and accepts
+// NDJSON {"channel": ..., "content": ...} lines from `dcli send` over a Unix socket
+int run_daemon(const std::string& token, const std::map<std::string, std::string>& channels, const std::string& default_channel,
+               Metrics& metrics, std::chrono::milliseconds coalesce_window) {
+    const std::string socket_path = get_socket_path();
+    sockaddr_un addr = make_socket_address(socket_path);
+
+    int listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listen_fd < 0) {
+        std::cerr << "socket: " << std::strerror(errno) << std::endl;
+        return 1;
+    }
+    // 既に起動中のデーモンがあれば終了、古いソケットは削除
+    if (connect(listen_fd, (sockaddr*)&addr, sizeof(addr)) == 0) {
+        std::cerr << "dcli daemon is already running on " << socket_path << std::endl;
+        close(listen_fd);
+        return 1;
+    }
+    close(listen_fd);
+    unlink(socket_path.c_str());
+
+    listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    mode_t old_mask = umask(0077);
+    int bound = bind(listen_fd, (sockaddr*)&addr, sizeof(addr));
+    umask(old_mask);
+    if (bound < 0 || listen(listen_fd, 64) < 0) {
+        std::cerr << "Cannot listen on " << socket_path << ": " << std::strerror(errno) << std::endl;
+        close(listen_fd);
+        return 1;
+    }
+
+    struct sigaction action{};
+    action.sa_handler = handle_daemon_signal;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGINT, &action, nullptr);
+    sigaction(SIGTERM, &action, nullptr);
+    signal(SIGPIPE, SIG_IGN);
+
+    ConnectionManager conn(token);
+    RateLimiter limiter(&metrics);
+    std::vector<OutgoingMessage> replay;
+    std::unique_ptr<Outbox> outbox = open_outbox(replay);
+    IdentityPool identities(conn, limiter, token, load_identity_config(channels));
+    if (identities.size() > 1) std::cout << "Sending as " << identities.describe() << "." << std::endl;
+    SendWorker worker(identities, outbox.get(), [](const OutgoingMessage&, const HttpResponse& response) {
+        if (response.result != CURLE_OK) {
+            std::cerr << "Request failed: " << curl_easy_strerror(response.result) << std::endl;
+        } else if (!response.ok()) {
+            std::cerr << "API Error [" << response.status << "]: " << response.body << std::endl;
+        }
+    });
+
+    std::cout << "dcli daemon listening on " << socket_path << std::endl;
+    for (auto& message : replay) {
+        worker.submit(std::move(message));
+    }
+    Coalescer coalescer(worker, coalesce_window);
+
+    std::string line, channel_id, content, error; // 行ごとに作り直さない
+    auto handle_line = [&](DaemonClient& client) {
+        if (line.empty()) return;
+        if (parse_batch_line(line, channels, default_channel, channel_id, content, error)) {
+            coalescer.add(channel_id, std::move(content));
+            client.out += QUEUED_REPLY;
         } else {
-            try {
-                auto messages = json::parse(readBuffer);
-                std::vector<std::string> user_messages;
-                for (const auto& message : messages) {
-                    if (message["author"]["username"] == username) {
-                        user_messages.push_back(message["content"]);
-                    }
-                }
-                if (user_messages.empty()) {
-                    std::cout << "No messages found for user: " << username << "\n";
-                } else {
-                    std::reverse(user_messages.begin(), user_messages.end()); // Reverse the order of user messages
-                    for (const auto& msg : user_messages) {
-                        std::cout << msg << "\n";
-                    }
-                }
-            } catch (const json::parse_error& e) {
-                std::cerr << "JSON parse error: " << e.what() << std::endl;
+            client.out += json{{"error", error}}.dump() + "\n";
+        }
+    };
+    // Read what has arrived, queue every complete line and send what replies fit;
+    // false once the client is finished or broken
+    auto serve = [&](DaemonClient& client, short revents, std::chrono::steady_clock::time_point now) {
+        if (revents & (POLLIN | POLLHUP | POLLERR)) {
+            char chunk[4096];
+            ssize_t n = recv(client.fd, chunk, sizeof(chunk), 0);
+            if (n > 0) {
+                client.in.append(chunk, n);
+                client.last_active = now;
+            } else if (n == 0 || (errno != EINTR && errno != EAGAIN)) {
+                client.eof = true;
+            }
+        }
+        size_t start = 0, newline;
+        while ((newline = client.in.find('\n', start)) != std::string::npos) {
+            line.assign(client.in, start, newline - start);
+            handle_line(client);
+            start = newline + 1;
+        }
+        client.in.erase(0, start);
+        if (client.eof && !client.in.empty()) {
+            // 改行のない最後の行
+            line.swap(client.in);
+            client.in.clear();
+            handle_line(client);
+        }
+        while (!client.out.empty()) {
+            ssize_t n = send(client.fd, client.out.data(), client.out.size(), MSG_NOSIGNAL);
+            if (n < 0 && errno == EINTR) continue;
+            if (n < 0 && errno == EAGAIN) break;
+            if (n <= 0) return false;
+            client.out.erase(0, n);
+            client.last_active = now;
+        }
+        if (client.eof && client.out.empty()) return false;
+        return now - client.last_active < DAEMON_CLIENT_TIMEOUT;
+    };
+
+    // 待ち受けソケットと全クライアントをまとめて poll する
+    std::vector<DaemonClient> clients;
+    std::vector<pollfd> fds;
+    while (!daemon_stop) {
+        fds.assign(1, pollfd{listen_fd, POLLIN, 0});
+        for (const auto& client : clients) {
+            short events = 0;
+            if (!client.eof) events |= POLLIN;
+            if (!client.out.empty()) events |= POLLOUT;
+            fds.push_back({client.fd, events, 0});
+        }
+        int timeout = clients.empty() ? -1 : static_cast<int>(std::chrono::milliseconds(DAEMON_CLIENT_TIMEOUT).count());
+        if (poll(fds.data(), fds.size(), timeout) < 0) {
+            if (errno == EINTR) continue;
+            std::cerr << "poll: " << std::strerror(errno) << std::endl;
+            break;
+        }
+        auto now = std::chrono::steady_clock::now();
+        size_t kept = 0;
+        for (size_t i = 0; i < clients.size(); ++i) {
+            if (serve(clients[i], fds[i + 1].revents, now)) {
+                if (kept != i) clients[kept] = std::move(clients[i]);
+                ++kept;
+            } else {
+                close(clients[i].fd);
+            }
+        }
+        clients.resize(kept);
+
+        if (fds[0].revents & POLLIN) {
+            int fd = accept4(listen_fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (fd >= 0) {
+                clients.push_back({fd, {}, {}, false, now});
+            } else if (errno != EINTR && errno != EAGAIN && errno != ECONNABORTED) {
+                std::cerr << "accept: " << std::strerror(errno) << std::endl;
+                break;
             }
         }
     }
+    for (const auto& client : clients) close(client.fd);
+
+    close(listen_fd);
+    unlink(socket_path.c_str());
+    coalescer.stop();
+    worker.stop();
+    std::cout << "dcli daemon stopped." << std::endl;
+    return 0;
 }
 
-// Function to list recent usernames
-std::vector<std::string> list_recent_usernames(CurlHandle& curl, const std::string& url, CurlSlist& headers) {
-    std::string readBuffer;
+// `dcli send`: hand messages to the daemon and return without waiting for delivery
+int run_send_client(const std::string& channel, const std::vector<std::string>& messages) {
+    const std::string socket_path = get_socket_path();
+    sockaddr_un addr = make_socket_address(socket_path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, (sockaddr*)&addr, sizeof(addr)) < 0) {
+        std::cerr << "dcli daemon is not running (start it with 'dcli --daemon')." << std::endl;
+        if (fd >= 0) close(fd);
+        return 1;
+    }
 
-    curl_easy_setopt(curl.get(), CURLOPT_URL, (url + "?limit=100").c_str());
-    curl_easy_setopt(curl.get(), CURLOPT_HTTPHEADER, headers.get());
-    curl_easy_setopt(curl.get(), CURLOPT_WRITEFUNCTION, WriteCallback);
-    curl_easy_setopt(curl.get(), CURLOPT_WRITEDATA, &readBuffer);
+    std::string request;
+    for (const auto& content : messages) {
+        json line;
+        line["content"] = content;
+        if (!channel.empty()) line["channel"] = channel;
+        request += line.dump() + "\n";
+    }
+    if (!write_all(fd, request)) {
+        std::cerr << "Failed to write to daemon: " << std::strerror(errno) << std::endl;
+        close(fd);
+        return 1;
+    }
+    shutdown(fd, SHUT_WR);
 
-    CURLcode res = curl_easy_perform(curl.get());
-    if (res != CURLE_OK) {
-        std::cerr << "Request failed: " << curl_easy_strerror(res) << std::endl;
-        return {};
-    } else {
-        long response_code;
-        curl_easy_getinfo(curl.get(), CURLINFO_RESPONSE_CODE, &response_code);
-        if (response_code != 200) {
-            std::cerr << "API Error [" << response_code << "]: " << readBuffer << std::endl;
-            return {};
-        } else {
-            try {
-                auto messages = json::parse(readBuffer);
-                std::set<std::string> usernames;
-                for (const auto& message : messages) {
-                    usernames.insert(message["author"]["username"]);
-                }
-                return std::vector<std::string>(usernames.begin(), usernames.end());
-            } catch (const json::parse_error& e) {
-                std::cerr << "JSON parse error: " << e.what() << std::endl;
-                return {};
+    size_t failed = 0, replies = 0;
+    std::string buffer, line;
+    while (replies < messages.size() && read_line(fd, buffer, line)) {
+        ++replies;
+        try {
+            auto reply = json::parse(line);
+            if (reply.contains("error")) {
+                std::cerr << reply["error"].get<std::string>() << std::endl;
+                ++failed;
             }
+        } catch (const json::parse_error& e) {
+            std::cerr << "Invalid reply from daemon: " << e.what() << std::endl;
+            ++failed;
         }
     }
+    close(fd);
+    failed += messages.size() - replies;
+    return failed == 0 ? 0 : 1;
 }
 
-// Function to escape special characters in a JSON string
-std::string escape_json(const std::string& s) {
-    std::ostringstream o;
-    for (auto c = s.cbegin(); c != s.cend(); c++) {
-        switch (*c) {
-            case '"': o << "\\\""; break;
-            case '\\': o << "\\\\"; break;
-            case '\b': o << "\\b"; break;
-            case '\f': o << "\\f"; break;
-            case '\n': o << "\\n"; break;
-            case '\r': o << "\\r"; break;
-            case '\t': o << "\\t"; break;
-            default:
-                if ('\x00' <= *c && *c <= '\x1f') {
-                    o << "\\u"
-                      << std::hex << std::setw(4) << std::setfill('0') << (int)*c;
-                } else {
-                    o << *c;
-                }
-        }
+// Compare request latency on a new connection per request against the shared warm connection
+int run_latency_bench(int rounds) {
+    const std::string url = API_BASE + "/gateway";
+    struct Result {
+        double first_ms = 0, rest_ms = 0;
+        long connects = 0;
+        long http_version = 0;
+        size_t failed = 0;
+    };
+    auto timed_get = [&](ConnectionManager& conn, Result& result, int i) {
+        auto start = std::chrono::steady_clock::now();
+        HttpResponse response = conn.get(url);
+        double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        if (!response.ok()) ++result.failed;
+        long connects = 0;
+        curl_easy_getinfo(conn.handle(), CURLINFO_NUM_CONNECTS, &connects);
+        curl_easy_getinfo(conn.handle(), CURLINFO_HTTP_VERSION, &result.http_version);
+        result.connects += connects;
+        if (i == 0) result.first_ms = ms; else result.rest_ms += ms;
+    };
+
+    Result cold, warm;
+    for (int i = 0; i < rounds; ++i) {
+        ConnectionManager conn("");
+        timed_get(conn, cold, i);
+    }
+    ConnectionManager conn("");
+    for (int i = 0; i < rounds; ++i) {
+        timed_get(conn, warm, i);
     }
-    return o.str();
-}
 
-// Function to trim whitespace from both ends of a string
-std::string trim(const std::string& str) {
-    size_t first = str.find_first_not_of(' ');
-    if (first == std::string::npos) return "";
-    size_t last = str.find_last_not_of(' ');
-    return str.substr(first, last - first + 1);
+    auto report = [&](const char* label, const Result& r) {
+        std::cout << label << std::fixed << std::setprecision(1) << "first " << r.first_ms << " ms, subsequent avg "
+                  << (rounds > 1 ? r.rest_ms / (rounds - 1) : 0.0) << " ms, " << r.connects << " connections, "
+                  << (r.http_version == CURL_HTTP_VERSION_2_0 ? "HTTP/2" : "HTTP/1.1");
+        if (r.failed) std::cout << ", " << r.failed << " failed";
+        std::cout << "\n";
+    };
+    std::cout << "Latency over " << rounds << " requests to " << url << "\n";
+    report("  new connection per request: ", cold);
+    report("  shared warm connection:     ", warm);
+    return (cold.failed || warm.failed) ? 1 : 0;
 }
 
 // メイン関数
@@ -213,8 +4999,25 @@ int main(int argc, char *argv[]) {
     try {
         std::string token;
         std::map<std::string, std::string> channels;
+        ChannelNames names; // channels の逆引き (ID -> 名前); channels と一緒に更新する
         std::string current_channel_id;
         std::string last_used_channel;
+        std::string channel_arg;
+        bool batch_mode = false;
+        int latency_rounds = 0;
+        bool daemon_mode = false;
+        size_t history_count = 0;
+        size_t tail_count = 0;
+        bool follow = false;
+        std::string metrics_path;
+        std::vector<std::string> attach_paths;
+        std::string search_query;
+        bool sync_guild = false;
+        std::string sync_guild_id; // 空なら参加している全ギルド
+        std::string export_channel_arg;
+        std::string export_path; // 空なら <チャンネルID>.ndjson.gz
+        std::chrono::milliseconds coalesce_window{0}; // 0: 長いメッセージの分割のみ
+        std::string batch_source = "-";
 
         // コマンドライン引数の処理
         struct option long_options[] = {
@@ -222,12 +5025,27 @@ int main(int argc, char *argv[]) {
             {"switch", no_argument, nullptr, 's'},
             {"add", no_argument, nullptr, 'a'},
             {"remove", no_argument, nullptr, 'r'},
+            {"channel", required_argument, nullptr, 'c'},
+            {"batch", optional_argument, nullptr, 'b'},
+            {"coalesce", optional_argument, nullptr, 'C'},
+            {"latency-bench", optional_argument, nullptr, 'L'},
+            {"daemon", no_argument, nullptr, 'D'},
+            {"history", required_argument, nullptr, 'H'},
+            {"tail-all", optional_argument, nullptr, 'T'},
+            {"search", required_argument, nullptr, 'Q'},
+            {"sync-guild", optional_argument, nullptr, 'G'},
+            {"export", required_argument, nullptr, 'E'},
+            {"out", required_argument, nullptr, 'O'},
+            {"follow", no_argument, nullptr, 'F'},
+            {"metrics", required_argument, nullptr, 'M'},
+            {"attach", required_argument, nullptr, 'A'},
             {"help", no_argument, nullptr, 'h'},
             {nullptr, 0, nullptr, 0}
         };
 
         int opt;
-        while ((opt = getopt_long(argc, argv, "t:sarh", long_options, nullptr)) != -1) {
+        // '+': 最初の非オプション (send) で解析を止め、"dcli send -5 degrees" の本文をオプション扱いしない
+        while ((opt = getopt_long(argc, argv, "+t:sarc:b::C::L::DH:T::Q:G::E:O:FM:A:h", long_options, nullptr)) != -1) {
             switch (opt) {
                 case 't':
                     token = optarg;
@@ -236,37 +5054,26 @@ int main(int argc, char *argv[]) {
                     auto config = load_config();
                     token = std::get<0>(config);
                     channels = std::get<1>(config);
-                    std::cout << "Select a channel to use:\n";
-                    int index = 1;
-                    for (const auto& [name, id] : channels) {
-                        std::cout << index++ << ". " << name << "\n";
-                    }
-                    std::cout << "Enter the number of the channel: ";
-                    int channel_index;
-                    std::cin >> channel_index;
-                    std::cin.ignore(std::numeric_limits<std::streamsize>::max(), '\n'); // Clear the input buffer
-                    if (channel_index > 0 && channel_index <= channels.size()) {
-                        auto it = channels.begin();
-                        std::advance(it, channel_index - 1);
-                        current_channel_id = it->second;
-                        last_used_channel = current_channel_id;
-                        save_config(token, channels, last_used_channel);
-                    } else {
-                        std::cerr << "Invalid selection.\n";
-                        return 1;
-                    }
+                    names = channel_names(channels);
+                    auto [channel_id, label] = pick_channel(channels, "");
+                    if (channel_id.empty()) return 1;
+                    current_channel_id = channel_id;
+                    last_used_channel = current_channel_id;
+                    save_config(token, channels, last_used_channel);
                     break;
                 }
                 case 'a': {
                     auto config = load_config();
                     token = std::get<0>(config);
                     channels = std::get<1>(config);
+                    names = channel_names(channels);
                     std::string channel_id, channel_name;
                     std::cout << "Enter Channel ID: ";
                     std::getline(std::cin, channel_id);
                     std::cout << "Enter Channel Name: ";
                     std::getline(std::cin, channel_name);
                     channels[channel_name] = channel_id;
+                    names.emplace(channel_id, channel_name);
                     save_config(token, channels, last_used_channel);
                     std::cout << "Channel added successfully.\n";
                     return 0;
@@ -275,27 +5082,72 @@ int main(int argc, char *argv[]) {
                     auto config = load_config();
                     token = std::get<0>(config);
                     channels = std::get<1>(config);
-                    std::cout << "Select a channel to remove:\n";
-                    int index = 1;
-                    for (const auto& [name, id] : channels) {
-                        std::cout << index++ << ". " << name << "\n";
+                    names = channel_names(channels);
+                    // 設定済みのチャンネルだけから選ぶ (同期したディレクトリは除く)
+                    auto [channel_id, name] = pick_channel(channels, "", ChannelDirectory(), "remove");
+                    if (channel_id.empty() || channels.erase(name) == 0) return 1;
+                    auto named = names.find(channel_id);
+                    if (named != names.end() && named->second == name) names.erase(named);
+                    save_config(token, channels, last_used_channel);
+                    std::cout << "Channel removed successfully.\n";
+                    return 0;
+                }
+                case 'c':
+                    channel_arg = optarg;
+                    break;
+                case 'b':
+                    batch_mode = true;
+                    if (optarg) batch_source = optarg;
+                    break;
+                case 'C':
+                    coalesce_window = optarg ? std::chrono::milliseconds(std::atoi(optarg)) : DEFAULT_COALESCE_WINDOW;
+                    if (coalesce_window.count() <= 0) {
+                        std::cerr << "Invalid coalesce window: " << optarg << std::endl;
+                        return 1;
                     }
-                    std::cout << "Enter the number of the channel: ";
-                    int channel_index;
-                    std::cin >> channel_index;
-                    std::cin.ignore(std::numeric_limits<std::streamsize>::max(), '\n'); // Clear the input buffer
-                    if (channel_index > 0 && channel_index <= channels.size()) {
-                        auto it = channels.begin();
-                        std::advance(it, channel_index - 1);
-                        channels.erase(it);
-                        save_config(token, channels, last_used_channel);
-                        std::cout << "Channel removed successfully.\n";
-                    } else {
-                        std::cerr << "Invalid selection.\n";
+                    break;
+                case 'L':
+                    latency_rounds = optarg ? std::max(2, std::atoi(optarg)) : 10;
+                    break;
+                case 'D':
+                    daemon_mode = true;
+                    break;
+                case 'H':
+                    history_count = std::strtoul(optarg, nullptr, 10);
+                    if (history_count == 0) {
+                        std::cerr << "Invalid history count: " << optarg << std::endl;
                         return 1;
                     }
-                    return 0;
-                }
+                    break;
+                case 'T':
+                    tail_count = optarg ? std::strtoul(optarg, nullptr, 10) : TAIL_DEFAULT_COUNT;
+                    if (tail_count == 0) {
+                        std::cerr << "Invalid message count: " << optarg << std::endl;
+                        return 1;
+                    }
+                    break;
+                case 'Q':
+                    search_query = optarg;
+                    break;
+                case 'G':
+                    sync_guild = true;
+                    if (optarg) sync_guild_id = optarg;
+                    break;
+                case 'E':
+                    export_channel_arg = optarg;
+                    break;
+                case 'O':
+                    export_path = optarg;
+                    break;
+                case 'F':
+                    follow = true;
+                    break;
+                case 'M':
+                    metrics_path = optarg;
+                    break;
+                case 'A':
+                    attach_paths.push_back(optarg);
+                    break;
                 case 'h':
                     print_help();
                     return 0;
@@ -305,12 +5157,49 @@ int main(int argc, char *argv[]) {
             }
         }
 
+        // dcli send: 設定を読まずにデーモンへ渡す
+        if (optind < argc && std::string(argv[optind]) == "send") {
+            std::vector<std::string> messages;
+            std::string text;
+            int first = optind + 1;
+            if (first < argc && std::string(argv[first]) == "--") ++first;
+            for (int i = first; i < argc; ++i) {
+                if (!text.empty()) text += ' ';
+                text += argv[i];
+            }
+            if (!text.empty()) {
+                messages.push_back(text);
+            } else {
+                std::string line;
+                while (std::getline(std::cin, line)) {
+                    if (!line.empty()) messages.push_back(line);
+                }
+            }
+            if (messages.empty()) {
+                std::cerr << "Cannot send an empty message.\n";
+                return 1;
+            }
+            return run_send_client(channel_arg, messages);
+        }
+
+        if (latency_rounds > 0) {
+            return run_latency_bench(latency_rounds);
+        }
+
+        // リクエストごとの計測 (/stats, --metrics)
+        Metrics metrics;
+        if (!metrics_path.empty() && !metrics.open_log(metrics_path)) {
+            std::cerr << "Cannot open metrics file: " << metrics_path << std::endl;
+            return 1;
+        }
+
         // 設定ファイルからトークンとチャンネルIDを読み込み
         if (token.empty() || current_channel_id.empty()) {
             try {
                 auto config = load_config();
                 token = std::get<0>(config);
                 channels = std::get<1>(config);
+                names = channel_names(channels);
                 last_used_channel = std::get<2>(config);
                 if (current_channel_id.empty() && !last_used_channel.empty()) {
                     current_channel_id = last_used_channel;
@@ -321,6 +5210,99 @@ int main(int argc, char *argv[]) {
             }
         }
 
+        // --channel で送信先を指定
+        if (!channel_arg.empty()) {
+            current_channel_id = resolve_channel(channels, channel_arg);
+            if (current_channel_id.empty()) {
+                std::cerr << "Unknown channel: " << channel_arg << std::endl;
+                return 1;
+            }
+        }
+
+        // 検索はキャッシュ済みのメッセージだけを使うのでトークンは不要
+        if (!search_query.empty()) {
+            SearchIndex index;
+            MessageCache cache;
+            run_search(index, cache, channels, names, search_query);
+            return 0;
+        }
+
+        // バッチモードは対話的な初期設定を行わない
+        if (batch_mode) {
+            if (token.empty() || current_channel_id.empty()) {
+                std::cerr << "Batch mode requires a configured token and channel.\n";
+                return 1;
+            }
+            return run_batch(token, channels, current_channel_id, batch_source, metrics, coalesce_window);
+        }
+        if (sync_guild) {
+            if (token.empty()) {
+                std::cerr << "--sync-guild requires a configured token.\n";
+                return 1;
+            }
+            ConnectionManager conn(token);
+            RateLimiter limiter(&metrics);
+            return sync_guilds(conn, limiter, sync_guild_id) ? 0 : 1;
+        }
+        if (!export_channel_arg.empty()) {
+            if (token.empty()) {
+                std::cerr << "--export requires a configured token.\n";
+                return 1;
+            }
+            std::string channel_id = resolve_channel(channels, export_channel_arg);
+            if (channel_id.empty()) {
+                std::cerr << "Unknown channel: " << export_channel_arg << std::endl;
+                return 1;
+            }
+            if (export_path.empty()) export_path = channel_id + ".ndjson.gz";
+            ConnectionManager conn(token);
+            RateLimiter limiter(&metrics);
+            return export_channel(conn, limiter, channel_id, channel_label(names, channel_id), export_path) ? 0 : 1;
+        }
+        if (!export_path.empty()) {
+            std::cerr << "--out is only used with --export.\n";
+            return 1;
+        }
+        if (!attach_paths.empty()) {
+            if (token.empty() || current_channel_id.empty()) {
+                std::cerr << "--attach requires a configured token and channel.\n";
+                return 1;
+            }
+            ConnectionManager conn(token);
+            RateLimiter limiter(&metrics);
+            Uploader uploader(conn, limiter);
+            return uploader.upload(current_channel_id, attach_paths) == 0 ? 0 : 1;
+        }
+        if (history_count > 0) {
+            if (token.empty() || current_channel_id.empty()) {
+                std::cerr << "History mode requires a configured token and channel.\n";
+                return 1;
+            }
+            ConnectionManager conn(token);
+            RateLimiter limiter(&metrics);
+            MessageStore store(current_channel_id);
+            bool ok = fetch_history(conn, limiter, store, current_channel_id, history_count);
+            print_history(store, history_count);
+            return ok ? 0 : 1;
+        }
+        if (tail_count > 0) {
+            if (token.empty() || channels.empty()) {
+                std::cerr << "--tail-all requires a configured token and channels.\n";
+                return 1;
+            }
+            ConnectionManager conn(token);
+            RateLimiter limiter(&metrics);
+            MessageCache cache;
+            return tail_all(conn, limiter, cache, channels, tail_count) ? 0 : 1;
+        }
+        if (daemon_mode) {
+            if (token.empty() || current_channel_id.empty()) {
+                std::cerr << "Daemon mode requires a configured token and channel.\n";
+                return 1;
+            }
+            return run_daemon(token, channels, current_channel_id, metrics, coalesce_window);
+        }
+
         // トークンとチャンネルIDが設定されていない場合、初期設定を求める
         if (token.empty() || current_channel_id.empty()) {
             std::cout << "Discord Bot Token and Channel ID are required.\n";
@@ -335,132 +5317,183 @@ int main(int argc, char *argv[]) {
                 std::cout << "Enter a name for this channel: ";
                 std::getline(std::cin, channel_name);
                 channels[channel_name] = current_channel_id;
+                names.emplace(current_channel_id, channel_name);
                 last_used_channel = current_channel_id;
             }
             save_config(token, channels, last_used_channel);
         }
 
-        // Discord APIとの通信処理
-        CurlHandle curl(curl_easy_init());
-        if (curl) {
-            // ヘッダーの正しい構築
-            CurlSlist headers;
-            headers.reset(curl_slist_append(nullptr, "Content-Type: application/json"));
-            headers.reset(curl_slist_append(headers.release(), ("Authorization: " + token).c_str()));
-
-            std::string url = "https://discord.com/api/v10/channels/" + current_channel_id + "/messages";
-            bool continue_input = true;
-            bool is_first_input = true; // 初回入力かどうかを判定するフラグ
+        // Discord APIとの通信処理 (接続は ConnectionManager で使い回す)
+        ConnectionManager conn(token);
+        RateLimiter limiter(&metrics);
 
-            while (continue_input) {
-                if (is_first_input) {
-                    std::cout << "Enter message (or '/exit' to quit): ";
-                    is_first_input = false; // 初回のみ表示
-                } else {
-                    std::cout << "> "; // 2回目以降は簡潔なプロンプト
-                }
-                std::string message;
-                std::getline(std::cin, message);
-                message = trim(message); // Trim whitespace from the input
+        // 送信はバックグラウンドで行い、失敗は非同期に表示する
+        std::vector<OutgoingMessage> replay;
+        std::unique_ptr<Outbox> outbox = open_outbox(replay);
+        IdentityPool identities(conn, limiter, token, load_identity_config(channels));
+        if (identities.size() > 1) std::cout << "Sending as " << identities.describe() << ".\n";
+        SendWorker worker(identities, outbox.get(), [](const OutgoingMessage& message, const HttpResponse& response) {
+            if (response.result != CURLE_OK) {
+                std::cerr << "\nFailed to send \"" << message.content << "\": " << curl_easy_strerror(response.result) << std::endl;
+            } else if (!response.ok()) {
+                std::cerr << "\nFailed to send \"" << message.content << "\": API Error [" << response.status << "]: " << response.body << std::endl;
+            }
+        });
 
-                // Trim command and check for specific commands
-                std::string command = message.substr(0, message.find(' '));
-                command = trim(command);
+        for (auto& message : replay) {
+            worker.submit(std::move(message));
+        }
+        Coalescer coalescer(worker, coalesce_window);
 
-                if (command == "/exit") {
-                    continue_input = false;
-                    break;
-                } else if (command == "/get") {
-                    // Reinitialize curl handle and headers for the /get request
-                    curl.reset(curl_easy_init());
-                    headers.reset(curl_slist_append(nullptr, "Content-Type: application/json"));
-                    headers.reset(curl_slist_append(headers.release(), ("Authorization: " + token).c_str()));
-
-                    auto usernames = list_recent_usernames(curl, url, headers);
-                    if (usernames.empty()) {
-                        std::cout << "No recent messages found.\n";
-                        continue;
-                    }
+        MessageCache cache;
+        std::unique_ptr<Uploader> uploader; // /upload で初めて作る
+        std::unique_ptr<SearchIndex> search_index; // /search で初めて作る
 
-                    std::cout << "Select a user to retrieve messages:\n";
-                    for (size_t i = 0; i < usernames.size(); ++i) {
-                        std::cout << i + 1 << ". " << usernames[i] << "\n";
-                    }
+        // --follow: Gateway から受信したメッセージを送信ループと並行して表示
+        std::atomic<bool> follow_stop{false};
+        std::thread follower;
+        if (follow) {
+            GatewayClient gateway(token, channels, get_gateway_url(conn));
+            follower = std::thread([gateway = std::move(gateway), &follow_stop]() mutable { gateway.run(follow_stop); });
+        }
 
-                    std::cout << "Enter the number of the user: ";
-                    size_t user_index;
-                    std::cin >> user_index;
-                    std::cin.ignore(std::numeric_limits<std::streamsize>::max(), '\n'); // Clear the input buffer
+        bool continue_input = true;
+        bool is_first_input = true; // 初回入力かどうかを判定するフラグ
 
-                    if (user_index > 0 && user_index <= usernames.size()) {
-                        get_recent_messages(curl, url, headers, usernames[user_index - 1]);
-                    } else {
-                        std::cout << "Invalid selection.\n";
-                    }
-                    continue;
-                } else if (command == "/channel") {
-                    // 現在のチャンネル名を表示
-                    for (const auto& [name, id] : channels) {
-                        if (id == current_channel_id) {
-                            std::cout << "Current channel: " << name << "\n";
-                            break;
-                        }
-                    }
-                    continue;
-                } else if (command == "/switch") {
-                    // チャンネルを切り替える
-                    std::cout << "Select a channel to use:\n";
-                    size_t index = 1;
-                    for (const auto& [name, id] : channels) {
-                        std::cout << index++ << ". " << name << "\n";
-                    }
-                    std::cout << "Enter the number of the channel: ";
-                    size_t channel_index;
-                    std::cin >> channel_index;
-                    std::cin.ignore(std::numeric_limits<std::streamsize>::max(), '\n'); // Clear the input buffer
-                    if (channel_index > 0 && channel_index <= channels.size()) {
-                        auto it = channels.begin();
-                        std::advance(it, channel_index - 1);
-                        current_channel_id = it->second;
-                        last_used_channel = current_channel_id;
-                        save_config(token, channels, last_used_channel);
-                        url = "https://discord.com/api/v10/channels/" + current_channel_id + "/messages";
-                        std::cout << "Switched to channel: " << it->first << "\n";
-                    } else {
-                        std::cerr << "Invalid selection.\n";
-                    }
-                    continue;
+        while (continue_input) {
+            if (is_first_input) {
+                std::cout << "Enter message (or '/exit' to quit): ";
+                is_first_input = false; // 初回のみ表示
+            } else {
+                std::cout << "> "; // 2回目以降は簡潔なプロンプト
+            }
+            std::string message;
+            if (!std::getline(std::cin, message)) {
+                // 入力が終わっても --follow なら Ctrl-C まで受信を続ける
+                if (follow) {
+                    std::signal(SIGINT, handle_daemon_signal);
+                    std::signal(SIGTERM, handle_daemon_signal);
+                    while (!daemon_stop) std::this_thread::sleep_for(std::chrono::milliseconds(100));
                 }
+                break; // EOF
+            }
+            message = trim(message); // Trim whitespace from the input
 
-                if (message.empty()) {
-                    std::cerr << "Cannot send an empty message.\n";
+            // Trim command and check for specific commands
+            std::string command = message.substr(0, message.find(' '));
+            command = trim(command);
+
+            if (command == "/exit") {
+                continue_input = false;
+                break;
+            } else if (command == "/get") {
+                MessageStore& store = cache.channel(current_channel_id);
+                sync_channel(conn, limiter, store, current_channel_id);
+                auto usernames = list_recent_usernames(store);
+                if (usernames.empty()) {
+                    std::cout << "No recent messages found.\n";
                     continue;
                 }
 
-                std::string escaped_message = escape_json(message);
-                std::string payload = "{\"content\": \"" + escaped_message + "\"}";
-                std::string readBuffer;  // 毎回新規作成
+                std::cout << "Select a user to retrieve messages:\n";
+                for (size_t i = 0; i < usernames.size(); ++i) {
+                    std::cout << i + 1 << ". " << usernames[i] << "\n";
+                }
 
-                curl_easy_setopt(curl.get(), CURLOPT_URL, url.c_str());
-                curl_easy_setopt(curl.get(), CURLOPT_HTTPHEADER, headers.get());
-                curl_easy_setopt(curl.get(), CURLOPT_POSTFIELDS, payload.c_str());
-                curl_easy_setopt(curl.get(), CURLOPT_WRITEFUNCTION, WriteCallback);
-                curl_easy_setopt(curl.get(), CURLOPT_WRITEDATA, &readBuffer);
+                std::cout << "Enter the number of the user: ";
+                size_t user_index;
+                std::cin >> user_index;
+                std::cin.ignore(std::numeric_limits<std::streamsize>::max(), '\n'); // Clear the input buffer
 
-                CURLcode res = curl_easy_perform(curl.get());
-                if (res != CURLE_OK) {
-                    std::cerr << "Request failed: " << curl_easy_strerror(res) << std::endl;
-                    std::cerr << "Response: " << readBuffer << std::endl;
+                if (user_index > 0 && user_index <= usernames.size()) {
+                    get_recent_messages(store, usernames[user_index - 1]);
                 } else {
-                    long response_code;
-                    curl_easy_getinfo(curl.get(), CURLINFO_RESPONSE_CODE, &response_code);
-                    if (response_code != 200) {
-                        std::cerr << "API Error [" << response_code << "]: " << readBuffer << std::endl;
-                    } else {
-                        std::cout << "Message sent successfully!" << std::endl;
-                    }
+                    std::cout << "Invalid selection.\n";
+                }
+                continue;
+            } else if (command == "/history") {
+                // 過去のメッセージを遡って表示
+                size_t count = std::strtoul(trim(message.substr(command.size())).c_str(), nullptr, 10);
+                if (count == 0) count = RECENT_WINDOW;
+                MessageStore& store = cache.channel(current_channel_id);
+                fetch_history(conn, limiter, store, current_channel_id, count);
+                print_history(store, count);
+                continue;
+            } else if (command == "/tail-all") {
+                // 全チャンネルの最新メッセージを時系列でまとめて表示
+                size_t count = std::strtoul(trim(message.substr(command.size())).c_str(), nullptr, 10);
+                tail_all(conn, limiter, cache, channels, count == 0 ? TAIL_DEFAULT_COUNT : count);
+                continue;
+            } else if (command == "/upload") {
+                // ファイルを添付して送信 (1 ファイル 1 メッセージ)
+                // パスに空白があれば引用符で囲む: /upload "build log.txt"
+                std::vector<std::string> paths;
+                if (!split_args(message.substr(command.size()), paths)) {
+                    std::cerr << "Unterminated quote in /upload arguments.\n";
+                    continue;
+                }
+                if (paths.empty()) {
+                    std::cerr << "Usage: /upload <FILE...>\n";
+                    continue;
+                }
+                if (!uploader) uploader = std::make_unique<Uploader>(conn, limiter);
+                uploader->upload(current_channel_id, paths);
+                continue;
+            } else if (command == "/search") {
+                // 取得済みのメッセージを全チャンネル横断で検索
+                std::string query = trim(message.substr(command.size()));
+                if (query.empty()) {
+                    std::cerr << "Usage: /search <words> [from:USER] [in:CHANNEL] [after:DATE|AGE] [before:DATE|AGE]\n";
+                    continue;
                 }
+                if (!search_index) search_index = std::make_unique<SearchIndex>();
+                run_search(*search_index, cache, channels, names, query);
+                continue;
+            } else if (command == "/stats") {
+                // リクエストの所要時間やレート制限の状態を表示
+                metrics.print(std::cout);
+                continue;
+            } else if (command == "/pending") {
+                // 未送信のメッセージを表示
+                auto pending = worker.pending_messages();
+                std::cout << worker.sent() << " sent, " << worker.failed() << " failed, " << worker.pending() << " pending\n";
+                if (identities.size() > 1) std::cout << "  by identity: " << identities.usage() << "\n";
+                for (const auto& item : pending) {
+                    std::cout << "  [" << channel_label(names, *item.channel_id) << "] " << item.content << "\n";
+                }
+                continue;
+            } else if (command == "/channel") {
+                // 現在のチャンネル名を表示
+                std::cout << "Current channel: " << channel_label(names, current_channel_id) << "\n";
+                continue;
+            } else if (command == "/switch") {
+                // チャンネルを切り替える (/switch <名前の一部> で絞り込み)
+                auto [channel_id, label] = pick_channel(channels, trim(message.substr(command.size())));
+                if (channel_id.empty()) continue;
+                current_channel_id = channel_id;
+                last_used_channel = current_channel_id;
+                save_config(token, channels, last_used_channel);
+                std::cout << "Switched to channel: " << label << "\n";
+                continue;
+            }
+
+            if (message.empty()) {
+                std::cerr << "Cannot send an empty message.\n";
+                continue;
             }
+
+            coalescer.add(current_channel_id, std::move(message));
+        }
+
+        coalescer.stop();
+        if (worker.pending() > 0) {
+            std::cout << "Waiting for " << worker.pending() << " pending message(s)...\n";
+        }
+        worker.stop();
+        follow_stop = true;
+        if (follower.joinable()) follower.join();
+        if (worker.pending() > 0) {
+            std::cout << worker.pending() << " message(s) kept in the outbox for the next run.\n";
         }
     } catch (const std::exception& e) {
         std::cerr << "Error: " << e.what() << std::endl;
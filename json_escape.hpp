@@ -0,0 +1,117 @@
+// JSON 文字列のエスケープ (dcli.cpp と bench/escape_bench.cpp で共有)
+//
+// Output matches the original escape_json byte for byte: '"' and '\\' and the
+// control characters below 0x20 are escaped (named escapes where JSON has them,
+// otherwise \u00xx), everything else is copied as is. Bytes >= 0x80 never need
+// escaping, so UTF-8 sequences pass through untouched, and a block boundary can
+// never split anything that has to be rewritten.
+//
+// Clean runs are found 32 bytes at a time with AVX2 (picked at runtime), 16 bytes
+// with SSE2, or byte by byte elsewhere, and copied to the output in one append.
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define DCLI_ESCAPE_X86 1
+#endif
+
+namespace json_escape {
+
+inline bool needs_escape(unsigned char c) {
+    return c < 0x20 || c == '"' || c == '\\';
+}
+
+// Append the escape sequence for one byte that needs_escape()
+inline void append_escaped_byte(std::string& out, unsigned char c) {
+    static const char HEX[] = "0123456789abcdef";
+    switch (c) {
+        case '"': out.append("\\\"", 2); break;
+        case '\\': out.append("\\\\", 2); break;
+        case '\b': out.append("\\b", 2); break;
+        case '\f': out.append("\\f", 2); break;
+        case '\n': out.append("\\n", 2); break;
+        case '\r': out.append("\\r", 2); break;
+        case '\t': out.append("\\t", 2); break;
+        default: {
+            char escaped[6] = {'\\', 'u', '0', '0', HEX[c >> 4], HEX[c & 0xf]};
+            out.append(escaped, 6);
+        }
+    }
+}
+
+// Index of the first byte in [from, size) that needs escaping, or size
+inline size_t find_escape_scalar(const char* data, size_t from, size_t size) {
+    for (size_t i = from; i < size; ++i) {
+        if (needs_escape(static_cast<unsigned char>(data[i]))) return i;
+    }
+    return size;
+}
+
+#ifdef DCLI_ESCAPE_X86
+inline size_t find_escape_sse2(const char* data, size_t from, size_t size) {
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i backslash = _mm_set1_epi8('\\');
+    const __m128i control_max = _mm_set1_epi8(0x1f);
+    size_t i = from;
+    for (; i + 16 <= size; i += 16) {
+        __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i));
+        // 符号なしで block <= 0x1f
+        __m128i control = _mm_cmpeq_epi8(_mm_max_epu8(block, control_max), control_max);
+        __m128i hits = _mm_or_si128(control, _mm_or_si128(_mm_cmpeq_epi8(block, quote), _mm_cmpeq_epi8(block, backslash)));
+        int mask = _mm_movemask_epi8(hits);
+        if (mask) return i + __builtin_ctz(mask);
+    }
+    return find_escape_scalar(data, i, size);
+}
+
+__attribute__((target("avx2"))) inline size_t find_escape_avx2(const char* data, size_t from, size_t size) {
+    const __m256i quote = _mm256_set1_epi8('"');
+    const __m256i backslash = _mm256_set1_epi8('\\');
+    const __m256i control_max = _mm256_set1_epi8(0x1f);
+    size_t i = from;
+    for (; i + 32 <= size; i += 32) {
+        __m256i block = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + i));
+        __m256i control = _mm256_cmpeq_epi8(_mm256_max_epu8(block, control_max), control_max);
+        __m256i hits = _mm256_or_si256(control, _mm256_or_si256(_mm256_cmpeq_epi8(block, quote), _mm256_cmpeq_epi8(block, backslash)));
+        unsigned mask = static_cast<unsigned>(_mm256_movemask_epi8(hits));
+        if (mask) return i + __builtin_ctz(mask);
+    }
+    return find_escape_sse2(data, i, size);
+}
+#endif
+
+using FindFunction = size_t (*)(const char*, size_t, size_t);
+
+// Fastest scanner this CPU supports
+inline FindFunction best_find() {
+#ifdef DCLI_ESCAPE_X86
+    static const FindFunction best = __builtin_cpu_supports("avx2") ? find_escape_avx2 : find_escape_sse2;
+    return best;
+#else
+    return find_escape_scalar;
+#endif
+}
+
+// Append the escaped form of `in` to `out` using `find` to skip clean runs
+inline void append_escaped(std::string& out, std::string_view in, FindFunction find) {
+    const char* data = in.data();
+    size_t size = in.size(), start = 0;
+    while (start < size) {
+        size_t hit = find(data, start, size);
+        out.append(data + start, hit - start);
+        if (hit == size) break;
+        append_escaped_byte(out, static_cast<unsigned char>(data[hit]));
+        start = hit + 1;
+    }
+}
+
+inline void append_escaped(std::string& out, std::string_view in) {
+    append_escaped(out, in, best_find());
+}
+
+} // namespace json_escape